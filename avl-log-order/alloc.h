@@ -4,13 +4,165 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef TREE_NUMA
+#include <numa.h>
+#endif
+
 #define XMALLOC(var,N) \
 	do { \
-		var = malloc(N * sizeof(*(var))); \
+		var = malloc((N) * sizeof(*(var))); \
 		if (!(var)) { \
 			fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__); \
 			exit(1); \
 		} \
 	} while(0)
 
+#define XMALLOC_ALIGNED(var,N,align) \
+	do { \
+		if (posix_memalign((void **)&(var), align, (N) * sizeof(*(var))) != 0) { \
+			fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__); \
+			exit(1); \
+		} \
+	} while(0)
+
+/*
+ * Placement of node memory on NUMA machines, built with -DTREE_NUMA and
+ * linked with -lnuma. NODE_ALLOC_LOCAL binds the memory to the node of the
+ * calling thread and NODE_ALLOC_INTERLEAVED spreads its pages round-robin
+ * over all nodes. Without TREE_NUMA, or on a single node, all placements
+ * fall back to NODE_ALLOC_DEFAULT, i.e. malloc and the kernel's first-touch
+ * policy.
+ */
+#define NODE_ALLOC_DEFAULT 0
+#define NODE_ALLOC_LOCAL 1
+#define NODE_ALLOC_INTERLEAVED 2
+#define NODE_ALLOC_ALIGN 64
+
+/* Number of NUMA nodes that placements can choose from, 1 if none. */
+static inline int node_alloc_nr_nodes(void)
+{
+#ifdef TREE_NUMA
+	if (numa_available() >= 0)
+		return numa_num_configured_nodes();
+#endif
+	return 1;
+}
+
+/* Cache-line aligned memory that is never freed, e.g. a slab. */
+static inline void *node_alloc(size_t size, int placement)
+{
+	void *ret;
+
+#ifdef TREE_NUMA
+	if (placement != NODE_ALLOC_DEFAULT && node_alloc_nr_nodes() > 1) {
+		ret = (placement == NODE_ALLOC_LOCAL) ? numa_alloc_local(size) :
+		                                        numa_alloc_interleaved(size);
+		if (ret == NULL) {
+			fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+			exit(1);
+		}
+		return ret;
+	}
+#endif
+	if (posix_memalign(&ret, NODE_ALLOC_ALIGN, size) != 0) {
+		fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+		exit(1);
+	}
+	return ret;
+}
+
+/*
+ * Per-thread node pool.
+ * Objects are carved out of cache-line aligned slabs and recycled through a
+ * private free list, so the owning thread never takes a malloc arena lock
+ * on the fast path. Objects of up to half a cache line are packed at the
+ * next power of two of their size, so that none straddles a cache line;
+ * larger ones are rounded up to whole cache lines. Objects may be freed
+ * into any pool of the same object size. Slabs are never returned to the
+ * system. They are placed with node_alloc, a NODE_ALLOC_LOCAL slab on the
+ * node of the thread that allocates it.
+ */
+#define NODE_POOL_ALIGN NODE_ALLOC_ALIGN
+#define NODE_POOL_SLAB_SIZE (256 * 1024)
+
+typedef struct node_pool_obj {
+	struct node_pool_obj *next;
+} node_pool_obj_t;
+
+typedef struct {
+	size_t obj_size;
+	node_pool_obj_t *free_list;
+	char *slab_cur, *slab_end;
+	int placement;			//> NODE_ALLOC_* of the slabs
+
+	unsigned long nr_allocs;	//> Objects handed out
+	unsigned long nr_frees;		//> Objects given back to the pool
+	unsigned long nr_recycled;	//> Allocations served from the free list
+	unsigned long nr_slabs;		//> Slabs requested from the system
+} node_pool_t;
+
+static inline void node_pool_init(node_pool_t *pool, size_t obj_size, int placement)
+{
+	size_t align = NODE_POOL_ALIGN;
+
+	while (align / 2 >= obj_size && align / 2 >= sizeof(node_pool_obj_t))
+		align /= 2;
+	pool->obj_size = (obj_size + align - 1) & ~(align - 1);
+	pool->free_list = NULL;
+	pool->slab_cur = NULL;
+	pool->slab_end = NULL;
+	pool->placement = placement;
+	pool->nr_allocs = 0;
+	pool->nr_frees = 0;
+	pool->nr_recycled = 0;
+	pool->nr_slabs = 0;
+}
+
+static inline void *node_pool_alloc(node_pool_t *pool)
+{
+	void *ret;
+
+	pool->nr_allocs++;
+	if (pool->free_list != NULL) {
+		ret = pool->free_list;
+		pool->free_list = pool->free_list->next;
+		pool->nr_recycled++;
+		return ret;
+	}
+
+	if (pool->slab_cur + pool->obj_size > pool->slab_end) {
+		char *slab = node_alloc(NODE_POOL_SLAB_SIZE, pool->placement);
+		pool->slab_cur = slab;
+		pool->slab_end = slab + NODE_POOL_SLAB_SIZE;
+		pool->nr_slabs++;
+	}
+	ret = pool->slab_cur;
+	pool->slab_cur += pool->obj_size;
+	return ret;
+}
+
+static inline void node_pool_free(node_pool_t *pool, void *obj)
+{
+	node_pool_obj_t *o = obj;
+
+	o->next = pool->free_list;
+	pool->free_list = o;
+	pool->nr_frees++;
+}
+
+static inline void node_pool_stats_add(node_pool_t *p1, node_pool_t *p2, node_pool_t *dst)
+{
+	dst->nr_allocs = p1->nr_allocs + p2->nr_allocs;
+	dst->nr_frees = p1->nr_frees + p2->nr_frees;
+	dst->nr_recycled = p1->nr_recycled + p2->nr_recycled;
+	dst->nr_slabs = p1->nr_slabs + p2->nr_slabs;
+}
+
+static inline void node_pool_stats_print(node_pool_t *pool, const char *name)
+{
+	printf("  %s: allocs %lu frees %lu recycled %lu slabs %lu (%lu KB)\n",
+	       name, pool->nr_allocs, pool->nr_frees, pool->nr_recycled, pool->nr_slabs,
+	       pool->nr_slabs * NODE_POOL_SLAB_SIZE / 1024);
+}
+
 #endif /* ALLOC_H */
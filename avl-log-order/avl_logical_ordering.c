@@ -1,133 +1,534 @@
-#include <pthread.h> //> pthread_spinlock_t
+#include <pthread.h>
 #include <limits.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "alloc.h"
+#include "atomics.h"
+#include "epoch.h"
+#include "key.h"
+#include "lock.h"
+#include "snapshot.h"
+#include "checkpoint.h"
+#include "wal.h"
+#include "contention.h"
 
 #define CACHE_LINE_SIZE 64
-#define MINVAL -999999
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
-#define GET_BALANCE_FACTOR(node) ( node->leftHeight - node->rightHeight )
+#define GET_BALANCE_FACTOR(node) ( SIDE(node)->leftHeight - SIDE(node)->rightHeight )
+
+/*
+ * With compact node locks the small fields are narrowed as well, so that the
+ * node fits in a single cache line (AVL heights stay far below 127).
+ * -DAVL_ORDER_STATS adds the size of the node's subtree for rank and select;
+ * with NODE_LOCK_TTAS the node still fits in 64 bytes.
+ *
+ * -DNODE_SPLIT splits every node in two. The hot part holds the fields of the
+ * descent: 32 bytes with int keys, two nodes per cache line. All other
+ * fields live in the cold part, which comes from a separate pool.
+ * COLD(node) reaches the cold fields in both layouts.
+ *
+ * -DNODE_SIDE_LOCKS is the read-optimized layout: the fields that every update
+ * writes, the two locks, the heights and the size, move to a side part of
+ * one cache line that lookups never read. SIDE(node) reaches them in all
+ * layouts. It combines with NODE_SPLIT.
+ *
+ * -DTREE_SNAPSHOT adds the insert and delete times of the node for the
+ * snapshots of snapshot.h, 16 bytes that no longer fit in one cache line
+ * unless the node is split.
+ */
+#ifdef NODE_LOCK_COMPACT
+typedef signed char avl_height_t;
+#else
+typedef int avl_height_t;
+#endif
+
+#ifdef NODE_SIDE_LOCKS
+typedef struct {
+	avl_height_t leftHeight;
+	avl_height_t rightHeight;
+#ifdef AVL_ORDER_STATS
+	int size;			//> Number of nodes in the subtree rooted here
+#endif
+	node_lock_t succLock;
+	node_lock_t treeLock;
+} __attribute__((aligned(CACHE_LINE_SIZE))) avl_node_side_t;
+
+#define NODE_NR_SIDE_POOLS 1
+#else
+#define NODE_NR_SIDE_POOLS 0
+#endif
+
+#ifdef NODE_SPLIT
+struct avl_node;
+
+typedef struct {
+#ifdef NODE_SIDE_LOCKS
+	avl_node_side_t *side;
+#else
+	avl_height_t leftHeight;
+	avl_height_t rightHeight;
+#ifdef AVL_ORDER_STATS
+	int size;			//> Number of nodes in the subtree rooted here
+#endif
+	node_lock_t succLock;
+	node_lock_t treeLock;
+#endif
+#ifdef TREE_SNAPSHOT
+	snapshot_ts_t ins_ts, del_ts;	//> See snapshot.h
+#endif
 
-typedef struct avl_node {
-	int key;
-	int valid; 			//> Valid = 1 => node exists, otherwise valid = 0
 	struct avl_node *pred;
 	struct avl_node *succ;
 	struct avl_node *parent;
+	tree_value_t value;
+} __attribute__((aligned(CACHE_LINE_SIZE))) avl_node_cold_t;
+
+typedef struct avl_node {
+	tree_key_t key;
+	node_version_t version;		//> Deleted flag and write counter, see atomics.h
 	struct avl_node *link[2];
-	int leftHeight;
-	int rightHeight;
-	void *value;
+	avl_node_cold_t *cold;
+} avl_node_t;
+
+#define COLD(node) ((node)->cold)
+#define NODE_NR_POOLS (2 + NODE_NR_SIDE_POOLS)
+#else
+typedef struct avl_node {
+	tree_key_t key;
+	node_version_t version;		//> Deleted flag and write counter, see atomics.h
+#ifdef NODE_SIDE_LOCKS
+	avl_node_side_t *side;
+#else
+	avl_height_t leftHeight;
+	avl_height_t rightHeight;
+#ifdef AVL_ORDER_STATS
+	int size;			//> Number of nodes in the subtree rooted here
+#endif
+	node_lock_t succLock;
+	node_lock_t treeLock;
+#endif
+#ifdef TREE_SNAPSHOT
+	snapshot_ts_t ins_ts, del_ts;	//> See snapshot.h
+#endif
 
-	pthread_spinlock_t succLock;
-	pthread_spinlock_t treeLock;
+	struct avl_node *pred;
+	struct avl_node *succ;
+	struct avl_node *parent;
+	struct avl_node *link[2];
+	tree_value_t value;
 
-	// FILL the padding
-	char padding[2 * CACHE_LINE_SIZE - 4 * sizeof(int) -
-	             5 * sizeof(struct avl_node *) - sizeof(void *) - 2 * sizeof(pthread_spinlock_t)];
+	//> The aligned attribute pads the node to a multiple of CACHE_LINE_SIZE
 } __attribute__((aligned(CACHE_LINE_SIZE))) avl_node_t;
 
+#define COLD(node) (node)
+#define NODE_NR_POOLS (1 + NODE_NR_SIDE_POOLS)
+#endif
+
+#ifdef NODE_SIDE_LOCKS
+#define SIDE(node) (COLD(node)->side)
+#else
+#define SIDE(node) COLD(node)
+#endif
+
+#define RELAXED_NR_SHARDS 64
+#define RELAXED_SHARD_SIZE 256
+#define RELAXED_IDLE_US 50		//> Sleep of a maintenance thread that found no work
+
+/*
+ * Relaxed rebalancing (avl_maintenance_start). Updates record the key of the
+ * node whose subtree height may have changed in one of the shards, chosen by
+ * key, and maintenance threads rebalance from there. Keys instead of node
+ * pointers are recorded, so a node deleted in the meantime is simply not
+ * found again and epoch reclamation is not affected. An update whose shard is
+ * full rebalances inline.
+ */
 typedef struct {
-	avl_node_t *root;
+	node_lock_t lock;
+	int nr;
+	unsigned long nr_deferred;	//> Violations handed to the maintenance threads
+	unsigned long nr_full;		//> Updates that rebalanced inline, shard full
+	tree_key_t keys[RELAXED_SHARD_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE))) avl_relaxed_shard_t;
+
+typedef struct {
+	pthread_t tid;
+	struct avl *avl;
+	int id;				//> Drains the shards id, id + nr_threads, ...
+} avl_maintenance_thread_t;
+
+typedef struct {
+	int enabled;			//> Updates defer rebalancing while set
+	int stop;
+	int nr_threads;
+	avl_maintenance_thread_t *threads;
+	avl_relaxed_shard_t shards[RELAXED_NR_SHARDS];
+} avl_relaxed_t;
+
+#define LOOKUP_BATCH_WIDTH 8		//> Descents in flight in *_lookup_batch
+#define TOP_MAX_LEVELS 16
+
+/*
+ * Read-only copy of the top levels of the tree (avl_top_cache_start): the
+ * nodes in key order, each with its depth below root->link[0]. A descent
+ * starts from the deepest snapshot node on its path instead of the root, so
+ * the nodes that rotations near the root keep writing are not read by every
+ * operation. A snapshot whose node was deleted or rotated down is marked
+ * dead and is no longer used; the node is retired only afterwards.
+ */
+typedef struct {
+	int dead;
+	int nr;
+	tree_key_t *keys;
+	avl_node_t **nodes;
+	unsigned char *depths;
+} avl_top_t;
 
+typedef struct {
+	int enabled;			//> Deletes and rotations look for their node while set
+	int stop;
+	int levels;
+	int period_ms;
+	pthread_t tid;
+	avl_top_t *pending;		//> Built and not yet validated, see _avl_top_publish
+	epoch_thread_t retired;		//> Replaced snapshots, freed after a grace period
+	unsigned long nr_published, nr_discarded, nr_dead;
+} avl_top_cache_t;
+
+typedef struct avl {
+	avl_node_t *root;
+	avl_relaxed_t *relaxed;		//> NULL until relaxed rebalancing is first enabled
+	avl_top_t *top;			//> Current snapshot, NULL if none
+	avl_top_cache_t *top_cache;	//> NULL until the snapshot is first enabled
+	size_counter_t size;
+#ifdef TREE_SNAPSHOT
+	snapshot_domain_t snapshot;	//> Point-in-time copies, see avl_snapshot_open
+#endif
+	wal_t *wal;			//> Write-ahead log, NULL unless avl_wal_start
+	contention_t cm;		//> Policy of the lock retry loops, see avl_contention
 } avl_t;
 
-static avl_node_t *avl_node_new(int key, void *value, avl_node_t *pred, avl_node_t *succ, avl_node_t *parent)
+#define STATS_LOOKUP 0
+#define STATS_INSERT 1
+#define STATS_DELETE 2
+#define STATS_GET 3
+#define STATS_UPDATE 4		//> put, put_if_absent and compute_if_present
+#define STATS_SCAN 5
+#define STATS_ORDER 6		//> ceiling, floor, next, prev, min, max and cursor steps
+#define STATS_NR_OPS 7
+
+/*
+ * Per-thread statistics, compiled in with -DTREE_STATS. The helpers do not
+ * see the thread data, so _avl_enter points avl_stats at the counters of the
+ * calling thread.
+ */
+typedef struct {
+	unsigned long nr_ops[STATS_NR_OPS];
+	unsigned long nr_restarts;		//> Validation failures that restart a search
+	unsigned long nr_trylock_fails;		//> Failed trylocks in acquireTreeLocks
+	unsigned long nr_rebalance_restarts;	//> restart() calls of rebalance
+	unsigned long nr_yields;		//> sched_yield calls of the contention manager
+	unsigned long nr_rotations;
+	unsigned long nr_locates;		//> Descents followed by the pred/succ fixup
+	unsigned long nr_fixup_hops;		//> pred/succ hops of those fixups
+	unsigned long nr_fast_inserts;		//> Inserts linked by _avl_insert_fast
+	unsigned long nr_slow_inserts;		//> Inserts linked under the full protocol
+} __attribute__((aligned(CACHE_LINE_SIZE))) avl_stats_t;
+
+#ifdef TREE_STATS
+static __thread avl_stats_t *avl_stats;
+#define STATS_ADD(field, n) do { if (avl_stats != NULL) avl_stats->field += (n); } while(0)
+#else
+#define STATS_ADD(field, n) do { } while(0)
+#endif
+#define STATS_INC(field) STATS_ADD(field, 1)
+
+static __thread int avl_tid;		//> tid of the thread data of the current operation
+
+typedef struct {
+	int tid;
+	epoch_thread_t epoch;		//> Per-thread state of the reclamation scheme
+	node_pool_t pool[NODE_NR_POOLS];	//> Nodes (and cold and side parts) allocated and reclaimed by this thread
+#ifdef TREE_STATS
+	avl_stats_t stats;
+#endif
+	void *next_free;		//> Next in avl_free_data once released
+} __attribute__((aligned(CACHE_LINE_SIZE))) avl_thread_data_t;
+
+/*
+ * Iteration state of avl_cursor_*. node is the next candidate along the succ
+ * chain; the cursor keeps the epoch of its thread entered, so node cannot be
+ * reclaimed while the cursor is open.
+ */
+typedef struct {
+	avl_t *avl;
+	avl_thread_data_t *data;
+	avl_node_t *node;
+} avl_cursor_t;
+
+static epoch_domain_t avl_epoch;	//> Shared by all avl_t instances
+
+/*
+ * Thread data released with avl_thread_data_free. Its epoch record cannot
+ * leave avl_epoch, so the whole thread data, with its pools and the nodes
+ * still pending in its limbo bags, is handed to the next avl_thread_data_new.
+ */
+static avl_thread_data_t *avl_free_data;
+static pthread_mutex_t avl_free_data_lock = PTHREAD_MUTEX_INITIALIZER;
+static int numa_policy = NUMA_POLICY_FIRST_TOUCH;	//> See avl_numa_policy
+
+/*
+ * Pools of the operations without thread data, see _avl_enter. The nodes
+ * they unlink may come from the pool of any thread or from a bulk_load
+ * array, so they are recycled here rather than handed to free().
+ */
+static node_pool_t avl_fallback_pool[NODE_NR_POOLS];
+static int avl_fallback_ready;
+static pthread_mutex_t avl_fallback_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define UPDATE_NONE 0		//> Only report the value of the existing node
+#define UPDATE_PUT 1		//> Overwrite the value of the existing node
+#define UPDATE_COMPUTE 2	//> Replace the value with fn(key, value, arg)
+
+/* What _avl_insert_helper does when the key already exists. */
+typedef struct {
+	int op;
+	tree_value_t value;		//> New value for UPDATE_PUT
+	compute_fn_t fn;		//> Update function for UPDATE_COMPUTE
+	void *arg;
+
+	int found;			//> Set when the key already existed
+	tree_value_t old_value;		//> Value of the existing node before the update
+} avl_update_t;
+
+static void avl_pool_init(node_pool_t *pool, int placement)
+{
+	node_pool_init(&pool[0], sizeof(avl_node_t), placement);
+#ifdef NODE_SPLIT
+	node_pool_init(&pool[1], sizeof(avl_node_cold_t), placement);
+#endif
+#ifdef NODE_SIDE_LOCKS
+	node_pool_init(&pool[NODE_NR_POOLS - 1], sizeof(avl_node_side_t), placement);
+#endif
+}
+
+/* pool is NULL or points to NODE_NR_POOLS pools, see avl_pool_init. */
+static avl_node_t *avl_node_new(node_pool_t *pool, tree_key_t key, tree_value_t value, avl_node_t *pred, avl_node_t *succ, avl_node_t *parent)
 {
         avl_node_t *ret;
 
-        XMALLOC(ret, 1);
+        if (pool != NULL)
+                ret = node_pool_alloc(&pool[0]);
+        else
+                XMALLOC_ALIGNED(ret, 1, CACHE_LINE_SIZE);
+#ifdef NODE_SPLIT
+	if (pool != NULL)
+		ret->cold = node_pool_alloc(&pool[1]);
+	else
+		XMALLOC_ALIGNED(ret->cold, 1, CACHE_LINE_SIZE);
+#endif
+#ifdef NODE_SIDE_LOCKS
+	if (pool != NULL)
+		SIDE(ret) = node_pool_alloc(&pool[NODE_NR_POOLS - 1]);
+	else
+		XMALLOC_ALIGNED(SIDE(ret), 1, CACHE_LINE_SIZE);
+#endif
         ret->key = key;
-	ret->valid = 1;
-	ret->pred = pred;
-	ret->succ = succ;
-	ret->parent = parent;
+	ret->version = 0;		//> Valid, no writes yet
+	COLD(ret)->pred = pred;
+	COLD(ret)->succ = succ;
+	COLD(ret)->parent = parent;
 	ret->link[0] = NULL;
 	ret->link[1] = NULL;
-	ret->leftHeight = 0;
-	ret->rightHeight = 0;
-        ret->value = value;
-
-	pthread_spin_init(&ret->succLock, PTHREAD_PROCESS_SHARED);
-	pthread_spin_init(&ret->treeLock, PTHREAD_PROCESS_SHARED);
+	SIDE(ret)->leftHeight = 0;
+	SIDE(ret)->rightHeight = 0;
+#ifdef AVL_ORDER_STATS
+	SIDE(ret)->size = 1;
+#endif
+        COLD(ret)->value = value;
+
+	node_lock_init(&SIDE(ret)->succLock);
+	node_lock_init(&SIDE(ret)->treeLock);
+#ifdef TREE_SNAPSHOT
+	COLD(ret)->ins_ts = SNAPSHOT_TS_PENDING;
+	COLD(ret)->del_ts = SNAPSHOT_TS_PENDING;
+#endif
 
         return ret;
 }
 
+static void avl_node_free(node_pool_t *pool, avl_node_t *node)
+{
+#ifdef NODE_SIDE_LOCKS
+	if (pool != NULL)
+		node_pool_free(&pool[NODE_NR_POOLS - 1], SIDE(node));
+	else
+		free(SIDE(node));
+#endif
+#ifdef NODE_SPLIT
+	if (pool != NULL)
+		node_pool_free(&pool[1], node->cold);
+	else
+		free(node->cold);
+#endif
+	if (pool != NULL)
+		node_pool_free(&pool[0], node);
+	else
+		free(node);
+}
+
 avl_t *_avl_new_helper()
 {
 	avl_t *avl;
 	avl_node_t *parent;
 	
-	parent = avl_node_new(MINVAL, NULL, NULL, NULL, NULL);
-	XMALLOC(avl, 1);
-	avl->root = avl_node_new(INT_MAX, NULL, parent, parent, parent);
-	avl->root->parent = parent;
+	parent = avl_node_new(NULL, KEY_MIN, VALUE_NONE, NULL, NULL, NULL);
+	XMALLOC_ALIGNED(avl, 1, CACHE_LINE_SIZE);
+	size_counter_init(&avl->size);
+#ifdef TREE_SNAPSHOT
+	snapshot_domain_init(&avl->snapshot);
+#endif
+	avl->relaxed = NULL;
+	avl->top = NULL;
+	avl->wal = NULL;
+	contention_init(&avl->cm);
+	avl->top_cache = NULL;
+	avl->root = avl_node_new(NULL, KEY_MAX, VALUE_NONE, parent, parent, parent);
+	COLD(avl->root)->parent = parent;
 	parent->link[1] = avl->root; 		//> Right child
-	parent->succ = avl->root;
-	parent->pred = avl->root;
-	parent->parent = avl->root;
+	COLD(parent)->succ = avl->root;
+	COLD(parent)->pred = avl->root;
+	COLD(parent)->parent = avl->root;
 	parent->link[0] = avl->root;
 
 	return avl;
 }
 
-static avl_node_t *lockParent(avl_node_t * node)
+/*
+ * Stamp the insert and the delete of node for the snapshots of
+ * -DTREE_SNAPSHOT, see snapshot.h.
+ */
+static inline void _avl_snapshot_insert(avl_t *avl, avl_node_t *node)
+{
+#ifdef TREE_SNAPSHOT
+	snapshot_stamp(&avl->snapshot, &COLD(node)->ins_ts);
+#endif
+}
+
+static inline void _avl_snapshot_delete(avl_t *avl, avl_node_t *node)
+{
+#ifdef TREE_SNAPSHOT
+	snapshot_delete(&avl->snapshot, node->key, COLD(node)->value, &COLD(node)->ins_ts,
+	                &COLD(node)->del_ts);
+#endif
+}
+
+/*
+ * Stamp the updates of node that a lookup or get observed, valid being what
+ * it read of the deleted flag. Returns valid.
+ */
+static inline int _avl_snapshot_read(avl_t *avl, avl_node_t *node, int valid)
+{
+#ifdef TREE_SNAPSHOT
+	snapshot_observe(&avl->snapshot, !valid, &COLD(node)->ins_ts, &COLD(node)->del_ts);
+#endif
+	return valid;
+}
+
+/*
+ * Log an insert, value update (WAL_INSERT) or delete of node if
+ * avl_wal_start is on. Called with the locks of the linearization point
+ * still held, see wal.h.
+ */
+static inline void _avl_wal_append(avl_t *avl, int op, avl_node_t *node)
+{
+	wal_t *wal = LOAD_ACQ(avl->wal);
+
+	if(wal != NULL)
+		wal_append(wal, avl_tid, op, node->key, COLD(node)->value);
+}
+
+/* cm_end, counting the yields of the loop. */
+static inline void _avl_cm_end(cm_retry_t *r)
+{
+	STATS_ADD(nr_yields, r->nr_yields);
+	cm_end(r);
+}
+
+static avl_node_t *lockParent(avl_t *avl, avl_node_t * node)
 {	
-	avl_node_t *parent = node->parent;		
-	pthread_spin_lock(&parent->treeLock);
-
-	while ((node->parent != parent) || !parent->valid) {
-		pthread_spin_unlock(&parent->treeLock);
-		parent = node->parent;
-		while(!parent->valid){
-			parent = node->parent;
+	avl_node_t *parent = LOAD_ACQ(COLD(node)->parent);
+	cm_retry_t r;
+
+	cm_begin(&r, &avl->cm);
+	cm_lock(&r, &SIDE(parent)->treeLock);
+
+	while ((LOAD(COLD(node)->parent) != parent) || !NODE_VALID(parent)) {
+		node_unlock(&SIDE(parent)->treeLock);
+		parent = LOAD_ACQ(COLD(node)->parent);
+		while(!NODE_VALID(parent)){		//> Wait for the delete of parent to move node
+			cm_wait(&r);
+			parent = LOAD_ACQ(COLD(node)->parent);
 		}
-		pthread_spin_lock(&parent->treeLock);
+		cm_lock(&r, &SIDE(parent)->treeLock);
 	}
 
+	_avl_cm_end(&r);
 	return parent;
 }
 
-static int acquireTreeLocks(avl_node_t *node)
+static int acquireTreeLocks(avl_t *avl, avl_node_t *node)
 {
+	cm_retry_t r;
+
+	cm_begin(&r, &avl->cm);
 	while(1){
-		pthread_spin_lock(&node->treeLock);
+		cm_lock(&r, &SIDE(node)->treeLock);
 		avl_node_t *left = node->link[0];
 		avl_node_t *right = node->link[1];
 
 		if(left == NULL || right == NULL){		//> node is a leaf or has a single child
-			if(left != NULL && pthread_spin_trylock(&left->treeLock) != 0){	//> fail lock
-				pthread_spin_unlock(&node->treeLock);
+			if(left != NULL && node_trylock(&SIDE(left)->treeLock) != 0){	//> fail lock
+				STATS_INC(nr_trylock_fails);
+				node_unlock(&SIDE(node)->treeLock);
+				cm_wait(&r);
 				continue;
 			}
-			if(right != NULL && pthread_spin_trylock(&right->treeLock) != 0){
-				pthread_spin_unlock(&node->treeLock);
+			if(right != NULL && node_trylock(&SIDE(right)->treeLock) != 0){
+				STATS_INC(nr_trylock_fails);
+				node_unlock(&SIDE(node)->treeLock);
+				cm_wait(&r);
 				continue;
 			}
+			_avl_cm_end(&r);
 			return 0;				//> 0 => false (node hasn't two children)
 		}
 		
 		// n has two children
-		avl_node_t *s = node->succ;
-		avl_node_t *parent = s->parent;
+		avl_node_t *s = COLD(node)->succ;
+		avl_node_t *parent = LOAD_ACQ(COLD(s)->parent);
 
 		if(parent != node){		
-			if(pthread_spin_trylock(&parent->treeLock) != 0){
-				pthread_spin_unlock(&node->treeLock);
+			if(node_trylock(&SIDE(parent)->treeLock) != 0){
+				STATS_INC(nr_trylock_fails);
+				node_unlock(&SIDE(node)->treeLock);
+				cm_wait(&r);
 				continue;
 			}
-			if(parent != s->parent || !parent->valid){
-				pthread_spin_unlock(&parent->treeLock);
-				pthread_spin_unlock(&node->treeLock);
+			if(parent != LOAD(COLD(s)->parent) || !NODE_VALID(parent)){
+				node_unlock(&SIDE(parent)->treeLock);
+				node_unlock(&SIDE(node)->treeLock);
+				cm_wait(&r);
 				continue;
 			}
 		}
 
-		if(pthread_spin_trylock(&s->treeLock) != 0){
-			pthread_spin_unlock(&node->treeLock);
+		if(node_trylock(&SIDE(s)->treeLock) != 0){
+			STATS_INC(nr_trylock_fails);
+			node_unlock(&SIDE(node)->treeLock);
 			if(parent != node)		
-				pthread_spin_unlock(&parent->treeLock);
+				node_unlock(&SIDE(parent)->treeLock);
+			cm_wait(&r);
 			continue;
 		}
 		
@@ -137,101 +538,274 @@ static int acquireTreeLocks(avl_node_t *node)
 		 * it may have right child
 		 */
 		avl_node_t *sRight = s->link[1];
-		if(sRight != NULL && pthread_spin_trylock(&sRight->treeLock) != 0){
-			pthread_spin_unlock(&node->treeLock);
-			pthread_spin_unlock(&s->treeLock);
+		if(sRight != NULL && node_trylock(&SIDE(sRight)->treeLock) != 0){
+			STATS_INC(nr_trylock_fails);
+			node_unlock(&SIDE(node)->treeLock);
+			node_unlock(&SIDE(s)->treeLock);
 			if(parent != node)		
-				pthread_spin_unlock(&parent->treeLock);
+				node_unlock(&SIDE(parent)->treeLock);
+			cm_wait(&r);
 			continue;
 		}
+		_avl_cm_end(&r);
 		return 1;				//> 1 => true (it has two children)
 	}
 }
 
+/*
+ * ch may not be locked (e.g. the child of a removed node), so its heights
+ * are read atomically. Heights are only ever written under the treeLock of
+ * their node.
+ */
 static int updateHeight(avl_node_t *ch, avl_node_t *node, int isLeft)
 {
-	int newHeight = ch == NULL? 0: MAX(ch->leftHeight, ch->rightHeight) + 1;
-	int oldHeight = isLeft? node->leftHeight : node->rightHeight;
+	int newHeight = ch == NULL? 0: MAX(LOAD(SIDE(ch)->leftHeight), LOAD(SIDE(ch)->rightHeight)) + 1;
+	int oldHeight = isLeft? SIDE(node)->leftHeight : SIDE(node)->rightHeight;
 	if(newHeight == oldHeight) return 0;	
 	if(isLeft)
-		node->leftHeight = newHeight;
+		STORE(SIDE(node)->leftHeight, newHeight);
 	else
-		node->rightHeight = newHeight;
+		STORE(SIDE(node)->rightHeight, newHeight);
 	
 	return 1;
 }
 
-static int restart(avl_node_t *node, avl_node_t *parent)
+#ifdef AVL_ORDER_STATS
+#define SUBTREE_SIZE(node) ((node) == NULL ? 0 : LOAD(SIDE(node)->size))
+
+/*
+ * Recomputes the size of node, whose treeLock is held, from its children.
+ * A child of the other side may not be locked and may have a pending change
+ * itself; its own update then passes through node again later. Returns 1 if
+ * the size changed.
+ */
+static int updateSize(avl_node_t *node)
+{
+	int newSize = SUBTREE_SIZE(LOAD(node->link[0])) + SUBTREE_SIZE(LOAD(node->link[1])) + 1;
+
+	if(newSize == SIDE(node)->size) return 0;
+	STORE(SIDE(node)->size, newSize);
+	return 1;
+}
+#endif
+
+static int restart(avl_t *avl, avl_node_t *node, avl_node_t *parent)
 {
+	cm_retry_t r;
+
+	STATS_INC(nr_rebalance_restarts);
 	if(parent != NULL)
-		pthread_spin_unlock(&parent->treeLock);
+		node_unlock(&SIDE(parent)->treeLock);
 
+	cm_begin(&r, &avl->cm);
 	while(1){ 
-		pthread_spin_unlock(&node->treeLock);
-		pthread_spin_lock(&node->treeLock);
-		if(!node->valid){
-			pthread_spin_unlock(&node->treeLock);
+		node_unlock(&SIDE(node)->treeLock);
+		cm_wait(&r);			//> Let the holder of the child's lock go on
+		cm_lock(&r, &SIDE(node)->treeLock);
+		if(!NODE_VALID(node)){
+			node_unlock(&SIDE(node)->treeLock);
+			_avl_cm_end(&r);
 			return 0;
 		}
 		avl_node_t *child = GET_BALANCE_FACTOR(node) >= 2? node->link[0] : node->link[1];
-		if(child == NULL) return 1;
-		if(pthread_spin_trylock(&child->treeLock) == 0) return 1;	// success
+		if(child == NULL || node_trylock(&SIDE(child)->treeLock) == 0){	// success
+			_avl_cm_end(&r);
+			return 1;
+		}
 	}
 }
 
 static void rotate(avl_node_t *child, avl_node_t *node, avl_node_t *parent, int left)
 {
+	STATS_INC(nr_rotations);
 	if(parent->link[0] == node)
-		parent->link[0] = child;
+		STORE_REL(parent->link[0], child);
 	else
-		parent->link[1] = child;
+		STORE_REL(parent->link[1], child);
 	
-	child->parent = parent;		
-	node->parent = child;
+	STORE_REL(COLD(child)->parent, parent);
+	STORE_REL(COLD(node)->parent, child);
 
 	avl_node_t *grandChild = left? child->link[0] : child->link[1];
 	if(left){
-		node->link[1] = grandChild;
+		STORE_REL(node->link[1], grandChild);
 		if(grandChild != NULL){
-			grandChild->parent = node; 
+			STORE_REL(COLD(grandChild)->parent, node);
 		}
-		child->link[0] = node;
-		node->rightHeight = child->leftHeight;
-		child->leftHeight = MAX(node->leftHeight, node->rightHeight) + 1;
+		STORE_REL(child->link[0], node);
+		STORE(SIDE(node)->rightHeight, SIDE(child)->leftHeight);
+		STORE(SIDE(child)->leftHeight, MAX(SIDE(node)->leftHeight, SIDE(node)->rightHeight) + 1);
 	}else{
-		node->link[0] = grandChild;
+		STORE_REL(node->link[0], grandChild);
 		if(grandChild != NULL){
-			grandChild->parent = node; 
+			STORE_REL(COLD(grandChild)->parent, node);
 		}
-		child->link[1] = node;
-		node->leftHeight = child->rightHeight;
-		child->rightHeight = MAX(node->leftHeight, node->rightHeight) + 1;
+		STORE_REL(child->link[1], node);
+		STORE(SIDE(node)->leftHeight, SIDE(child)->rightHeight);
+		STORE(SIDE(child)->rightHeight, MAX(SIDE(node)->leftHeight, SIDE(node)->rightHeight) + 1);
+	}
+#ifdef AVL_ORDER_STATS
+	updateSize(node);
+	updateSize(child);
+#endif
+}
+
+/*
+ * Records that the height of key's node may be stale, in relaxed mode.
+ * Returns 0 if the caller has to rebalance inline. Either way, the heights
+ * of the node that the caller changed must match its children: a side
+ * height is 0 if and only if that child is NULL, so that rebalance never
+ * picks a missing child, whichever other heights are still stale.
+ */
+static int _avl_defer(avl_t *avl, tree_key_t key)
+{
+	avl_relaxed_t *relaxed = LOAD_ACQ(avl->relaxed);
+	avl_relaxed_shard_t *shard;
+	int ret = 0;
+
+	if(relaxed == NULL || !LOAD_ACQ(relaxed->enabled))
+		return 0;
+
+	shard = &relaxed->shards[((unsigned long)key * 0x9e3779b97f4a7c15UL >> 32) % RELAXED_NR_SHARDS];
+	node_lock(&shard->lock);
+	if(shard->nr == RELAXED_SHARD_SIZE){
+		shard->nr_full++;
+	}else{
+		shard->keys[shard->nr] = key;
+		STORE(shard->nr, shard->nr + 1);
+		shard->nr_deferred++;
+		ret = 1;
+	}
+	node_unlock(&shard->lock);
+
+	return ret;
+}
+
+/* Index of the last snapshot key <= key, -1 if there is none. */
+static inline int _avl_top_search(avl_top_t *top, tree_key_t key)
+{
+	const tree_key_t *base = top->keys;
+	int half, n = top->nr;
+
+	while(n > 1){
+		half = n / 2;
+		base = (base[half] <= key) ? base + half : base;	//> cmov, no branch
+		n -= half;
+	}
+	return (base - top->keys) + (*base <= key) - 1;
+}
+
+/*
+ * Node to start the descent for key from. Between two neighbouring snapshot
+ * keys the path of key leaves the snapshot below the deeper of both nodes.
+ */
+static inline avl_node_t *_avl_top_start(avl_t *avl, tree_key_t key)
+{
+	avl_top_t *top = LOAD_ACQ(avl->top);
+	int i;
+
+	//> Pairs with the store of _avl_top_forget: a node read from a live
+	//> snapshot was retired after this thread entered its epoch
+	if(top == NULL || __atomic_load_n(&top->dead, __ATOMIC_SEQ_CST))
+		return avl->root;
+
+	i = _avl_top_search(top, key);
+	if(i < 0)
+		return top->nodes[0];
+	if(i == top->nr - 1 || top->keys[i] == key)
+		return top->nodes[i];
+	return (top->depths[i] > top->depths[i + 1]) ? top->nodes[i] : top->nodes[i + 1];
+}
+
+static inline void _avl_top_kill(avl_top_t *top, avl_node_t *node)
+{
+	int i;
+
+	if(top == NULL || LOAD(top->dead))
+		return;
+	i = _avl_top_search(top, node->key);
+	if(i >= 0 && top->nodes[i] == node)
+		__atomic_store_n(&top->dead, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Called for a node that a rotation moved down, whose subtree no longer
+ * covers the keys of the snapshot, and for a deleted node after it was
+ * unlinked and before it is retired. For the latter, the fence orders the
+ * deleted flag before the loads of the snapshots, and _avl_top_publish
+ * stores the pending snapshot before it checks the flags of its nodes:
+ * either this finds the snapshot or the rebuilder finds node deleted and
+ * drops it.
+ */
+static void _avl_top_forget(avl_t *avl, avl_node_t *node)
+{
+	avl_top_cache_t *cache = LOAD_ACQ(avl->top_cache);
+
+	if(cache == NULL || !LOAD(cache->enabled))
+		return;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	_avl_top_kill(LOAD_ACQ(cache->pending), node);	//> Cleared after top is set
+	_avl_top_kill(LOAD_ACQ(avl->top), node);
+}
+
+#define REBALANCE_PENDING 8
+
+/*
+ * Keys of nodes that a rebalance left unbalanced and could not defer, to be
+ * fixed once it has released its locks. keys points to local until more
+ * than REBALANCE_PENDING are added.
+ */
+typedef struct {
+	tree_key_t local[REBALANCE_PENDING];
+	tree_key_t *keys;
+	int nr, size;
+} avl_pending_t;
+
+static void _avl_pending_add(avl_pending_t *pending, tree_key_t key)
+{
+	tree_key_t *keys;
+
+	if(pending->nr == pending->size){
+		XMALLOC(keys, 2 * pending->size);
+		memcpy(keys, pending->keys, pending->nr * sizeof(*keys));
+		if(pending->keys != pending->local)
+			free(pending->keys);
+		pending->keys = keys;
+		pending->size *= 2;
 	}
+	pending->keys[pending->nr++] = key;
 }
 
-static void rebalance(avl_t *avl, avl_node_t *nod, avl_node_t *ch, int left)
+static void _avl_rebalance(avl_t *avl, avl_node_t *nod, avl_node_t *ch, int left, avl_pending_t *pending)
 {
 	avl_node_t *node = nod;
 	avl_node_t *child = ch;
 	int isLeft = left;
 
 	if(node == avl->root){
-		pthread_spin_unlock(&node->treeLock);
-		if(child != NULL) pthread_spin_unlock(&child->treeLock); 
+		node_unlock(&SIDE(node)->treeLock);
+		if(child != NULL) node_unlock(&SIDE(child)->treeLock); 
 			return;
 	}
 
 	avl_node_t *parent = NULL;
+	int rotatedAbove = 0;
 	while(node != avl->root){ 
-		int updated = updateHeight(child, node, isLeft);
+		int updated = updateHeight(child, node, isLeft) || rotatedAbove > 0;
+		if(rotatedAbove > 0)
+			rotatedAbove--;
+#ifdef AVL_ORDER_STATS
+		if(updateSize(node))
+			updated = 1;
+#endif
 		int bf = GET_BALANCE_FACTOR(node);
 		if(!updated && abs(bf) < 2) break;
 		while(bf >= 2 || bf <= -2){ 
 			if((isLeft && bf <= -2) || (!isLeft && bf >= 2)){ 
-				if(child != NULL) pthread_spin_unlock(&child->treeLock); 
+				if(child != NULL) node_unlock(&SIDE(child)->treeLock); 
 				child = isLeft? node->link[1] : node->link[0]; 
-				if(pthread_spin_trylock(&child->treeLock) != 0){ 
-					if(!restart(node, parent)){ 
+				if(node_trylock(&SIDE(child)->treeLock) != 0){ 
+					if(!restart(avl, node, parent)){ 
 						return;			
 					}
 					parent = NULL;
@@ -245,9 +819,9 @@ static void rebalance(avl_t *avl, avl_node_t *nod, avl_node_t *ch, int left)
 			
 			if((isLeft && GET_BALANCE_FACTOR(child) < 0) || (!isLeft && GET_BALANCE_FACTOR(child) > 0)){ 
 				avl_node_t *grandChild =  isLeft? child->link[1] : child->link[0]; 	
-				if(pthread_spin_trylock(&grandChild->treeLock) != 0){		//> fail lock
-					pthread_spin_unlock(&child->treeLock);
-					if(!restart(node, parent)){ 
+				if(node_trylock(&SIDE(grandChild)->treeLock) != 0){		//> fail lock
+					node_unlock(&SIDE(child)->treeLock);
+					if(!restart(avl, node, parent)){ 
 						return;			
 					}
 					parent = NULL;  
@@ -257,20 +831,26 @@ static void rebalance(avl_t *avl, avl_node_t *nod, avl_node_t *ch, int left)
 					continue;
 				}
 				rotate(grandChild, child, node, isLeft);
-				pthread_spin_unlock(&child->treeLock);
+				_avl_top_forget(avl, child);
+				if(abs(GET_BALANCE_FACTOR(child)) >= 2 &&	//> Only if grandChild was not balanced either
+				   !_avl_defer(avl, child->key))
+					_avl_pending_add(pending, child->key);
+				node_unlock(&SIDE(child)->treeLock);
 				child = grandChild;
 			}
 			
 			if(parent == NULL)
-				parent = lockParent(node);
+				parent = lockParent(avl, node);
 			
 			rotate(child, node, parent, isLeft ^ 0x0001);		
+			_avl_top_forget(avl, node);
 			bf = GET_BALANCE_FACTOR(node);
 			if(bf >= 2 || bf <= -2){
-				pthread_spin_unlock(&parent->treeLock);
+				node_unlock(&SIDE(parent)->treeLock);
 				parent = child;
 				child = NULL;
 				isLeft = bf >= 2? 0: 1; 			// enforces to lock child
+				rotatedAbove++;		//> Only with stale heights: every new parent up to the old one changed height too
 				continue;
 			}
 			avl_node_t *temp = child;
@@ -281,70 +861,111 @@ static void rebalance(avl_t *avl, avl_node_t *nod, avl_node_t *ch, int left)
 		}
 
 		if(child != NULL){
-			pthread_spin_unlock(&child->treeLock);
+			node_unlock(&SIDE(child)->treeLock);
 		}
 		child = node;
-		node = parent != NULL? parent: lockParent(node);
+		node = parent != NULL? parent: lockParent(avl, node);
 		isLeft = node->link[0] == child;
 		parent = NULL;	
 	}
 
 	if(child != NULL)
-		pthread_spin_unlock(&child->treeLock);
-	pthread_spin_unlock(&node->treeLock);
+		node_unlock(&SIDE(child)->treeLock);
+	node_unlock(&SIDE(node)->treeLock);
 	if (parent != NULL) 
-		pthread_spin_unlock(&parent->treeLock);
+		node_unlock(&SIDE(parent)->treeLock);
+}
+
+static int _avl_fix(avl_t *avl, tree_key_t key);
+
+/*
+ * Rebalances from node, whose child changed height, and releases the locks
+ * of both. A node that a double rotation left unbalanced (only with stale
+ * heights, in relaxed mode) is deferred, or fixed here once every lock is
+ * released if its shard is full.
+ */
+static void rebalance(avl_t *avl, avl_node_t *node, avl_node_t *child, int isLeft)
+{
+	avl_pending_t pending;
+	cm_retry_t r;
+	int i;
+
+	pending.keys = pending.local;
+	pending.nr = 0;
+	pending.size = REBALANCE_PENDING;
+	_avl_rebalance(avl, node, child, isLeft, &pending);
+
+	for(i = 0; i < pending.nr; i++){
+		cm_begin(&r, &avl->cm);
+		while(!_avl_fix(avl, pending.keys[i]))
+			cm_wait(&r);
+		_avl_cm_end(&r);
+	}
+	if(pending.keys != pending.local)
+		free(pending.keys);
 }
 
-static void removeFromTree(avl_t *avl, avl_node_t *node, int hasTwoChildren, avl_node_t *parent, avl_node_t *node_to_delete)
+static void removeFromTree(avl_t *avl, avl_node_t *node, int hasTwoChildren, avl_node_t *parent, avl_node_t **node_to_delete)
 {
+	avl_relaxed_t *relaxed;
+
 	if(hasTwoChildren == 0){			//> node is a leaf or has one single child
 		avl_node_t *child = (node->link[1] == NULL) ? node->link[0] : node->link[1];
 
 		//> UpdateChild
 		if(child != NULL)
-			child->parent = parent;
+			STORE_REL(COLD(child)->parent, parent);
 		int isLeft = 0;
 		if(parent->link[0] == node)
 			isLeft = 1;
 		if(isLeft)
-			parent->link[0] = child;
+			STORE_REL(parent->link[0], child);
 		else
-			parent->link[1] = child;
-
-		node_to_delete = node;
-		pthread_spin_unlock(&node->treeLock);
+			STORE_REL(parent->link[1], child);
+
+		*node_to_delete = node;
+		node_unlock(&SIDE(node)->treeLock);
+		if(parent != avl->root && _avl_defer(avl, parent->key)){
+			updateHeight(child, parent, isLeft);
+			if(child != NULL)
+				node_unlock(&SIDE(child)->treeLock);
+			node_unlock(&SIDE(parent)->treeLock);
+			return;
+		}
 		rebalance(avl, parent, child, isLeft);
 		return;
 	}
 		
-	avl_node_t *succ = node->succ;		
-	avl_node_t *oldParent = succ->parent;
+	avl_node_t *succ = COLD(node)->succ;		
+	avl_node_t *oldParent = COLD(succ)->parent;
 	avl_node_t *oldRight = succ->link[1];		//> oldRight may be NULL
 
 	//> UpdateChild
 	if(oldRight != NULL)
-		oldRight->parent = oldParent;
+		STORE_REL(COLD(oldRight)->parent, oldParent);
 	int left = 0;
 	if(oldParent->link[0] == succ)
 		left = 1;
 	if(left)
-		oldParent->link[0] = oldRight;
+		STORE_REL(oldParent->link[0], oldRight);
 	else
-		oldParent->link[1] = oldRight;
-
-	succ->leftHeight = node->leftHeight;
-	succ->rightHeight = node->rightHeight;
-	succ->parent = parent;
-	succ->link[0] = node->link[0];
-	succ->link[1] = node->link[1];
-	node->link[0]->parent = succ;
+		STORE_REL(oldParent->link[1], oldRight);
+
+	STORE(SIDE(succ)->leftHeight, SIDE(node)->leftHeight);
+	STORE(SIDE(succ)->rightHeight, SIDE(node)->rightHeight);
+#ifdef AVL_ORDER_STATS
+	STORE(SIDE(succ)->size, SIDE(node)->size);		//> Fixed up by the rebalance from oldParent
+#endif
+	STORE_REL(COLD(succ)->parent, parent);
+	STORE_REL(succ->link[0], node->link[0]);
+	STORE_REL(succ->link[1], node->link[1]);
+	STORE_REL(COLD(node->link[0])->parent, succ);
 	if(node->link[1] != NULL)		//> n.right  may be null
-		node->link[1]->parent = succ;
+		STORE_REL(COLD(node->link[1])->parent, succ);
 	if(parent->link[0] == node)
-		parent->link[0] = succ;
+		STORE_REL(parent->link[0], succ);
 	else
-		parent->link[1] = succ;
+		STORE_REL(parent->link[1], succ);
 
 	int isLeft = 0;
 	if(oldParent != node)
@@ -353,238 +974,855 @@ static void removeFromTree(avl_t *avl, avl_node_t *node, int hasTwoChildren, avl
 	if(!isLeft)
 		oldParent = succ;
 	else
-		pthread_spin_unlock(&succ->treeLock);
-
-	pthread_spin_unlock(&node->treeLock);
-	node_to_delete = node;
-	pthread_spin_unlock(&parent->treeLock);
+		node_unlock(&SIDE(succ)->treeLock);
+
+	node_unlock(&SIDE(node)->treeLock);
+	*node_to_delete = node;
+	node_unlock(&SIDE(parent)->treeLock);
+
+	//> succ took over node's heights, which may be stale as well
+	if(_avl_defer(avl, oldParent->key) && (oldParent == succ || _avl_defer(avl, succ->key))){
+		updateHeight(oldRight, oldParent, isLeft);
+		if(oldRight != NULL)
+			node_unlock(&SIDE(oldRight)->treeLock);
+		node_unlock(&SIDE(oldParent)->treeLock);
+		return;
+	}
 
 	rebalance(avl, oldParent, oldRight, isLeft);	
 	
-	if(violated){
-		pthread_spin_lock(&succ->treeLock);
+	relaxed = LOAD_ACQ(avl->relaxed);
+	if(relaxed != NULL && LOAD_ACQ(relaxed->enabled)){
+		//> A violation recorded for node went away with it, the rebalance
+		//> from oldParent may stop below succ
+		cm_retry_t r;
+
+		cm_begin(&r, &avl->cm);
+		while(!_avl_fix(avl, succ->key))
+			cm_wait(&r);
+		_avl_cm_end(&r);
+	}else if(violated){
+		node_lock(&SIDE(succ)->treeLock);
 		int bf = GET_BALANCE_FACTOR(succ);
-		if(succ->valid && abs(bf) >= 2)
+		if(NODE_VALID(succ) && abs(bf) >= 2)
 			rebalance(avl, succ, NULL, bf >= 2? 0: 1);	
 		else
-			pthread_spin_unlock(&succ->treeLock);
+			node_unlock(&SIDE(succ)->treeLock);
 	}
 	
 	return;
 }
 
-static int _avl_lookup_helper(avl_t *avl, int key)
+/*
+ * Pred/succ fixup from the node where a descent for key stopped. Returns the
+ * first node of the logical ordering layout with node->key >= key.
+ */
+static inline avl_node_t *_avl_fixup(avl_node_t *node, tree_key_t key)
+{
+	STATS_INC(nr_locates);
+	while(node->key > key){
+		node = LOAD_ACQ(COLD(node)->pred);
+		STATS_INC(nr_fixup_hops);
+	}
+
+	while(node->key < key){
+		node = LOAD_ACQ(COLD(node)->succ);
+		STATS_INC(nr_fixup_hops);
+	}
+
+	return node;
+}
+
+/*
+ * Tree descent followed by the pred/succ fixup. Returns the first node of the
+ * logical ordering layout with node->key >= key; it may be already deleted.
+ */
+static avl_node_t *_avl_locate(avl_t *avl, tree_key_t key)
 { 
-	int dir, currKey;
+	int dir;
+	tree_key_t currKey;
 	avl_node_t *node, *child = NULL;	
 
-	node = avl->root;
+	node = _avl_top_start(avl, key);
 	while(1){
 		currKey = node->key;
 		if(currKey == key)
 			break;
 		dir = currKey < key;
-		child = node->link[dir];
+		child = LOAD_ACQ(node->link[dir]);
 		if(child == NULL) 
 			break;		
 		node = child;
 	}
 
-	while(node->key > key)
-		node = node->pred;
-
-	while(node->key < key)
-		node = node->succ;
-	
-	return ((node->key == key) && node->valid);
+	return _avl_fixup(node, key);
 }
 
-static int _avl_insert_helper(avl_t *avl, avl_node_t *new_node)
+static int _avl_lookup_helper(avl_t *avl, tree_key_t key)
 { 
-	int inserted = 0;
-	avl_node_t *node = NULL;
-	int key = new_node->key;
-
-	while(1){ 
-		//> Searh operation
-		int dir, currKey;
-		avl_node_t *node, *child = NULL;
-		node = avl->root;
-		while(1){
-			currKey = node->key;
-			if(currKey == key)
-				break;
-			dir = currKey < key;
-			child = node->link[dir];
-			if(child == NULL) 
-				break;		
-			node = child;
-		}
+	avl_node_t *node = _avl_locate(avl, key);
 
-		avl_node_t *p = (node->key >= key) ? node->pred : node;
-		pthread_spin_lock(&p->succLock);
-		avl_node_t *s = p->succ;  
+	return ((node->key == key) && _avl_snapshot_read(avl, node, NODE_VALID(node)));
+}
 
-		if((p->key < key) && (s->key >= key) && p->valid){
+/* Skips sentinel keys, which are never found; returns the next key to look up. */
+static inline int _avl_lookup_batch_next(tree_key_t *keys, int next, int n, int *results)
+{
+	while(next < n && KEY_IS_SENTINEL(keys[next]))
+		results[next++] = 0;
+	return next;
+}
 
-			if(s->key == key){			//> The key already exists -  Unsuccessful insert 
-				pthread_spin_unlock(&p->succLock);
-				return inserted; 	
-			}
+/*
+ * Looks up keys[0..n) with up to LOOKUP_BATCH_WIDTH descents in flight. Each
+ * round moves every descent down by one level and prefetches the child it
+ * moves to, so the cache misses of the descents overlap instead of adding
+ * up. A descent that stops runs the fixup of _avl_locate, and its slot takes
+ * the next key. Returns the number of keys found.
+ */
+static int _avl_lookup_batch_helper(avl_t *avl, tree_key_t *keys, int n, int *results)
+{
+	avl_node_t *nodes[LOOKUP_BATCH_WIDTH], *node, *child;
+	int slots[LOOKUP_BATCH_WIDTH];	//> Index of the key of each descent
+	int i, next = 0, nr_active = 0, found = 0;
+	tree_key_t key, currKey;
+
+	for(next = _avl_lookup_batch_next(keys, 0, n, results);
+	    next < n && nr_active < LOOKUP_BATCH_WIDTH;
+	    next = _avl_lookup_batch_next(keys, next + 1, n, results)){
+		slots[nr_active] = next;
+		nodes[nr_active] = _avl_top_start(avl, keys[next]);
+		__builtin_prefetch(nodes[nr_active++]);
+	}
 
-			//> Find the right parent for new node - ChooseParent
-			avl_node_t *parent = ((node ==  p) || (node == s)) ? node : p;
-			while(1){
-				pthread_spin_lock(&parent->treeLock);
-				if(parent == p){
-					if(parent->link[1] == NULL)
-						break;
-					pthread_spin_unlock(&parent->treeLock);
-					parent = s;
-				}else{
-					if(parent->link[0] == NULL)
-						break;
-					pthread_spin_unlock(&parent->treeLock);
-					parent = p;
+	while(nr_active > 0){
+		for(i = 0; i < nr_active; i++){
+			node = nodes[i];
+			key = keys[slots[i]];
+			currKey = node->key;
+			if(currKey != key){
+				child = LOAD_ACQ(node->link[currKey < key]);
+				if(child != NULL){
+					__builtin_prefetch(child);
+					nodes[i] = child;
+					continue;
 				}
 			}
 
-			//> Update logical ordering layout
-			new_node->succ = s;
-			new_node->pred = p;
-			new_node->parent = parent;		//> Parent is already locked
-			s->pred = new_node;
-			p->succ = new_node;
-			pthread_spin_unlock(&p->succLock);
-			
-			//> Update physical layout - InsertToTree
-								//> Parent is already locked
-			if(parent->key < key){			//> New_node is the right child
-				parent->link[1] = new_node;
-				parent->rightHeight = 1;
-			}else{					//> New_node is the left child
-				parent->link[0] = new_node;
-				parent->leftHeight = 1;
-			}
+			node = _avl_fixup(node, key);
+			results[slots[i]] = ((node->key == key) && _avl_snapshot_read(avl, node, NODE_VALID(node)));
+			found += results[slots[i]];
 
-			if(parent != avl->root){
-				avl_node_t *grandParent = lockParent(parent);
-				rebalance(avl, grandParent, parent, grandParent->link[0] == parent); // !!!! SOSOOSOS arguments of rebalance
+			if(next < n){
+				slots[i] = next;
+				nodes[i] = _avl_top_start(avl, keys[next]);
+				__builtin_prefetch(nodes[i]);
+				next = _avl_lookup_batch_next(keys, next + 1, n, results);
 			}else{
-				pthread_spin_unlock(&parent->treeLock);
+				nr_active--;
+				slots[i] = slots[nr_active];
+				nodes[i] = nodes[nr_active];
+				i--;		//> The moved descent has not advanced this round
 			}
-
-			inserted = 1;
-			return inserted;			//> Successful insert					
 		}
-		pthread_spin_unlock(&p->succLock);		//> Validation failed - restart
 	}
-	return inserted;
+
+	return found;
 }
 
-static inline int _avl_delete_helper(avl_t *avl, int key, avl_node_t *node_to_delete)
+/*
+ * The value and the deleted flag are read under the node's version, so a
+ * value that was overwritten or whose node was deleted during the read is
+ * never reported. Returns 1 if node is valid.
+ */
+static int _avl_read_node(avl_node_t *node, tree_value_t *value)
 {
-	int ret = 0;
+	node_version_t v;
+	tree_value_t val;
+
+	do {
+		v = version_read_begin(&node->version);
+		val = LOAD(COLD(node)->value);
+	} while(version_read_retry(&node->version, v));
+
+	if(!VERSION_VALID(v))
+		return 0;
+	if(value != NULL)
+		*value = val;
+	return 1;
+}
 
-	while(1){ 
-		//> Searh operation
-		int dir, currKey;
-		avl_node_t *node, *child = NULL;
+static int _avl_get_helper(avl_t *avl, tree_key_t key, tree_value_t *value)
+{ 
+	avl_node_t *node = _avl_locate(avl, key);
+
+	if(node->key != key)
+		return 0;
+	return _avl_snapshot_read(avl, node, _avl_read_node(node, value));
+}
+
+#define ORDER_CEILING 0		//> Smallest key >= key
+#define ORDER_NEXT 1		//> Smallest key > key
+#define ORDER_FLOOR 2		//> Largest key <= key
+#define ORDER_PREV 3		//> Largest key < key
+
+/*
+ * Ordered queries without locks: the descent and fixup of _avl_locate give
+ * the first node >= key, from which the pred/succ chain is followed past
+ * deleted nodes. The two sentinels bound the walk. Like lookup, the result
+ * may miss concurrent inserts and deletes.
+ */
+static int _avl_order_helper(avl_t *avl, tree_key_t key, int query,
+                             tree_key_t *key_found, tree_value_t *value)
+{
+	avl_node_t *head = COLD(avl->root)->parent;
+	avl_node_t *node;
+
+	if(key <= KEY_MIN)
+		node = head;
+	else if(key >= KEY_MAX)
 		node = avl->root;
-		while(1){
-			currKey = node->key;
-			if(currKey == key)
-				break;
-			dir = currKey < key;
-			child = node->link[dir];
-			if(child == NULL) 
-				break;		
-			node = child;
-		}
+	else
+		node = _avl_locate(avl, key);
+
+	if(query == ORDER_CEILING || query == ORDER_NEXT){
+		if(node == avl->root)
+			return 0;
+		if(node == head || (query == ORDER_NEXT && node->key == key))
+			node = LOAD_ACQ(COLD(node)->succ);
+		while(node != avl->root && !_avl_read_node(node, value))
+			node = LOAD_ACQ(COLD(node)->succ);
+		if(node == avl->root)
+			return 0;
+	}else{
+		if(node == head)
+			return 0;
+		if(node == avl->root || query == ORDER_PREV || node->key != key)
+			node = LOAD_ACQ(COLD(node)->pred);
+		while(node != head && !_avl_read_node(node, value))
+			node = LOAD_ACQ(COLD(node)->pred);
+		if(node == head)
+			return 0;
+	}
+
+	if(key_found != NULL)
+		*key_found = node->key;
+	return 1;
+}
 
-		avl_node_t *p = (node->key >= key) ? node->pred : node;
-		pthread_spin_lock(&p->succLock);
-		avl_node_t *s = p->succ;  
+/* Returns 1 and the next valid key of the cursor, 0 at the end of the tree. */
+static int _avl_cursor_next_helper(avl_cursor_t *cursor, tree_key_t *key, tree_value_t *value)
+{
+	avl_node_t *node = cursor->node;
 
-		if((p->key < key) && (s->key >= key) && p->valid){
+	while(node != cursor->avl->root && !_avl_read_node(node, value))
+		node = LOAD_ACQ(COLD(node)->succ);
+	if(node == cursor->avl->root){
+		cursor->node = node;
+		return 0;
+	}
 
-			if(s->key > key){			//> The key doesn't exist -  Unsuccessful delete
-				pthread_spin_unlock(&p->succLock);
-				return ret; 	
-			}
+	if(key != NULL)
+		*key = node->key;
+	cursor->node = LOAD_ACQ(COLD(node)->succ);
+	return 1;
+}
 
-			pthread_spin_lock(&s->succLock);	//> Successful remove
-			int hasTwoChildren = acquireTreeLocks(s);
-			avl_node_t *sParent = lockParent(s);
-
-			//> Update logical order
-			s->valid = 0;
-			avl_node_t *sSucc = s->succ;
-			sSucc->pred = p;
-			p->succ = sSucc;
-			pthread_spin_unlock(&s->succLock);
-			pthread_spin_unlock(&p->succLock);
-	
-			//> Physical remove
-			removeFromTree(avl, s, hasTwoChildren, sParent, node_to_delete);
-			ret = 1;
-			return ret;		
+#ifdef AVL_ORDER_STATS
+/*
+ * Number of keys smaller than key, counted along a single descent. Concurrent
+ * updates may not have propagated their size changes up to the nodes on the
+ * path yet, and deleted nodes are counted until they leave the tree, so under
+ * concurrency the result is approximate.
+ */
+static int _avl_rank_helper(avl_t *avl, tree_key_t key)
+{
+	int rank = 0;
+	avl_node_t *node = LOAD_ACQ(avl->root->link[0]);
+
+	while(node != NULL){
+		avl_node_t *left = LOAD_ACQ(node->link[0]);
+
+		if(key < node->key){
+			node = left;
+		}else if(key == node->key){
+			rank += SUBTREE_SIZE(left);
+			break;
+		}else{
+			rank += SUBTREE_SIZE(left) + 1;
+			node = LOAD_ACQ(node->link[1]);
 		}
-		pthread_spin_unlock(&p->succLock);		//> Validation failed - restart
 	}
-	return ret;
+
+	return rank;
 }
 
-static int total_paths;
-static int min_path_len, max_path_len;
-static int total_nodes;
-static int avl_violations, logic_violations;
-static void _avl_validate(avl_node_t *root, int _th)
+/*
+ * Finds the i-th smallest key (from 0) by the subtree sizes. If the sizes on
+ * the path are stale the descent may run out of nodes; the successor of the
+ * last node is used then. Deleted nodes are skipped along the succ chain, so
+ * under concurrency the result is a valid key close to position i.
+ */
+static int _avl_select_helper(avl_t *avl, int i, tree_key_t *key, tree_value_t *value)
 {
-	if (root == NULL)
-		return;
+	avl_node_t *node = LOAD_ACQ(avl->root->link[0]);
+	avl_node_t *last = COLD(avl->root)->parent;
 
-	avl_node_t *left = root->link[0];
-	avl_node_t *right = root->link[1];
+	if(i < 0 || i >= SUBTREE_SIZE(node))
+		return 0;
 
-	total_nodes++;
-	_th++;
+	while(node != NULL){
+		avl_node_t *left = LOAD_ACQ(node->link[0]);
+		int leftSize = SUBTREE_SIZE(left);
 
-	/* AVL violation? */
-	if (left != NULL && left->key >= root->key)
-		avl_violations++;
-	if (right != NULL && right->key <= root->key)
-		avl_violations++;
+		if(i < leftSize){
+			node = left;
+		}else if(i == leftSize){
+			break;
+		}else{
+			i -= leftSize + 1;
+			last = node;
+			node = LOAD_ACQ(node->link[1]);
+		}
+	}
+	if(node == NULL)
+		node = LOAD_ACQ(COLD(last)->succ);
 
-	/* Violation in logical order */
-	if (root->pred->succ != root)
-		logic_violations++;
-	if (root->succ->pred != root)
-		logic_violations++;
+	while(node != avl->root && !_avl_read_node(node, value))
+		node = LOAD_ACQ(COLD(node)->succ);
+	if(node == avl->root)
+		return 0;
 
-	/* We found a path (a node with at least one sentinel child). */
-	if (left == NULL || right == NULL) {
-		total_paths++;
+	if(key != NULL)
+		*key = node->key;
+	return 1;
+}
+#endif
+
+/*
+ * Weakly consistent scan: streams the valid nodes along the succ chain
+ * without taking any lock. Every reported key was present at some point
+ * during the scan; keys inserted or deleted concurrently may or may not
+ * be reported.
+ */
+static int _avl_range_scan_weak(avl_t *avl, tree_key_t lo, tree_key_t hi, range_scan_cb_t cb, void *arg)
+{
+	int nr_keys = 0;
+	avl_node_t *node = (lo > KEY_MIN) ? _avl_locate(avl, lo) : LOAD_ACQ(COLD(COLD(avl->root)->parent)->succ);
+	avl_node_t *succ;
+	node_version_t v;
+	tree_value_t value;
+
+	while(node->key <= hi && node != avl->root){
+		do {
+			v = version_read_begin(&node->version);
+			value = LOAD(COLD(node)->value);
+			succ = LOAD_ACQ(COLD(node)->succ);
+		} while(version_read_retry(&node->version, v));
+
+		if(VERSION_VALID(v)){
+			nr_keys++;
+			if(cb(node->key, value, arg) != 0)
+				break;
+		}
+		node = succ;
+	}
 
-		if (_th <= min_path_len)
-			min_path_len = _th;
-		if (_th >= max_path_len)
-			max_path_len = _th;
+	return nr_keys;
+}
+
+/*
+ * Linearizable scan: locks the succLock of lo's predecessor and then, hand
+ * over hand, of every node in [lo, hi]. All locks are held until the end of
+ * the scan, so no insert or delete can modify the range while it is
+ * reported. cb runs with the locks held and must not operate on the tree.
+ */
+static int _avl_range_scan_locked(avl_t *avl, tree_key_t lo, tree_key_t hi, range_scan_cb_t cb, void *arg)
+{
+	int nr_keys = 0;
+	avl_node_t *p, *node, *last;
+
+	while(1){
+		if(lo <= KEY_MIN){
+			p = COLD(avl->root)->parent;			//> The KEY_MIN sentinel, never deleted
+			node_lock(&SIDE(p)->succLock);
+			break;
+		}
+		node = _avl_locate(avl, lo);
+		p = (node->key >= lo) ? LOAD_ACQ(COLD(node)->pred) : node;
+		node_lock(&SIDE(p)->succLock);
+		if((p->key < lo) && (COLD(p)->succ->key >= lo) && NODE_VALID(p))
+			break;
+		node_unlock(&SIDE(p)->succLock);		//> Validation failed - restart
+		STATS_INC(nr_restarts);
 	}
 
-	/* Check subtrees. */
-	if (left != NULL){
-		_avl_validate(left, _th);
+	last = p;
+	node = COLD(p)->succ;						//> Cannot be deleted while we hold p->succLock
+	while(node->key <= hi && node != avl->root){
+		node_lock(&SIDE(node)->succLock);
+		last = node;
+		nr_keys++;
+		if(cb(node->key, COLD(node)->value, arg) != 0)
+			break;
+		node = COLD(node)->succ;
 	}
-	if (right != NULL){
-		_avl_validate(right, _th);
+
+	node = p;
+	while(1){
+		avl_node_t *next = COLD(node)->succ;
+		node_unlock(&SIDE(node)->succLock);
+		if(node == last)
+			break;
+		node = next;
 	}
+
+	return nr_keys;
 }
 
+/*
+ * The existing node s is updated under its own succLock: s cannot be removed
+ * while we hold p->succLock (p->succ == s), and once s->succLock is taken
+ * p->succLock can be released so that inserts before s are not delayed.
+ */
+static void _avl_update_existing(avl_t *avl, avl_node_t *p, avl_node_t *s, avl_update_t *upd)
+{
+	node_lock(&SIDE(s)->succLock);
+	node_unlock(&SIDE(p)->succLock);
+
+	upd->found = 1;
+	upd->old_value = COLD(s)->value;
+	if(upd->op != UPDATE_NONE){
+		tree_value_t value = (upd->op == UPDATE_PUT) ? upd->value :
+		                     upd->fn(s->key, COLD(s)->value, upd->arg);
+		version_write_begin(&s->version);
+		STORE(COLD(s)->value, value);
+		version_write_end(&s->version, 0);
+		_avl_wal_append(avl, WAL_INSERT, s);
+	}
+
+	node_unlock(&SIDE(s)->succLock);
+}
 
-static inline int _avl_validate_helper(avl_node_t *root)
+/*
+ * Links new_node between p and s and below parent, then rebalances. Called
+ * with p->succLock and parent->treeLock held, which are both released.
+ */
+static void _avl_link_new(avl_t *avl, avl_node_t *p, avl_node_t *s, avl_node_t *parent,
+                          avl_node_t *new_node)
 {
-	int check_avl = 0, check_logic = 0;
+	//> Update logical ordering layout
+	COLD(new_node)->succ = s;
+	COLD(new_node)->pred = p;
+	COLD(new_node)->parent = parent;		//> Parent is already locked
+	STORE_REL(COLD(s)->pred, new_node);		//> Publishes new_node
+	version_write_begin(&p->version);
+	STORE_REL(COLD(p)->succ, new_node);
+	version_write_end(&p->version, 0);
+	_avl_wal_append(avl, WAL_INSERT, new_node);
+	node_unlock(&SIDE(p)->succLock);
+	_avl_snapshot_insert(avl, new_node);
+	
+	//> Update physical layout - InsertToTree
+						//> Parent is already locked
+	if(parent->key < new_node->key){	//> New_node is the right child
+		STORE_REL(parent->link[1], new_node);
+		STORE(SIDE(parent)->rightHeight, 1);
+	}else{					//> New_node is the left child
+		STORE_REL(parent->link[0], new_node);
+		STORE(SIDE(parent)->leftHeight, 1);
+	}
+#ifdef AVL_ORDER_STATS
+	updateSize(parent);
+#endif
+
+	if(parent != avl->root && !_avl_defer(avl, parent->key)){
+		avl_node_t *grandParent = lockParent(avl, parent);
+		rebalance(avl, grandParent, parent, grandParent->link[0] == parent); // !!!! SOSOOSOS arguments of rebalance
+	}else{
+		node_unlock(&SIDE(parent)->treeLock);
+	}
+}
+
+#ifndef NO_FAST_INSERT
+/*
+ * Optimistic insert for the common case: the descent ended at node, a free
+ * child slot of p or s. The search result is checked without locks first.
+ * Both locks are then taken with a single trylock each instead of spinning,
+ * and node itself becomes the parent, skipping the ChooseParent loop. Under
+ * p->succLock, p must still be valid and linked to s. Returns 0 without any
+ * change on a conflict; the caller then falls back to the full protocol.
+ * Rebalancing is the same on both paths.
+ */
+static int _avl_insert_fast(avl_t *avl, avl_node_t *node, tree_key_t key, avl_node_t *new_node)
+{
+	int dir = node->key < key;		//> The free slot of node
+	avl_node_t *p = dir ? node : LOAD_ACQ(COLD(node)->pred);
+	avl_node_t *s = dir ? LOAD_ACQ(COLD(node)->succ) : node;
+
+	if(!((p->key < key) && (key < s->key)))
+		return 0;
+	if(node_trylock(&SIDE(p)->succLock) != 0)
+		return 0;
+	if(COLD(p)->succ != s || !NODE_VALID(p)){
+		node_unlock(&SIDE(p)->succLock);
+		return 0;
+	}
+	if(node_trylock(&SIDE(node)->treeLock) != 0){
+		node_unlock(&SIDE(p)->succLock);
+		return 0;
+	}
+	if(node->link[dir] != NULL){
+		node_unlock(&SIDE(node)->treeLock);
+		node_unlock(&SIDE(p)->succLock);
+		return 0;
+	}
+
+	_avl_link_new(avl, p, s, node, new_node);
+	STATS_INC(nr_fast_inserts);
+	return 1;
+}
+#endif
+
+/*
+ * Second half of _avl_insert_helper, called with p->succLock held after
+ * validating that key lies in (p, s]. node is the last node of the descent,
+ * the first candidate parent. Releases every lock before returning.
+ */
+static int _avl_insert_locked(avl_t *avl, avl_node_t *p, avl_node_t *s, avl_node_t *node,
+                              tree_key_t key, avl_node_t *new_node, avl_update_t *upd)
+{
+	int inserted = 0;
+
+	if(s->key == key){			//> The key already exists -  Unsuccessful insert 
+		if(upd != NULL)
+			_avl_update_existing(avl, p, s, upd);
+		else
+			node_unlock(&SIDE(p)->succLock);
+		return inserted; 	
+	}
+
+	if(new_node == NULL){			//> Nothing to insert
+		node_unlock(&SIDE(p)->succLock);
+		return inserted;
+	}
+
+	//> Find the right parent for new node - ChooseParent
+	avl_node_t *parent = ((node ==  p) || (node == s)) ? node : p;
+	while(1){
+		node_lock(&SIDE(parent)->treeLock);
+		if(parent == p){
+			if(parent->link[1] == NULL)
+				break;
+			node_unlock(&SIDE(parent)->treeLock);
+			parent = s;
+		}else{
+			if(parent->link[0] == NULL)
+				break;
+			node_unlock(&SIDE(parent)->treeLock);
+			parent = p;
+		}
+	}
+
+	_avl_link_new(avl, p, s, parent, new_node);
+	STATS_INC(nr_slow_inserts);
+
+	inserted = 1;
+	return inserted;			//> Successful insert
+}
+
+/*
+ * Inserts new_node, or applies upd to the existing node with the same key.
+ * A NULL new_node only updates an existing node (compute_if_present).
+ * Unless built with -DNO_FAST_INSERT, _avl_insert_fast is tried first.
+ */
+static int _avl_insert_helper(avl_t *avl, tree_key_t key, avl_node_t *new_node, avl_update_t *upd)
+{ 
+	int inserted = 0, restarted = 0;
+	avl_node_t *node = NULL;
+
+	while(1){ 
+		//> Searh operation
+		int dir;
+		tree_key_t currKey;
+		avl_node_t *node, *child = NULL;
+		node = restarted ? avl->root : _avl_top_start(avl, key);	//> A stale start fails once
+		while(1){
+			currKey = node->key;
+			if(currKey == key)
+				break;
+			dir = currKey < key;
+			child = LOAD_ACQ(node->link[dir]);
+			if(child == NULL) 
+				break;		
+			node = child;
+		}
+
+#ifndef NO_FAST_INSERT
+		if(new_node != NULL && node->key != key && _avl_insert_fast(avl, node, key, new_node))
+			return 1;
+#endif
+
+		avl_node_t *p = (node->key >= key) ? LOAD_ACQ(COLD(node)->pred) : node;
+		node_lock(&SIDE(p)->succLock);
+		avl_node_t *s = COLD(p)->succ;  
+
+		if((p->key < key) && (s->key >= key) && NODE_VALID(p))
+			return _avl_insert_locked(avl, p, s, node, key, new_node, upd);
+		node_unlock(&SIDE(p)->succLock);		//> Validation failed - restart
+		STATS_INC(nr_restarts);
+		restarted = 1;
+	}
+	return inserted;
+}
+
+/*
+ * Deletes s if it holds key. Called with p->succLock held after validating
+ * that key lies in (p, s]; releases every lock before returning.
+ */
+static int _avl_delete_locked(avl_t *avl, avl_node_t *p, avl_node_t *s, tree_key_t key,
+                              avl_node_t **node_to_delete)
+{
+	int ret = 0;
+
+	if(s->key > key){			//> The key doesn't exist -  Unsuccessful delete
+		node_unlock(&SIDE(p)->succLock);
+		return ret; 	
+	}
+
+	node_lock(&SIDE(s)->succLock);	//> Successful remove
+	int hasTwoChildren = acquireTreeLocks(avl, s);
+	avl_node_t *sParent = lockParent(avl, s);
+
+	//> Update logical order
+	version_write_begin(&s->version);
+	version_write_end(&s->version, VERSION_DELETED);
+	_avl_snapshot_delete(avl, s);		//> Before s leaves the succ chain
+	_avl_wal_append(avl, WAL_DELETE, s);
+	avl_node_t *sSucc = COLD(s)->succ;
+	STORE_REL(COLD(sSucc)->pred, p);
+	version_write_begin(&p->version);
+	STORE_REL(COLD(p)->succ, sSucc);
+	version_write_end(&p->version, 0);
+	node_unlock(&SIDE(s)->succLock);
+	node_unlock(&SIDE(p)->succLock);
+
+	//> Physical remove
+	removeFromTree(avl, s, hasTwoChildren, sParent, node_to_delete);
+	_avl_top_forget(avl, s);
+	ret = 1;
+	return ret;
+}
+
+static inline int _avl_delete_helper(avl_t *avl, tree_key_t key, avl_node_t **node_to_delete)
+{
+	int ret = 0, restarted = 0;
+
+	while(1){ 
+		//> Searh operation
+		int dir;
+		tree_key_t currKey;
+		avl_node_t *node, *child = NULL;
+		node = restarted ? avl->root : _avl_top_start(avl, key);
+		while(1){
+			currKey = node->key;
+			if(currKey == key)
+				break;
+			dir = currKey < key;
+			child = LOAD_ACQ(node->link[dir]);
+			if(child == NULL) 
+				break;		
+			node = child;
+		}
+
+		avl_node_t *p = (node->key >= key) ? LOAD_ACQ(COLD(node)->pred) : node;
+		node_lock(&SIDE(p)->succLock);
+		avl_node_t *s = COLD(p)->succ;  
+
+		if((p->key < key) && (s->key >= key) && NODE_VALID(p))
+			return _avl_delete_locked(avl, p, s, key, node_to_delete);
+		node_unlock(&SIDE(p)->succLock);		//> Validation failed - restart
+		STATS_INC(nr_restarts);
+		restarted = 1;
+	}
+	return ret;
+}
+
+#define BATCH_MAX_HOPS 32	//> Longer walks along the succ chain descend from the root
+
+/*
+ * Returns the node to validate as the predecessor of key. The previous key of
+ * a sorted batch left pos close by, so the succ chain is followed from pos if
+ * key is at most BATCH_MAX_HOPS nodes ahead; otherwise the search descends
+ * from the root. The result may be stale and must be validated under its
+ * succLock.
+ */
+static avl_node_t *_avl_batch_pred(avl_t *avl, avl_node_t *pos, tree_key_t key)
+{
+	int hops;
+
+	if(pos != NULL && pos->key < key){
+		for(hops = 0; hops < BATCH_MAX_HOPS; hops++){
+			avl_node_t *succ = LOAD_ACQ(COLD(pos)->succ);
+			if(succ->key >= key)
+				return pos;
+			pos = succ;
+		}
+	}
+
+	return LOAD_ACQ(COLD(_avl_locate(avl, key))->pred);
+}
+
+/*
+ * Inserts nodes[0, n), sorted by key, one at a time: every insert rebalances
+ * on its own, so keys of the same gap cannot be linked as one subtree like in
+ * the BST, but each search continues from the previous key's position.
+ * inserted[i] is set for every node that was linked.
+ */
+static int _avl_insert_batch_helper(avl_t *avl, avl_node_t **nodes, int n, char *inserted)
+{
+	int i = 0, nr_inserted = 0;
+	avl_node_t *pos = NULL;
+
+	while(i < n){
+		tree_key_t key = nodes[i]->key;
+		avl_node_t *p = _avl_batch_pred(avl, pos, key);
+		node_lock(&SIDE(p)->succLock);
+		avl_node_t *s = COLD(p)->succ;
+
+		if(!((p->key < key) && (s->key >= key) && NODE_VALID(p))){
+			node_unlock(&SIDE(p)->succLock);	//> Validation failed - descend
+			STATS_INC(nr_restarts);
+			pos = NULL;
+			continue;
+		}
+		if(_avl_insert_locked(avl, p, s, p, key, nodes[i], NULL)){
+			inserted[i] = 1;
+			nr_inserted++;
+			pos = nodes[i];
+		}else{
+			pos = s;
+		}
+		i++;
+	}
+
+	return nr_inserted;
+}
+
+/*
+ * Deletes keys[0, n), sorted. Each delete locks like a single one but starts
+ * from the predecessor of the previous key instead of the root. The unlinked
+ * nodes are stored in nodes_to_delete.
+ */
+static int _avl_delete_batch_helper(avl_t *avl, tree_key_t *keys, int n, avl_node_t **nodes_to_delete)
+{
+	int i = 0, nr_deleted = 0;
+	avl_node_t *pos = NULL, *node_to_delete;
+
+	while(i < n){
+		tree_key_t key = keys[i];
+		avl_node_t *p = _avl_batch_pred(avl, pos, key);
+		node_lock(&SIDE(p)->succLock);
+		avl_node_t *s = COLD(p)->succ;
+
+		if(!((p->key < key) && (s->key >= key) && NODE_VALID(p))){
+			node_unlock(&SIDE(p)->succLock);	//> Validation failed - descend
+			STATS_INC(nr_restarts);
+			pos = NULL;
+			continue;
+		}
+		if(_avl_delete_locked(avl, p, s, key, &node_to_delete))
+			nodes_to_delete[nr_deleted++] = node_to_delete;
+		pos = p;
+		i++;
+	}
+
+	return nr_deleted;
+}
+
+static int total_paths;
+static int min_path_len, max_path_len;
+static int total_nodes;
+static int avl_violations, logic_violations;
+static int height_violations;
+
+/*
+ * Returns the height of the subtree of root and counts the nodes whose stored
+ * heights differ from the real ones or that are not balanced.
+ */
+static int _avl_validate_height(avl_node_t *root)
+{
+	if (root == NULL)
+		return 0;
+
+	int left = _avl_validate_height(root->link[0]);
+	int right = _avl_validate_height(root->link[1]);
+	if (SIDE(root)->leftHeight != left || SIDE(root)->rightHeight != right ||
+	    abs(left - right) >= 2)
+		height_violations++;
+	return MAX(left, right) + 1;
+}
+#ifdef AVL_ORDER_STATS
+static int size_violations;
+
+/* Returns the number of nodes below root and counts the wrong sizes. */
+static int _avl_validate_size(avl_node_t *root)
+{
+	if (root == NULL)
+		return 0;
+
+	int size = _avl_validate_size(root->link[0]) + _avl_validate_size(root->link[1]) + 1;
+	if (SIDE(root)->size != size)
+		size_violations++;
+	return size;
+}
+#endif
+static void _avl_validate(avl_node_t *root, int _th)
+{
+	if (root == NULL)
+		return;
+
+	avl_node_t *left = root->link[0];
+	avl_node_t *right = root->link[1];
+
+	total_nodes++;
+	_th++;
+
+	/* AVL violation? */
+	if (left != NULL && left->key >= root->key)
+		avl_violations++;
+	if (right != NULL && right->key <= root->key)
+		avl_violations++;
+
+	/* Violation in logical order */
+	if (COLD(COLD(root)->pred)->succ != root)
+		logic_violations++;
+	if (COLD(COLD(root)->succ)->pred != root)
+		logic_violations++;
+
+	/* We found a path (a node with at least one sentinel child). */
+	if (left == NULL || right == NULL) {
+		total_paths++;
+
+		if (_th <= min_path_len)
+			min_path_len = _th;
+		if (_th >= max_path_len)
+			max_path_len = _th;
+	}
+
+	/* Check subtrees. */
+	if (left != NULL){
+		_avl_validate(left, _th);
+	}
+	if (right != NULL){
+		_avl_validate(right, _th);
+	}
+}
+
+
+static inline int _avl_validate_helper(avl_node_t *root)
+{
+	int check_avl = 0, check_logic = 0;
 	int check_rbt = 0;
 	total_paths = 0;
 	min_path_len = 99999999;
@@ -594,6 +1832,14 @@ static inline int _avl_validate_helper(avl_node_t *root)
 	logic_violations = 0;
 
 	_avl_validate(root, 0);
+	height_violations = 0;
+	_avl_validate_height(root->link[0]);		//> The sentinel root is not maintained
+	avl_violations += height_violations;
+#ifdef AVL_ORDER_STATS
+	size_violations = 0;
+	_avl_validate_size(root->link[0]);		//> The sentinel root is not maintained
+	avl_violations += size_violations;
+#endif
 
 	check_avl = (avl_violations == 0);
 	check_logic = (logic_violations == 0);
@@ -607,6 +1853,12 @@ static inline int _avl_validate_helper(avl_node_t *root)
 	       check_avl ? "No [OK]" : "Yes [ERROR]");
 	printf("  Logical Violation: %s\n",
 	       check_logic ? "No [OK]" : "Yes [ERROR]");
+	printf("  Height Violation: %s\n",
+	       (height_violations == 0) ? "No [OK]" : "Yes [ERROR]");
+#ifdef AVL_ORDER_STATS
+	printf("  Size Violation: %s\n",
+	       (size_violations == 0) ? "No [OK]" : "Yes [ERROR]");
+#endif
 	printf("  Tree size (Total): %8d\n",
 	       total_nodes);
 	printf("  Total paths: %d\n", total_paths);
@@ -616,76 +1868,1183 @@ static inline int _avl_validate_helper(avl_node_t *root)
 	return check_avl;
 }
 
+/*
+ * Placement of the nodes of a thread's pool, or of the nodes that warmup and
+ * bulk_load pre-fill the tree with.
+ */
+static int _avl_placement(int prefill)
+{
+	if(numa_policy == NUMA_POLICY_LOCAL)
+		return NODE_ALLOC_LOCAL;
+	if(numa_policy == NUMA_POLICY_INTERLEAVE)
+		return prefill ? NODE_ALLOC_INTERLEAVED : NODE_ALLOC_LOCAL;
+	return NODE_ALLOC_DEFAULT;
+}
+
 static inline int _avl_warmup_helper(avl_t *avl, int nr_nodes, int max_key,
                                      unsigned int seed, int force)
 {
 	int i, nodes_inserted = 0, ret = 0;
 	avl_node_t *node;
+	node_pool_t pool[NODE_NR_POOLS], *prefill = NULL;	//> Only used to place the nodes
 	
+	if (_avl_placement(1) != NODE_ALLOC_DEFAULT) {
+		avl_pool_init(pool, _avl_placement(1));
+		prefill = pool;
+	}
 	srand(seed);
 	while (nodes_inserted < nr_nodes) {
 		int key = rand() % max_key;
-		node = avl_node_new(key, NULL, NULL, NULL, NULL);
+		node = avl_node_new(prefill, key, VALUE_NONE, NULL, NULL, NULL);
 
-		ret = _avl_insert_helper(avl, node); 
+		ret = _avl_insert_helper(avl, key, node, NULL); 
 		nodes_inserted += ret;
 
-		if (!ret) {
-			free(node);
-		}
+		if (!ret)
+			avl_node_free(prefill, node);
 	}
 
 	return nodes_inserted;
 }
 
+#define BULK_MIN_KEYS_PER_THREAD 4096	//> Smaller subtrees are not worth a thread
+
+typedef struct {
+	avl_t *avl;
+	avl_node_t *nodes;		//> nodes[i] holds keys[i]
+	tree_key_t *keys;
+	tree_value_t *values;
+	int n;
+} avl_bulk_t;
+
+typedef struct {
+	avl_bulk_t *bulk;
+	int lo, hi;
+	avl_node_t *parent;
+	int depth;
+	avl_node_t *ret;
+} avl_bulk_task_t;
+
+static void *_avl_bulk_worker(void *arg);
+
+static inline int _avl_bulk_height(avl_node_t *node)
+{
+	return (node == NULL) ? 0 : MAX(SIDE(node)->leftHeight, SIDE(node)->rightHeight) + 1;
+}
+
+/*
+ * Builds a perfectly balanced subtree out of nodes[lo, hi) below parent and
+ * returns its root. The pred/succ chain follows from the array index, so
+ * disjoint subtrees can be built by different threads. For depth > 0 the
+ * left subtree is handed to a new thread. Heights are set bottom-up.
+ */
+static avl_node_t *_avl_bulk_build(avl_bulk_t *bulk, int lo, int hi, avl_node_t *parent, int depth)
+{
+	if(lo >= hi)
+		return NULL;
+
+	int mid = lo + (hi - lo) / 2;
+	avl_node_t *node = &bulk->nodes[mid];
+	avl_node_t *pred = (mid > 0) ? &bulk->nodes[mid - 1] : COLD(bulk->avl->root)->parent;
+	avl_node_t *succ = (mid < bulk->n - 1) ? &bulk->nodes[mid + 1] : bulk->avl->root;
+
+	node->key = bulk->keys[mid];
+	node->version = 0;
+	COLD(node)->pred = pred;
+	COLD(node)->succ = succ;
+	COLD(node)->parent = parent;
+	COLD(node)->value = (bulk->values != NULL) ? bulk->values[mid] : VALUE_NONE;
+	node_lock_init(&SIDE(node)->succLock);
+	node_lock_init(&SIDE(node)->treeLock);
+#ifdef TREE_SNAPSHOT
+	COLD(node)->ins_ts = 0;			//> Present since the start
+	COLD(node)->del_ts = SNAPSHOT_TS_PENDING;
+#endif
+
+	node->link[0] = NULL;
+	if(depth > 0 && hi - lo >= 2 * BULK_MIN_KEYS_PER_THREAD){
+		pthread_t tid;
+		avl_bulk_task_t task = { bulk, lo, mid, node, depth - 1, NULL };
+
+		if(pthread_create(&tid, NULL, _avl_bulk_worker, &task) == 0){
+			node->link[1] = _avl_bulk_build(bulk, mid + 1, hi, node, depth - 1);
+			pthread_join(tid, NULL);
+			node->link[0] = task.ret;
+		}
+	}
+	if(node->link[0] == NULL){
+		node->link[0] = _avl_bulk_build(bulk, lo, mid, node, 0);
+		node->link[1] = _avl_bulk_build(bulk, mid + 1, hi, node, 0);
+	}
+
+	SIDE(node)->leftHeight = _avl_bulk_height(node->link[0]);
+	SIDE(node)->rightHeight = _avl_bulk_height(node->link[1]);
+#ifdef AVL_ORDER_STATS
+	SIDE(node)->size = hi - lo;
+#endif
+	return node;
+}
+
+static void *_avl_bulk_worker(void *arg)
+{
+	avl_bulk_task_t *task = arg;
+
+	task->ret = _avl_bulk_build(task->bulk, task->lo, task->hi, task->parent, task->depth);
+	return NULL;
+}
+
+static int _avl_bulk_load_helper(avl_t *avl, tree_key_t *keys, tree_value_t *values,
+                                 int n, int nr_threads)
+{
+	int i, depth = 0;
+	avl_bulk_t bulk = { avl, NULL, keys, values, n };
+	avl_node_t *head = COLD(avl->root)->parent;
+
+	if(n <= 0 || avl->root->link[0] != NULL)
+		return 0;
+	for(i = 0; i < n; i++)
+		if(KEY_IS_SENTINEL(keys[i]) || (i > 0 && keys[i - 1] >= keys[i]))
+			return 0;
+
+	while((2 << depth) <= nr_threads)
+		depth++;
+
+	bulk.nodes = node_alloc(n * sizeof(*bulk.nodes), _avl_placement(1));
+#ifdef NODE_SPLIT
+	avl_node_cold_t *colds = node_alloc(n * sizeof(*colds), _avl_placement(1));
+	for(i = 0; i < n; i++)
+		bulk.nodes[i].cold = &colds[i];
+#endif
+#ifdef NODE_SIDE_LOCKS
+	avl_node_side_t *sides = node_alloc(n * sizeof(*sides), _avl_placement(1));
+	for(i = 0; i < n; i++)
+		SIDE(&bulk.nodes[i]) = &sides[i];
+#endif
+	avl->root->link[0] = _avl_bulk_build(&bulk, 0, n, avl->root, depth);
+	SIDE(avl->root)->leftHeight = _avl_bulk_height(avl->root->link[0]);
+	COLD(head)->succ = &bulk.nodes[0];
+	COLD(avl->root)->pred = &bulk.nodes[n - 1];
+
+	return n;
+}
+
+/*
+ * thread_data may only be NULL while no other thread operates on the tree
+ * (e.g. during warmup); nodes are then allocated from and unlinked nodes
+ * returned to avl_fallback_pool immediately.
+ */
+static inline void _avl_enter(avl_thread_data_t *data)
+{
+	avl_tid = (data != NULL) ? data->tid : 0;
+#ifdef TREE_STATS
+	avl_stats = (data != NULL) ? &data->stats : NULL;
+#endif
+	if (data != NULL)
+		epoch_enter(&avl_epoch, &data->epoch);
+}
+
+static inline void _avl_exit(avl_thread_data_t *data)
+{
+	if (data != NULL)
+		epoch_exit(&data->epoch);
+}
+
+/* Returns avl_fallback_pool locked, unlock with avl_fallback_lock. */
+static node_pool_t *_avl_fallback_pool(void)
+{
+	pthread_mutex_lock(&avl_fallback_lock);
+	if (!avl_fallback_ready) {
+		avl_pool_init(avl_fallback_pool, _avl_placement(0));
+		avl_fallback_ready = 1;
+	}
+	return avl_fallback_pool;
+}
+
+static inline avl_node_t *_avl_node_alloc(avl_thread_data_t *data, tree_key_t key, tree_value_t value)
+{
+	avl_node_t *node;
+
+	if (data != NULL)
+		return avl_node_new(data->pool, key, value, NULL, NULL, NULL);
+	node = avl_node_new(_avl_fallback_pool(), key, value, NULL, NULL, NULL);
+	pthread_mutex_unlock(&avl_fallback_lock);
+	return node;
+}
+
+/* For nodes that were never published, e.g. after an unsuccessful insert. */
+static inline void _avl_node_release(avl_thread_data_t *data, avl_node_t *node)
+{
+	if (data != NULL) {
+		avl_node_free(data->pool, node);
+		return;
+	}
+	avl_node_free(_avl_fallback_pool(), node);
+	pthread_mutex_unlock(&avl_fallback_lock);
+}
+
+static void _avl_node_reclaim(void *node, void *pool)
+{
+	avl_node_free(pool, node);
+}
+
+static inline void _avl_retire(avl_thread_data_t *data, avl_node_t *node)
+{
+	if (data != NULL)
+		epoch_retire(&avl_epoch, &data->epoch, node);
+	else
+		_avl_node_release(NULL, node);
+}
+
+static inline void _avl_size_add(avl_t *avl, avl_thread_data_t *data, long n)
+{
+	size_counter_add(&avl->size, (data != NULL) ? data->tid : 0, n);
+}
+
+#ifdef TREE_STATS
+static void _avl_stats_print(avl_stats_t *stats)
+{
+	printf("  Ops: lookup %lu insert %lu delete %lu get %lu update %lu scan %lu order %lu\n",
+	       stats->nr_ops[STATS_LOOKUP], stats->nr_ops[STATS_INSERT], stats->nr_ops[STATS_DELETE],
+	       stats->nr_ops[STATS_GET], stats->nr_ops[STATS_UPDATE], stats->nr_ops[STATS_SCAN],
+	       stats->nr_ops[STATS_ORDER]);
+	printf("  Contention: restarts %lu trylock failures %lu rebalance restarts %lu yields %lu\n",
+	       stats->nr_restarts, stats->nr_trylock_fails, stats->nr_rebalance_restarts,
+	       stats->nr_yields);
+	printf("  Rotations: %lu\n", stats->nr_rotations);
+	printf("  Fixup: %.3f pred/succ hops per search (%lu searches)\n",
+	       stats->nr_locates ? (double)stats->nr_fixup_hops / stats->nr_locates : 0.0,
+	       stats->nr_locates);
+	printf("  Insert fast path: %lu of %lu inserts (%.1f%%)\n", stats->nr_fast_inserts,
+	       stats->nr_fast_inserts + stats->nr_slow_inserts,
+	       (stats->nr_fast_inserts + stats->nr_slow_inserts) ?
+	       100.0 * stats->nr_fast_inserts / (stats->nr_fast_inserts + stats->nr_slow_inserts) : 0.0);
+}
+
+static void _avl_stats_add(avl_stats_t *s1, avl_stats_t *s2, avl_stats_t *dst)
+{
+	int i;
+
+	for (i = 0; i < STATS_NR_OPS; i++)
+		dst->nr_ops[i] = s1->nr_ops[i] + s2->nr_ops[i];
+	dst->nr_restarts = s1->nr_restarts + s2->nr_restarts;
+	dst->nr_trylock_fails = s1->nr_trylock_fails + s2->nr_trylock_fails;
+	dst->nr_rebalance_restarts = s1->nr_rebalance_restarts + s2->nr_rebalance_restarts;
+	dst->nr_yields = s1->nr_yields + s2->nr_yields;
+	dst->nr_rotations = s1->nr_rotations + s2->nr_rotations;
+	dst->nr_locates = s1->nr_locates + s2->nr_locates;
+	dst->nr_fixup_hops = s1->nr_fixup_hops + s2->nr_fixup_hops;
+	dst->nr_fast_inserts = s1->nr_fast_inserts + s2->nr_fast_inserts;
+	dst->nr_slow_inserts = s1->nr_slow_inserts + s2->nr_slow_inserts;
+}
+#endif
+
 /********************************************************************************/
 /* AVL (relaxed balanced) Logical Ordering Search tree interface implementation */
 /********************************************************************************/
 void *avl_new()
 {
+#ifdef NODE_SPLIT
+	printf("Size of tree node is %lu + %lu (hot + cold)\n", sizeof(avl_node_t),
+	       sizeof(avl_node_cold_t));
+#else
 	printf("Size of tree node is %lu\n", sizeof(avl_node_t));
+#endif
+#ifdef NODE_SIDE_LOCKS
+	printf("Size of side part is %lu\n", sizeof(avl_node_side_t));
+#endif
 	return _avl_new_helper();
 }
 
-int avl_lookup(void *avl, void *thread_data, int key)
+void *avl_thread_data_new(int tid)
+{
+	avl_thread_data_t *data;
+
+	pthread_mutex_lock(&avl_free_data_lock);
+	data = avl_free_data;
+	if(data != NULL)
+		avl_free_data = data->next_free;
+	pthread_mutex_unlock(&avl_free_data_lock);
+
+	if(data == NULL){
+		XMALLOC_ALIGNED(data, 1, CACHE_LINE_SIZE);
+		avl_pool_init(data->pool, _avl_placement(0));
+		epoch_thread_register(&avl_epoch, &data->epoch, _avl_node_reclaim, data->pool);
+	}
+	data->tid = tid;
+#ifdef TREE_STATS
+	memset(&data->stats, 0, sizeof(data->stats));
+#endif
+
+	return data;
+}
+
+/*
+ * Releases thread data of a thread that no longer operates on any tree. It
+ * is recycled by a later avl_thread_data_new, see avl_free_data.
+ */
+void avl_thread_data_free(void *thread_data)
+{
+	avl_thread_data_t *data = thread_data;
+
+	pthread_mutex_lock(&avl_free_data_lock);
+	data->next_free = avl_free_data;
+	avl_free_data = data;
+	pthread_mutex_unlock(&avl_free_data_lock);
+}
+
+void avl_thread_data_print(void *thread_data)
+{
+	avl_thread_data_t *data = thread_data;
+
+	node_pool_stats_print(&data->pool[0], "Node pool");
+#ifdef NODE_SPLIT
+	node_pool_stats_print(&data->pool[1], "Cold pool");
+#endif
+#ifdef NODE_SIDE_LOCKS
+	node_pool_stats_print(&data->pool[NODE_NR_POOLS - 1], "Side pool");
+#endif
+#ifdef TREE_STATS
+	_avl_stats_print(&data->stats);
+#endif
+}
+
+void avl_thread_data_add(void *d1, void *d2, void *dst)
+{
+	avl_thread_data_t *data1 = d1, *data2 = d2, *dst_data = dst;
+	int i;
+
+	for (i = 0; i < NODE_NR_POOLS; i++)
+		node_pool_stats_add(&data1->pool[i], &data2->pool[i], &dst_data->pool[i]);
+#ifdef TREE_STATS
+	_avl_stats_add(&data1->stats, &data2->stats, &dst_data->stats);
+#endif
+}
+
+int avl_lookup(void *avl, void *thread_data, tree_key_t key)
 {
 	int ret;
 
+	if (KEY_IS_SENTINEL(key))
+		return 0;
+
+	_avl_enter(thread_data);
+	STATS_INC(nr_ops[STATS_LOOKUP]);
 	ret = _avl_lookup_helper(avl, key);
+	_avl_exit(thread_data);
+
+	return ret;
+}
+
+/*
+ * Looks up n keys, in any order: results[i] is set to 1 if keys[i] exists
+ * and to 0 otherwise. Returns the number of keys found.
+ */
+int avl_lookup_batch(void *avl, void *thread_data, tree_key_t *keys, int n, int *results)
+{
+	int ret;
+
+	_avl_enter(thread_data);
+	STATS_ADD(nr_ops[STATS_LOOKUP], n);
+	ret = _avl_lookup_batch_helper(avl, keys, n, results);
+	_avl_exit(thread_data);
 
 	return ret;
 }
 
-int avl_insert(void *avl, void *thread_data, int key, void *value)
+int avl_insert(void *avl, void *thread_data, tree_key_t key, tree_value_t value)
 {
 	int ret;
 	avl_node_t *node;
 
-	node = avl_node_new(key, value, NULL, NULL, NULL);
+	if (KEY_IS_SENTINEL(key))
+		return 0;
 
-	ret = _avl_insert_helper(avl, node);
+	node = _avl_node_alloc(thread_data, key, value);
 
-	if (!ret) {
-		free(node);
-	}
+	_avl_enter(thread_data);
+	STATS_INC(nr_ops[STATS_INSERT]);
+	ret = _avl_insert_helper(avl, key, node, NULL);
+	_avl_exit(thread_data);
+
+	if (ret)
+		_avl_size_add(avl, thread_data, 1);
+	else
+		_avl_node_release(thread_data, node);
 
 	return ret;
 }
 
-int avl_delete(void *avl, void *thread_data, int key)
+int avl_delete(void *avl, void *thread_data, tree_key_t key)
 {
 	int ret;
 	avl_node_t *node_to_delete=NULL;
 
-	ret = _avl_delete_helper(avl, key, node_to_delete);
+	if (KEY_IS_SENTINEL(key))
+		return 0;
+
+	_avl_enter(thread_data);
+	STATS_INC(nr_ops[STATS_DELETE]);
+	ret = _avl_delete_helper(avl, key, &node_to_delete);
 
 	if (ret) {
-		free(node_to_delete);
+		_avl_retire(thread_data, node_to_delete);
 	}
+	_avl_exit(thread_data);
+	_avl_size_add(avl, thread_data, -ret);
 
 	return ret;
 }
 
+static int _avl_node_cmp(const void *a, const void *b)
+{
+	tree_key_t k1 = (*(avl_node_t * const *)a)->key, k2 = (*(avl_node_t * const *)b)->key;
+
+	return (k1 > k2) - (k1 < k2);
+}
+
+static int _avl_key_cmp(const void *a, const void *b)
+{
+	tree_key_t k1 = *(const tree_key_t *)a, k2 = *(const tree_key_t *)b;
+
+	return (k1 > k2) - (k1 < k2);
+}
+
+/*
+ * Inserts n keys, in any order, and returns how many were inserted. The keys
+ * are sorted first so that each search continues from the previous key's
+ * position; values may be NULL.
+ */
+int avl_insert_batch(void *avl, void *thread_data, tree_key_t *keys, tree_value_t *values, int n)
+{
+	int i, nr = 0, ret;
+	avl_node_t **nodes;
+	char *inserted;
+
+	XMALLOC(nodes, n + 1);
+	XMALLOC(inserted, n + 1);
+	for (i = 0; i < n; i++) {
+		if (KEY_IS_SENTINEL(keys[i]))
+			continue;
+		inserted[nr] = 0;
+		nodes[nr++] = _avl_node_alloc(thread_data, keys[i],
+		                              (values != NULL) ? values[i] : VALUE_NONE);
+	}
+	qsort(nodes, nr, sizeof(*nodes), _avl_node_cmp);
+
+	_avl_enter(thread_data);
+	STATS_ADD(nr_ops[STATS_INSERT], nr);
+	ret = _avl_insert_batch_helper(avl, nodes, nr, inserted);
+	_avl_exit(thread_data);
+	_avl_size_add(avl, thread_data, ret);
+
+	for (i = 0; i < nr; i++)
+		if (!inserted[i])
+			_avl_node_release(thread_data, nodes[i]);
+	free(inserted);
+	free(nodes);
+
+	return ret;
+}
+
+/*
+ * Deletes n keys, in any order, and returns how many were deleted.
+ */
+int avl_delete_batch(void *avl, void *thread_data, tree_key_t *keys, int n)
+{
+	int i, nr = 0, ret;
+	tree_key_t *sorted;
+	avl_node_t **nodes_to_delete;
+
+	XMALLOC(sorted, n + 1);
+	XMALLOC(nodes_to_delete, n + 1);
+	for (i = 0; i < n; i++)
+		if (!KEY_IS_SENTINEL(keys[i]))
+			sorted[nr++] = keys[i];
+	qsort(sorted, nr, sizeof(*sorted), _avl_key_cmp);
+
+	_avl_enter(thread_data);
+	STATS_ADD(nr_ops[STATS_DELETE], nr);
+	ret = _avl_delete_batch_helper(avl, sorted, nr, nodes_to_delete);
+	for (i = 0; i < ret; i++)
+		_avl_retire(thread_data, nodes_to_delete[i]);
+	_avl_exit(thread_data);
+	_avl_size_add(avl, thread_data, -ret);
+
+	free(nodes_to_delete);
+	free(sorted);
+
+	return ret;
+}
+
+/*
+ * Returns 1 and stores the value of key in *value if key exists.
+ */
+int avl_get(void *avl, void *thread_data, tree_key_t key, tree_value_t *value)
+{
+	int ret;
+
+	if (KEY_IS_SENTINEL(key))
+		return 0;
+
+	_avl_enter(thread_data);
+	STATS_INC(nr_ops[STATS_GET]);
+	ret = _avl_get_helper(avl, key, value);
+	_avl_exit(thread_data);
+
+	return ret;
+}
+
+static int _avl_upsert(avl_t *avl, avl_thread_data_t *thread_data, tree_key_t key,
+                       tree_value_t value, avl_update_t *upd)
+{
+	int ret;
+	avl_node_t *node;
+
+	node = _avl_node_alloc(thread_data, key, value);
+
+	_avl_enter(thread_data);
+	STATS_INC(nr_ops[STATS_UPDATE]);
+	ret = _avl_insert_helper(avl, key, node, upd);
+	_avl_exit(thread_data);
+
+	if (ret)
+		_avl_size_add(avl, thread_data, 1);
+	else
+		_avl_node_release(thread_data, node);
+
+	return ret;
+}
+
+/*
+ * Inserts key or overwrites the value of the existing node.
+ * Returns 1 if key was inserted, 0 if it existed; its previous value is then
+ * stored in *old_value.
+ */
+int avl_put(void *avl, void *thread_data, tree_key_t key, tree_value_t value,
+            tree_value_t *old_value)
+{
+	int ret;
+	avl_update_t upd = { .op = UPDATE_PUT, .value = value };
+
+	if (KEY_IS_SENTINEL(key))
+		return 0;
+
+	ret = _avl_upsert(avl, thread_data, key, value, &upd);
+	if (!ret && old_value != NULL)
+		*old_value = upd.old_value;
+
+	return ret;
+}
+
+/*
+ * Inserts key only if it does not exist. Returns 1 if key was inserted,
+ * otherwise 0 and the value of the existing node in *value_found.
+ */
+int avl_put_if_absent(void *avl, void *thread_data, tree_key_t key, tree_value_t value,
+                      tree_value_t *value_found)
+{
+	int ret;
+	avl_update_t upd = { .op = UPDATE_NONE };
+
+	if (KEY_IS_SENTINEL(key))
+		return 0;
+
+	ret = _avl_upsert(avl, thread_data, key, value, &upd);
+	if (!ret && value_found != NULL)
+		*value_found = upd.old_value;
+
+	return ret;
+}
+
+/*
+ * Atomically replaces the value of key with fn(key, value, arg), if key
+ * exists. fn runs under the node's succLock and must not operate on the
+ * tree. Returns 1 if key existed.
+ */
+int avl_compute_if_present(void *avl, void *thread_data, tree_key_t key,
+                           compute_fn_t fn, void *arg)
+{
+	avl_update_t upd = { .op = UPDATE_COMPUTE, .fn = fn, .arg = arg };
+
+	if (KEY_IS_SENTINEL(key))
+		return 0;
+
+	_avl_enter(thread_data);
+	STATS_INC(nr_ops[STATS_UPDATE]);
+	_avl_insert_helper(avl, key, NULL, &upd);
+	_avl_exit(thread_data);
+
+	return upd.found;
+}
+
+int avl_range_scan(void *avl, void *thread_data, tree_key_t lo, tree_key_t hi, int mode,
+                   range_scan_cb_t cb, void *arg)
+{
+	int ret;
+
+	if (lo > hi)
+		return 0;
+
+	_avl_enter(thread_data);
+	STATS_INC(nr_ops[STATS_SCAN]);
+	if (mode == RANGE_SCAN_LINEARIZABLE)
+		ret = _avl_range_scan_locked(avl, lo, hi, cb, arg);
+	else
+		ret = _avl_range_scan_weak(avl, lo, hi, cb, arg);
+	_avl_exit(thread_data);
+
+	return ret;
+}
+
+static int _avl_order(avl_t *avl, avl_thread_data_t *thread_data, tree_key_t key, int query,
+                     tree_key_t *key_found, tree_value_t *value)
+{
+	int ret;
+
+	_avl_enter(thread_data);
+	STATS_INC(nr_ops[STATS_ORDER]);
+	ret = _avl_order_helper(avl, key, query, key_found, value);
+	_avl_exit(thread_data);
+
+	return ret;
+}
+
+/*
+ * Ordered queries. Each returns 1 and stores the key found and its value in
+ * *key_found and *value (either may be NULL), or 0 if there is no such key.
+ * Any key may be passed, including the sentinels.
+ */
+int avl_ceiling(void *avl, void *thread_data, tree_key_t key, tree_key_t *key_found,
+                tree_value_t *value)
+{
+	return _avl_order(avl, thread_data, key, ORDER_CEILING, key_found, value);
+}
+
+int avl_floor(void *avl, void *thread_data, tree_key_t key, tree_key_t *key_found,
+              tree_value_t *value)
+{
+	return _avl_order(avl, thread_data, key, ORDER_FLOOR, key_found, value);
+}
+
+int avl_next(void *avl, void *thread_data, tree_key_t key, tree_key_t *key_found,
+             tree_value_t *value)
+{
+	return _avl_order(avl, thread_data, key, ORDER_NEXT, key_found, value);
+}
+
+int avl_prev(void *avl, void *thread_data, tree_key_t key, tree_key_t *key_found,
+             tree_value_t *value)
+{
+	return _avl_order(avl, thread_data, key, ORDER_PREV, key_found, value);
+}
+
+int avl_min(void *avl, void *thread_data, tree_key_t *key_found, tree_value_t *value)
+{
+	return _avl_order(avl, thread_data, KEY_MIN, ORDER_CEILING, key_found, value);
+}
+
+int avl_max(void *avl, void *thread_data, tree_key_t *key_found, tree_value_t *value)
+{
+	return _avl_order(avl, thread_data, KEY_MAX, ORDER_FLOOR, key_found, value);
+}
+
+/*
+ * Opens a cursor at the first key >= key. Every avl_cursor_next resumes from
+ * the node the previous one stopped at, without a new descent, and, like
+ * the weak range scan, reports keys that were present at some point during
+ * the iteration. The cursor keeps the epoch of thread_data entered until
+ * avl_cursor_close, which delays the reclamation of deleted nodes, so it
+ * should not be left open for long. The thread may run other operations on
+ * the tree while its cursor is open.
+ */
+void *avl_cursor_open(void *avl, void *thread_data, tree_key_t key)
+{
+	avl_cursor_t *cursor;
+
+	XMALLOC(cursor, 1);
+	cursor->avl = avl;
+	cursor->data = thread_data;
+
+	_avl_enter(thread_data);
+	STATS_INC(nr_ops[STATS_ORDER]);
+	if(key <= KEY_MIN)
+		cursor->node = LOAD_ACQ(COLD(COLD(cursor->avl->root)->parent)->succ);
+	else if(key >= KEY_MAX)
+		cursor->node = cursor->avl->root;
+	else
+		cursor->node = _avl_locate(avl, key);
+
+	return cursor;
+}
+
+/* Returns 1 and the next key and value (either may be NULL), 0 at the end. */
+int avl_cursor_next(void *cursor, tree_key_t *key, tree_value_t *value)
+{
+	avl_cursor_t *c = cursor;
+
+#ifdef TREE_STATS
+	avl_stats = (c->data != NULL) ? &c->data->stats : NULL;
+#endif
+	STATS_INC(nr_ops[STATS_ORDER]);
+	return _avl_cursor_next_helper(c, key, value);
+}
+
+void avl_cursor_close(void *cursor)
+{
+	avl_cursor_t *c = cursor;
+
+	_avl_exit(c->data);
+	free(c);
+}
+
+#ifdef AVL_ORDER_STATS
+/*
+ * Order statistics, built with -DAVL_ORDER_STATS. avl_rank returns the number
+ * of keys smaller than key, so avl_rank(KEY_MAX) is the size of the tree.
+ * avl_select stores the i-th smallest key (from 0) and its value, and
+ * returns 0 if i is out of range. Both take no locks. They are exact while
+ * no update runs; under concurrency they are approximate (see
+ * _avl_rank_helper and _avl_select_helper).
+ */
+int avl_rank(void *avl, void *thread_data, tree_key_t key)
+{
+	int ret;
+
+	_avl_enter(thread_data);
+	STATS_INC(nr_ops[STATS_ORDER]);
+	ret = _avl_rank_helper(avl, key);
+	_avl_exit(thread_data);
+
+	return ret;
+}
+
+int avl_select(void *avl, void *thread_data, int i, tree_key_t *key, tree_value_t *value)
+{
+	int ret;
+
+	_avl_enter(thread_data);
+	STATS_INC(nr_ops[STATS_ORDER]);
+	ret = _avl_select_helper(avl, i, key, value);
+	_avl_exit(thread_data);
+
+	return ret;
+}
+#endif
+
+/*
+ * Rebalances from the node of a deferred key: both heights of the node are
+ * recomputed from its children, and then rebalance rotates it if needed or
+ * carries the change up towards the root, exactly as an inline update would.
+ * Returns 0 if a trylock failed and the key has to be retried.
+ */
+static int _avl_fix(avl_t *avl, tree_key_t key)
+{
+	avl_node_t *node = _avl_locate(avl, key);
+	avl_node_t *child, *parent;
+	int bf;
+
+	if(node->key != key)
+		return 1;			//> Deleted, removeFromTree recorded its replacement
+	node_lock(&SIDE(node)->treeLock);
+	if(!NODE_VALID(node)){
+		node_unlock(&SIDE(node)->treeLock);
+		return 0;			//> Being deleted, or the key was inserted again
+	}
+
+	updateHeight(node->link[0], node, 1);
+	updateHeight(node->link[1], node, 0);
+#ifdef AVL_ORDER_STATS
+	updateSize(node);
+#endif
+	bf = GET_BALANCE_FACTOR(node);
+	if(bf >= 2 || bf <= -2){
+		child = bf >= 2 ? node->link[0] : node->link[1];
+		if(node_trylock(&SIDE(child)->treeLock) != 0){
+			node_unlock(&SIDE(node)->treeLock);
+			return 0;
+		}
+		rebalance(avl, node, child, bf >= 2);
+		return 1;
+	}
+
+	parent = lockParent(avl, node);
+	rebalance(avl, parent, node, parent->link[0] == node);
+	return 1;
+}
+
+/*
+ * Fixes the keys recorded in the shards first, first + step, ... Returns 1
+ * if all of them were empty.
+ */
+static int _avl_maintenance_pass(avl_t *avl, avl_thread_data_t *data, int first, int step)
+{
+	avl_relaxed_t *relaxed = avl->relaxed;
+	tree_key_t keys[RELAXED_SHARD_SIZE];
+	cm_retry_t r;
+	int i, j, nr, idle = 1;
+
+	for(i = first; i < RELAXED_NR_SHARDS; i += step){
+		avl_relaxed_shard_t *shard = &relaxed->shards[i];
+
+		if(LOAD(shard->nr) == 0)
+			continue;
+		node_lock(&shard->lock);
+		nr = shard->nr;
+		memcpy(keys, shard->keys, nr * sizeof(*keys));
+		STORE(shard->nr, 0);
+		node_unlock(&shard->lock);
+
+		idle = 0;
+		_avl_enter(data);
+		for(j = 0; j < nr; j++){
+			cm_begin(&r, &avl->cm);
+			while(!_avl_fix(avl, keys[j]))
+				cm_wait(&r);
+			_avl_cm_end(&r);
+		}
+		_avl_exit(data);
+	}
+
+	return idle;
+}
+
+static void *_avl_maintenance_worker(void *arg)
+{
+	avl_maintenance_thread_t *mt = arg;
+	avl_relaxed_t *relaxed = mt->avl->relaxed;
+	avl_thread_data_t *data = avl_thread_data_new(-1 - mt->id);
+	int stop;
+
+	while(1){
+		stop = LOAD_ACQ(relaxed->stop);
+		if(_avl_maintenance_pass(mt->avl, data, mt->id, relaxed->nr_threads)){
+			if(stop)
+				break;		//> Drained after the stop request
+			usleep(RELAXED_IDLE_US);
+		}
+	}
+
+	avl_thread_data_free(data);
+	return NULL;
+}
+
+/*
+ * Switches the tree to relaxed rebalancing: from now on inserts and deletes
+ * only record where heights may have become stale, and nr_threads background
+ * threads rotate and update the heights. Until they catch up the tree may be
+ * less balanced than an AVL tree, but it is always a valid search tree.
+ * Returns the number of maintenance threads started, 0 on failure.
+ */
+int avl_maintenance_start(void *avl, int nr_threads)
+{
+	avl_t *t = avl;
+	avl_relaxed_t *relaxed = t->relaxed;
+	int i;
+
+	if(nr_threads <= 0 || (relaxed != NULL && relaxed->enabled))
+		return 0;
+	if(relaxed == NULL){
+		XMALLOC_ALIGNED(relaxed, 1, CACHE_LINE_SIZE);
+		memset(relaxed, 0, sizeof(*relaxed));
+		for(i = 0; i < RELAXED_NR_SHARDS; i++)
+			node_lock_init(&relaxed->shards[i].lock);
+		STORE_REL(t->relaxed, relaxed);
+	}
+	for(i = 0; i < RELAXED_NR_SHARDS; i++){
+		relaxed->shards[i].nr_deferred = 0;
+		relaxed->shards[i].nr_full = 0;
+	}
+
+	relaxed->stop = 0;
+	relaxed->nr_threads = nr_threads;
+	XMALLOC(relaxed->threads, nr_threads);
+	for(i = 0; i < nr_threads; i++){
+		relaxed->threads[i].avl = t;
+		relaxed->threads[i].id = i;
+		if(pthread_create(&relaxed->threads[i].tid, NULL, _avl_maintenance_worker,
+		                  &relaxed->threads[i]) != 0)
+			break;
+	}
+	if(i < nr_threads){			//> Every shard needs its thread
+		STORE_REL(relaxed->stop, 1);
+		while(i-- > 0)
+			pthread_join(relaxed->threads[i].tid, NULL);
+		free(relaxed->threads);
+		return 0;
+	}
+
+	STORE_REL(relaxed->enabled, 1);
+	return nr_threads;
+}
+
+/*
+ * Returns to inline rebalancing once every recorded violation is fixed. The
+ * maintenance threads drain their shards and exit; a violation that one of
+ * them recorded in the shard of a thread that had already exited is fixed
+ * here. Updates keep deferring until all shards are empty, so the tree is a
+ * strict AVL tree again when this returns. Call it while no update runs; a
+ * violation that an update records concurrently may otherwise be left
+ * behind. Stores the number of violations deferred since
+ * avl_maintenance_start in nr_deferred, and that of the updates that
+ * rebalanced inline because their shard was full in nr_full.
+ */
+void avl_maintenance_stop(void *avl, unsigned long *nr_deferred, unsigned long *nr_full)
+{
+	avl_t *t = avl;
+	avl_relaxed_t *relaxed = t->relaxed;
+	avl_thread_data_t *data;
+	int i;
+
+	*nr_deferred = 0;
+	*nr_full = 0;
+	if(relaxed == NULL || !relaxed->enabled)
+		return;
+
+	STORE_REL(relaxed->stop, 1);
+	for(i = 0; i < relaxed->nr_threads; i++)
+		pthread_join(relaxed->threads[i].tid, NULL);
+	data = avl_thread_data_new(-1 - relaxed->nr_threads);
+	while(!_avl_maintenance_pass(t, data, 0, 1))
+		;
+	avl_thread_data_free(data);
+	STORE_REL(relaxed->enabled, 0);
+	free(relaxed->threads);
+
+	for(i = 0; i < RELAXED_NR_SHARDS; i++){
+		*nr_deferred += relaxed->shards[i].nr_deferred;
+		*nr_full += relaxed->shards[i].nr_full;
+	}
+}
+
+static void _avl_top_collect(avl_top_t *top, avl_node_t *node, int depth, int levels)
+{
+	if(node == NULL || depth == levels)
+		return;
+	_avl_top_collect(top, LOAD_ACQ(node->link[0]), depth + 1, levels);
+	top->nodes[top->nr] = node;
+	top->keys[top->nr] = node->key;
+	top->depths[top->nr] = depth;
+	top->nr++;
+	_avl_top_collect(top, LOAD_ACQ(node->link[1]), depth + 1, levels);
+}
+
+/*
+ * Copies the top levels of the tree. A node that a concurrent rotation or
+ * delete moved while it was read may be seen twice or out of order; the
+ * copy is then dropped. Returns NULL if the copy is not strictly sorted or
+ * the tree is empty.
+ */
+static avl_top_t *_avl_top_build(avl_t *avl, int levels)
+{
+	int i, max = (1 << levels) - 1;
+	avl_top_t *top;
+	char *mem;
+
+	XMALLOC(mem, sizeof(*top) + max * (sizeof(avl_node_t *) + sizeof(tree_key_t) + 1));
+	top = (avl_top_t *)mem;
+	top->dead = 0;
+	top->nr = 0;
+	top->nodes = (avl_node_t **)(top + 1);
+	top->keys = (tree_key_t *)(top->nodes + max);
+	top->depths = (unsigned char *)(top->keys + max);
+	_avl_top_collect(top, LOAD_ACQ(avl->root->link[0]), 0, levels);
+
+	for(i = 1; i < top->nr; i++)
+		if(top->keys[i - 1] >= top->keys[i])
+			break;
+	if(top->nr == 0 || i < top->nr){
+		free(top);
+		return NULL;
+	}
+	return top;
+}
+
+/*
+ * Replaces the current snapshot with top unless one of its nodes has been
+ * deleted in the meantime. top is stored in cache->pending before the
+ * deleted flags are checked, see _avl_top_forget. Replaced and dropped
+ * snapshots may still be read and are retired.
+ */
+static void _avl_top_publish(avl_t *avl, avl_top_cache_t *cache, avl_top_t *top)
+{
+	avl_top_t *old = avl->top;
+	int i;
+
+	__atomic_store_n(&cache->pending, top, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for(i = 0; i < top->nr; i++)
+		if(!NODE_VALID(top->nodes[i]))
+			break;
+	if(i < top->nr){
+		STORE_REL(cache->pending, NULL);
+		epoch_retire(&avl_epoch, &cache->retired, top);
+		cache->nr_discarded++;
+		return;
+	}
+
+	STORE_REL(avl->top, top);
+	STORE_REL(cache->pending, NULL);
+	cache->nr_published++;
+	if(old != NULL){
+		if(LOAD(old->dead))
+			cache->nr_dead++;
+		epoch_retire(&avl_epoch, &cache->retired, old);
+	}
+}
+
+static void *_avl_top_worker(void *arg)
+{
+	avl_t *avl = arg;
+	avl_top_cache_t *cache = avl->top_cache;
+	avl_thread_data_t *data = avl_thread_data_new(-1);
+	avl_top_t *top;
+
+	while(!LOAD_ACQ(cache->stop)){
+		_avl_enter(data);
+		top = _avl_top_build(avl, cache->levels);
+		if(top != NULL)
+			_avl_top_publish(avl, cache, top);
+		else
+			cache->nr_discarded++;
+		_avl_exit(data);
+		usleep(cache->period_ms * 1000);
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts a thread that copies the top levels of the tree every period_ms
+ * milliseconds. Descents then start from the deepest copied node on their
+ * path, so the nodes near the root are no longer read by every operation.
+ * Meanwhile each delete and each rotation also looks for its node in the
+ * copy. Works with relaxed rebalancing as well. Call it, like
+ * avl_top_cache_stop, while no other operation runs on the tree.
+ * Returns 1 on success, 0 if levels is not in [1, TOP_MAX_LEVELS] or the
+ * snapshot is already enabled.
+ */
+int avl_top_cache_start(void *avl, int levels, int period_ms)
+{
+	avl_t *t = avl;
+	avl_top_cache_t *cache = t->top_cache;
+
+	if(levels < 1 || levels > TOP_MAX_LEVELS || period_ms < 1 ||
+	   (cache != NULL && cache->enabled))
+		return 0;
+	if(cache == NULL){
+		XMALLOC_ALIGNED(cache, 1, CACHE_LINE_SIZE);
+		memset(cache, 0, sizeof(*cache));
+		epoch_thread_register(&avl_epoch, &cache->retired, NULL, NULL);
+		STORE_REL(t->top_cache, cache);
+	}
+	cache->levels = levels;
+	cache->period_ms = period_ms;
+	cache->stop = 0;
+	cache->nr_published = cache->nr_discarded = cache->nr_dead = 0;
+
+	STORE_REL(cache->enabled, 1);
+	if(pthread_create(&cache->tid, NULL, _avl_top_worker, t) != 0){
+		STORE_REL(cache->enabled, 0);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Stops the rebuilder thread; descents start from the root again. Unlike
+ * the start, this may run concurrently with other operations.
+ */
+void avl_top_cache_stop(void *avl)
+{
+	avl_t *t = avl;
+	avl_top_cache_t *cache = t->top_cache;
+	avl_top_t *top;
+
+	if(cache == NULL || !cache->enabled)
+		return;
+
+	STORE_REL(cache->stop, 1);
+	pthread_join(cache->tid, NULL);
+	top = t->top;
+	STORE_REL(t->top, NULL);
+	STORE_REL(cache->enabled, 0);
+	if(top != NULL){
+		if(LOAD(top->dead))
+			cache->nr_dead++;
+		epoch_retire(&avl_epoch, &cache->retired, top);
+	}
+
+	printf("Top cache: %lu snapshots published, %lu of them invalidated, %lu dropped\n",
+	       cache->nr_published, cache->nr_dead, cache->nr_discarded);
+}
+
+/*
+ * Number of keys in the tree, from counters that every thread updates after
+ * its successful inserts and deletes (see snapshot.h). Exact while no update
+ * runs; otherwise off by at most the number of updates in flight.
+ */
+long avl_size(void *avl)
+{
+	return size_counter_read(&((avl_t *)avl)->size);
+}
+
+#ifdef TREE_SNAPSHOT
+/*
+ * Copies the nodes of the succ chain that belong to snap. A node that was
+ * deleted keeps its last value.
+ */
+static void _avl_snapshot_walk(avl_t *avl, snapshot_t *snap)
+{
+	avl_node_t *node = LOAD_ACQ(COLD(COLD(avl->root)->parent)->succ);
+	tree_value_t value;
+	int deleted;
+
+	while(node != avl->root){
+		deleted = !_avl_read_node(node, &value);
+		if(deleted)
+			value = LOAD(COLD(node)->value);
+		if(snapshot_visible(&avl->snapshot, snap, deleted, &COLD(node)->ins_ts,
+		                    &COLD(node)->del_ts))
+			snapshot_add(snap, node->key, value);
+		node = LOAD_ACQ(COLD(node)->succ);
+	}
+}
+
+/*
+ * Point-in-time copy of the keys of the tree and their values, built with
+ * -DTREE_SNAPSHOT (see snapshot.h). Updates continue while it is taken;
+ * concurrent calls are serialized. avl_snapshot_next then returns the keys
+ * in increasing order, and avl_snapshot_close frees the copy.
+ */
+void *avl_snapshot_open(void *avl, void *thread_data)
+{
+	snapshot_t *snap;
+
+	_avl_enter(thread_data);
+	snap = snapshot_begin(&((avl_t *)avl)->snapshot);
+	_avl_snapshot_walk(avl, snap);
+	snapshot_end(&((avl_t *)avl)->snapshot, snap);
+	_avl_exit(thread_data);
+
+	return snap;
+}
+
+long avl_snapshot_size(void *snapshot)
+{
+	return ((snapshot_t *)snapshot)->nr;
+}
+
+int avl_snapshot_next(void *snapshot, tree_key_t *key, tree_value_t *value)
+{
+	return snapshot_next(snapshot, key, value);
+}
+
+void avl_snapshot_close(void *snapshot)
+{
+	snapshot_free(snapshot);
+}
+#endif
+
 int avl_validate(void *avl)
 {
 	int ret;
@@ -693,14 +3052,224 @@ int avl_validate(void *avl)
 	return ret;
 }
 
+/*
+ * Selects where the nodes of thread data created afterwards, and the nodes
+ * of warmup and bulk_load, are allocated (NUMA_POLICY_*). Under a NUMA policy
+ * the warmup nodes come from a pool as well and, like those of bulk_load,
+ * must be deleted with a thread data. Returns the policy in effect, which is
+ * NUMA_POLICY_FIRST_TOUCH if the tree was built without -DTREE_NUMA or the
+ * machine has a single NUMA node.
+ */
+int avl_numa_policy(int policy)
+{
+	numa_policy = (node_alloc_nr_nodes() > 1) ? policy : NUMA_POLICY_FIRST_TOUCH;
+	return numa_policy;
+}
+
 int avl_warmup(void *avl, int nr_nodes, int max_key, 
                unsigned int seed, int force)
 {
 	int ret;
 	ret = _avl_warmup_helper((avl_t *)avl, nr_nodes, max_key, seed, force);
+	_avl_size_add(avl, NULL, ret);
+	return ret;
+}
+
+/*
+ * Loads n keys, sorted in strictly increasing order, into an empty tree in
+ * O(n) without taking any lock; values may be NULL. Up to nr_threads threads
+ * build disjoint subtrees. No other operation may run on the tree during the
+ * load. The nodes come from a single allocation and, like pool nodes, must
+ * be deleted with a thread data.
+ * Returns n, or 0 if the tree is not empty or the keys are not sorted.
+ */
+int avl_bulk_load(void *avl, tree_key_t *keys, tree_value_t *values, int n, int nr_threads)
+{
+	int ret;
+	ret = _avl_bulk_load_helper((avl_t *)avl, keys, values, n, nr_threads);
+	_avl_size_add(avl, NULL, ret);
+	return ret;
+}
+
+/*
+ * Writes the keys of the tree and their values, in key order, to the
+ * checkpoint file path (see checkpoint.h). Built with -DTREE_SNAPSHOT the
+ * checkpoint is a point-in-time snapshot; otherwise it is a walk of the succ
+ * chain that may or may not see the updates that run concurrently.
+ * Returns the number of keys written, or -1 if the file cannot be written.
+ */
+long avl_save(void *avl, void *thread_data, const char *path)
+{
+	tree_key_t *keys;
+	tree_value_t *values;
+	long n = 0;
+	int ret;
+#ifdef TREE_SNAPSHOT
+	snapshot_t *snap;
+
+	snap = avl_snapshot_open(avl, thread_data);
+	XMALLOC(keys, snap->nr + 1);
+	XMALLOC(values, snap->nr + 1);
+	while(snapshot_next(snap, &keys[n], &values[n]))
+		n++;
+	snapshot_free(snap);
+#else
+	avl_node_t *node;
+	long size = 1024;
+
+	XMALLOC(keys, size);
+	XMALLOC(values, size);
+	_avl_enter(thread_data);
+	node = LOAD_ACQ(COLD(COLD(((avl_t *)avl)->root)->parent)->succ);
+	while(node != ((avl_t *)avl)->root){
+		if(n == size){
+			size *= 2;
+			keys = realloc(keys, size * sizeof(*keys));
+			values = realloc(values, size * sizeof(*values));
+			if(keys == NULL || values == NULL){
+				fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+				exit(1);
+			}
+		}
+		if(_avl_read_node(node, &values[n]))
+			keys[n++] = node->key;
+		node = LOAD_ACQ(COLD(node)->succ);
+	}
+	_avl_exit(thread_data);
+#endif
+
+	ret = checkpoint_write(path, keys, values, n);
+	free(keys);
+	free(values);
+	return (ret < 0) ? -1 : n;
+}
+
+/*
+ * Loads the checkpoint file path into an empty tree with bulk_load, reading
+ * the keys and values straight from the mapped file. The same restrictions
+ * as for bulk_load apply. Returns the number of keys loaded, or -1 if the
+ * file is missing, corrupt or was written by a build with other key or
+ * value types, or if the tree is not empty.
+ */
+long avl_load(void *avl, const char *path, int nr_threads)
+{
+	checkpoint_map_t map;
+	long ret;
+
+	if(checkpoint_map(path, &map) < 0)
+		return -1;
+	ret = avl_bulk_load(avl, map.keys, map.values, map.nr_keys, nr_threads);
+	if(ret == 0 && map.nr_keys > 0)
+		ret = -1;
+	checkpoint_unmap(&map);
 	return ret;
 }
 
+/*
+ * Starts logging every successful insert, delete and value update to the
+ * write-ahead log at path, with a group commit every period_us microseconds
+ * (see wal.h). An existing log is appended to; replay it first with
+ * avl_wal_replay. Returns 1, or 0 if the log cannot be opened or is
+ * already on.
+ */
+int avl_wal_start(void *avl, const char *path, int period_us)
+{
+	wal_t *wal;
+
+	if(((avl_t *)avl)->wal != NULL || period_us < 1)
+		return 0;
+	wal = wal_open(path, period_us);
+	if(wal == NULL)
+		return 0;
+	STORE_REL(((avl_t *)avl)->wal, wal);
+	return 1;
+}
+
+/* Waits until every update logged so far is durable. */
+void avl_wal_sync(void *avl)
+{
+	wal_t *wal = LOAD_ACQ(((avl_t *)avl)->wal);
+
+	if(wal != NULL)
+		wal_sync(wal);
+}
+
+/*
+ * Flushes the log and stops logging. No update may run meanwhile.
+ * Returns the number of records written since avl_wal_start.
+ */
+long avl_wal_stop(void *avl)
+{
+	wal_t *wal = ((avl_t *)avl)->wal;
+
+	if(wal == NULL)
+		return 0;
+	STORE_REL(((avl_t *)avl)->wal, NULL);
+	return wal_close(wal);
+}
+
+/*
+ * Applies the write-ahead log at path: the last record of every key decides
+ * whether the key is present and its value. An empty tree is built with
+ * bulk_load, otherwise the keys are deleted and inserted again with the batch
+ * operations, WAL_REPLAY_BATCH keys at a time. No other operation may run
+ * meanwhile. Returns the number of records, or -1 if the log cannot be read.
+ */
+long avl_wal_replay(void *avl, void *thread_data, const char *path, int nr_threads)
+{
+	wal_record_t *records;
+	tree_key_t *keys;
+	tree_value_t *values;
+	long n, nr_keys, nr_present = 0, i, len;
+
+	n = wal_read(path, &records);
+	if(n < 0)
+		return -1;
+	nr_keys = wal_last_per_key(records, n);
+	XMALLOC(keys, nr_keys + 1);
+	XMALLOC(values, nr_keys + 1);
+
+	if(avl_size(avl) != 0){
+		for(i = 0; i < nr_keys; i++)
+			keys[i] = records[i].key;
+		for(i = 0; i < nr_keys; i += WAL_REPLAY_BATCH){
+			len = (nr_keys - i < WAL_REPLAY_BATCH) ? nr_keys - i : WAL_REPLAY_BATCH;
+			avl_delete_batch(avl, thread_data, keys + i, len);
+		}
+	}
+	for(i = 0; i < nr_keys; i++){
+		if((records[i].lsn_op & 3) != WAL_INSERT)
+			continue;
+		keys[nr_present] = records[i].key;
+		values[nr_present++] = records[i].value;
+	}
+	if(avl_size(avl) == 0){
+		avl_bulk_load(avl, keys, values, nr_present, nr_threads);
+	}else{
+		for(i = 0; i < nr_present; i += WAL_REPLAY_BATCH){
+			len = (nr_present - i < WAL_REPLAY_BATCH) ? nr_present - i : WAL_REPLAY_BATCH;
+			avl_insert_batch(avl, thread_data, keys + i, values + i, len);
+		}
+	}
+
+	free(keys);
+	free(values);
+	free(records);
+	return n;
+}
+
+/*
+ * Selects the contention manager of the lock retry loops of this tree
+ * (CONTENTION_*, see contention.h). yield_after sets the failures in a row
+ * before a thread yields, or the starting point of CONTENTION_ADAPTIVE;
+ * 0 keeps the current one. May be called while the tree is in use. Returns
+ * 1, or 0 if policy or yield_after is out of range.
+ */
+int avl_contention(void *avl, int policy, int yield_after)
+{
+	return contention_config(&((avl_t *)avl)->cm, policy, yield_after);
+}
+
 char *avl_name()
 {
 	return "avl_logical_ordering";
@@ -0,0 +1,67 @@
+#ifndef KEY_H
+#define KEY_H
+
+/*
+ * Key and value types of the tree.
+ * Both default to the original int/void * pair and can be overridden at
+ * compile time with any scalar type, e.g.
+ *   -DKEY_TYPE=long -DKEY_MIN=LONG_MIN -DKEY_MAX=LONG_MAX -DVALUE_TYPE=long
+ * KEY_MIN and KEY_MAX are the keys of the two sentinel nodes and therefore
+ * cannot be stored in the tree. A scalar VALUE_TYPE is stored inline in the
+ * node, so small payloads do not need to be boxed behind a pointer.
+ */
+
+#include <limits.h>
+
+#ifndef KEY_TYPE
+#define KEY_TYPE int
+#define KEY_MIN INT_MIN
+#define KEY_MAX INT_MAX
+#endif
+
+#if !defined(KEY_MIN) || !defined(KEY_MAX)
+#error "KEY_MIN and KEY_MAX must be defined together with KEY_TYPE"
+#endif
+
+#ifndef VALUE_TYPE
+#define VALUE_TYPE void *
+#endif
+
+typedef KEY_TYPE tree_key_t;
+typedef VALUE_TYPE tree_value_t;
+
+#define VALUE_NONE ((tree_value_t)0)
+#define KEY_IS_SENTINEL(key) ((key) <= KEY_MIN || (key) >= KEY_MAX)
+
+/* Range scan callback, a non-zero return value stops the scan. */
+typedef int (*range_scan_cb_t)(tree_key_t key, tree_value_t value, void *arg);
+
+/* Read-modify-write function of *_compute_if_present, returns the new value. */
+typedef tree_value_t (*compute_fn_t)(tree_key_t key, tree_value_t value, void *arg);
+
+#define RANGE_SCAN_WEAK 0
+#define RANGE_SCAN_LINEARIZABLE 1
+
+/*
+ * Node placement policies of *_numa_policy. NUMA_POLICY_LOCAL allocates the
+ * nodes of every thread on its own NUMA node, NUMA_POLICY_INTERLEAVE does the
+ * same but spreads the nodes of warmup and bulk_load, and thus the top of the
+ * tree, over all NUMA nodes.
+ */
+#define NUMA_POLICY_FIRST_TOUCH 0
+#define NUMA_POLICY_LOCAL 1
+#define NUMA_POLICY_INTERLEAVE 2
+
+/*
+ * Contention managers of *_contention, see contention.h. They decide what a
+ * thread does after a failed attempt in a lock retry loop: retry at once,
+ * pause, back off exponentially, yield the cpu after a number of failures
+ * in a row, or yield after a number of failures that adapts to the contention.
+ */
+#define CONTENTION_SPIN 0
+#define CONTENTION_PAUSE 1
+#define CONTENTION_BACKOFF 2
+#define CONTENTION_YIELD 3
+#define CONTENTION_ADAPTIVE 4
+
+#endif /* KEY_H */
@@ -0,0 +1,123 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+/*
+ * Per-node locks.
+ * By default every lock is a pthread_spinlock_t. Two compact alternatives
+ * can be selected at compile time:
+ *   -DNODE_LOCK_TTAS   1-byte test-and-test-and-set lock with exponential
+ *                      backoff
+ *   -DNODE_LOCK_FUTEX  4-byte lock that spins briefly and then sleeps on a
+ *                      futex, for runs with more threads than cores
+ * Both define NODE_LOCK_COMPACT, which lets the trees shrink the remaining
+ * node fields. All trylock functions return 0 on success, like
+ * pthread_spin_trylock.
+ */
+
+#include <pthread.h>
+
+#include "atomics.h"
+
+#if defined(NODE_LOCK_TTAS) && defined(NODE_LOCK_FUTEX)
+#error "NODE_LOCK_TTAS and NODE_LOCK_FUTEX are mutually exclusive"
+#endif
+
+#if defined(NODE_LOCK_TTAS)
+
+#define NODE_LOCK_COMPACT
+#define NODE_LOCK_MIN_BACKOFF 4
+#define NODE_LOCK_MAX_BACKOFF 1024
+
+typedef unsigned char node_lock_t;
+
+static inline void node_lock_init(node_lock_t *lock)
+{
+	*lock = 0;
+}
+
+static inline void node_lock(node_lock_t *lock)
+{
+	unsigned int i, backoff = NODE_LOCK_MIN_BACKOFF;
+
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+		do {
+			for (i = 0; i < backoff; i++)
+				cpu_relax();
+			if (backoff < NODE_LOCK_MAX_BACKOFF)
+				backoff <<= 1;
+		} while (__atomic_load_n(lock, __ATOMIC_RELAXED));
+	}
+}
+
+static inline int node_trylock(node_lock_t *lock)
+{
+	if (__atomic_load_n(lock, __ATOMIC_RELAXED))
+		return 1;
+	return __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void node_unlock(node_lock_t *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+#elif defined(NODE_LOCK_FUTEX)
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define NODE_LOCK_COMPACT
+#define NODE_LOCK_SPINS 128
+
+typedef int node_lock_t;		//> 0 => unlocked, 1 => locked, 2 => locked with waiters
+
+static inline void node_lock_init(node_lock_t *lock)
+{
+	*lock = 0;
+}
+
+static inline void node_lock(node_lock_t *lock)
+{
+	int i, c;
+
+	for (i = 0; i < NODE_LOCK_SPINS; i++) {
+		c = 0;
+		if (__atomic_compare_exchange_n(lock, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+		cpu_relax();
+	}
+
+	if (c != 2)
+		c = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+	while (c != 0) {
+		syscall(SYS_futex, lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+		c = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static inline int node_trylock(node_lock_t *lock)
+{
+	int c = 0;
+
+	return !__atomic_compare_exchange_n(lock, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void node_unlock(node_lock_t *lock)
+{
+	if (__atomic_exchange_n(lock, 0, __ATOMIC_RELEASE) == 2)
+		syscall(SYS_futex, lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+#else
+
+typedef pthread_spinlock_t node_lock_t;
+
+#define node_lock_init(lock) pthread_spin_init(lock, PTHREAD_PROCESS_SHARED)
+#define node_lock(lock) pthread_spin_lock(lock)
+#define node_trylock(lock) pthread_spin_trylock(lock)
+#define node_unlock(lock) pthread_spin_unlock(lock)
+
+#endif
+
+#endif /* LOCK_H */
@@ -0,0 +1,295 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * Element count and point-in-time snapshots.
+ *
+ * size_counter_t counts the elements of a tree in SIZE_NR_STRIPES cache-line
+ * padded stripes. Every thread adds its successful inserts and deletes to
+ * the stripe of its tid, so updates on different stripes never share a
+ * cache line, and size_counter_read sums the stripes. The sum is exact while
+ * no update runs; under concurrent updates it is off by at most the number
+ * of updates in flight.
+ *
+ * Built with -DTREE_SNAPSHOT, every node also carries the times at which it
+ * was inserted and deleted, read from a clock that only snapshots advance.
+ * An update stamps its node after it has linked it into, or marked it
+ * deleted in, the logical ordering layout; a snapshot that finds a node
+ * still unstamped stamps it itself with the current time, which is past the
+ * snapshot's own time. Lookups and gets stamp the insert of the node they
+ * found, and its delete if they saw it deleted, before they return: once a
+ * reader has observed an update, no later snapshot may order it after its
+ * own time. A snapshot at time ts walks the succ chain and keeps
+ * the nodes inserted at or before ts and not deleted by then. Nodes deleted
+ * after ts may already be unlinked when the walk reaches them: while a
+ * snapshot runs, deletes copy their node into a log before unlinking it,
+ * and the snapshot merges the entries of the log that were live at ts. The
+ * key set of a snapshot is therefore exactly the one at ts, without
+ * blocking any update. Values are those of the nodes when they are copied.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "alloc.h"
+#include "key.h"
+
+#define SIZE_NR_STRIPES 64
+#define SIZE_CACHE_LINE_SIZE 64
+
+typedef struct {
+	long count;
+} __attribute__((aligned(SIZE_CACHE_LINE_SIZE))) size_stripe_t;
+
+typedef struct {
+	size_stripe_t stripes[SIZE_NR_STRIPES];
+} size_counter_t;
+
+static inline void size_counter_init(size_counter_t *c)
+{
+	int i;
+
+	for (i = 0; i < SIZE_NR_STRIPES; i++)
+		c->stripes[i].count = 0;
+}
+
+/*
+ * Threads without a thread data (warmup, bulk load) use stripe 0. Helper
+ * threads have negative tids, hence the unsigned modulo.
+ */
+static inline void size_counter_add(size_counter_t *c, int tid, long n)
+{
+	if (n != 0)
+		__atomic_fetch_add(&c->stripes[(unsigned int)tid % SIZE_NR_STRIPES].count, n, __ATOMIC_RELAXED);
+}
+
+static inline long size_counter_read(size_counter_t *c)
+{
+	long sum = 0;
+	int i;
+
+	for (i = 0; i < SIZE_NR_STRIPES; i++)
+		sum += __atomic_load_n(&c->stripes[i].count, __ATOMIC_RELAXED);
+	return sum;
+}
+
+#ifdef TREE_SNAPSHOT
+typedef unsigned long snapshot_ts_t;
+#define SNAPSHOT_TS_PENDING ULONG_MAX	//> Not stamped yet
+
+typedef struct {
+	tree_key_t key;
+	tree_value_t value;
+} snapshot_entry_t;
+
+typedef struct snapshot_log_entry {
+	snapshot_entry_t entry;
+	snapshot_ts_t ins_ts, del_ts;
+	struct snapshot_log_entry *next;
+} snapshot_log_entry_t;
+
+typedef struct {
+	snapshot_ts_t clock;
+	int active;			//> Deletes copy their node into log while set
+	snapshot_log_entry_t *log;
+	pthread_mutex_t lock;		//> Serializes snapshots
+} snapshot_domain_t;
+
+typedef struct {
+	snapshot_ts_t ts;
+	int nr, size, pos;
+	snapshot_entry_t *entries;	//> Sorted by key
+} snapshot_t;
+
+static inline void snapshot_domain_init(snapshot_domain_t *dom)
+{
+	dom->clock = 0;
+	dom->active = 0;
+	dom->log = NULL;
+	pthread_mutex_init(&dom->lock, NULL);
+}
+
+static inline void _snapshot_help(snapshot_domain_t *dom, snapshot_ts_t *ts)
+{
+	snapshot_ts_t pending = SNAPSHOT_TS_PENDING;
+
+	if (__atomic_load_n(ts, __ATOMIC_SEQ_CST) == SNAPSHOT_TS_PENDING)
+		__atomic_compare_exchange_n(ts, &pending, __atomic_load_n(&dom->clock, __ATOMIC_SEQ_CST),
+		                            0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Stamps an update that is already visible in the logical ordering layout.
+ * The fence pairs with the one in snapshot_begin: a stamp that reads a time
+ * up to ts makes the update visible to the walk of the snapshot at ts.
+ */
+static inline void snapshot_stamp(snapshot_domain_t *dom, snapshot_ts_t *ts)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	_snapshot_help(dom, ts);
+}
+
+/*
+ * Called by a lookup or get that found a node with its key, after it read
+ * the node's deleted flag. The update the reader observed may not be stamped
+ * yet; stamping it here gives it a time no later than that of any snapshot
+ * that begins after the reader returns.
+ */
+static inline void snapshot_observe(snapshot_domain_t *dom, int deleted, snapshot_ts_t *ins_ts,
+                                    snapshot_ts_t *del_ts)
+{
+	_snapshot_help(dom, ins_ts);
+	if (deleted)
+		_snapshot_help(dom, del_ts);
+}
+
+/*
+ * Called for a node that was marked deleted and is still linked into the
+ * logical ordering layout, with its succLock held.
+ */
+static inline void snapshot_delete(snapshot_domain_t *dom, tree_key_t key, tree_value_t value,
+                                   snapshot_ts_t *ins_ts, snapshot_ts_t *del_ts)
+{
+	snapshot_log_entry_t *e;
+
+	snapshot_stamp(dom, ins_ts);	//> The insert may not have stamped it yet
+	snapshot_stamp(dom, del_ts);
+	if (!__atomic_load_n(&dom->active, __ATOMIC_SEQ_CST))
+		return;
+
+	XMALLOC(e, 1);
+	e->entry.key = key;
+	e->entry.value = value;
+	e->ins_ts = __atomic_load_n(ins_ts, __ATOMIC_SEQ_CST);
+	e->del_ts = __atomic_load_n(del_ts, __ATOMIC_SEQ_CST);
+	e->next = __atomic_load_n(&dom->log, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&dom->log, &e->next, e, 1,
+	                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		;
+}
+
+/* Starts a snapshot at the current time; the caller then walks the succ chain. */
+static inline snapshot_t *snapshot_begin(snapshot_domain_t *dom)
+{
+	snapshot_t *snap;
+
+	XMALLOC(snap, 1);
+	snap->nr = 0;
+	snap->pos = 0;
+	snap->size = 1024;
+	XMALLOC(snap->entries, snap->size);
+
+	pthread_mutex_lock(&dom->lock);
+	__atomic_store_n(&dom->active, 1, __ATOMIC_SEQ_CST);
+	snap->ts = __atomic_fetch_add(&dom->clock, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return snap;
+}
+
+/*
+ * Whether a node of the succ chain belongs to snap; deleted is the node's
+ * deleted flag, read before its timestamps.
+ */
+static inline int snapshot_visible(snapshot_domain_t *dom, snapshot_t *snap, int deleted,
+                                   snapshot_ts_t *ins_ts, snapshot_ts_t *del_ts)
+{
+	_snapshot_help(dom, ins_ts);
+	if (__atomic_load_n(ins_ts, __ATOMIC_SEQ_CST) > snap->ts)
+		return 0;
+	if (!deleted)
+		return 1;
+	_snapshot_help(dom, del_ts);
+	return __atomic_load_n(del_ts, __ATOMIC_SEQ_CST) > snap->ts;
+}
+
+static inline void snapshot_add(snapshot_t *snap, tree_key_t key, tree_value_t value)
+{
+	if (snap->nr == snap->size) {
+		snap->size *= 2;
+		snap->entries = realloc(snap->entries, snap->size * sizeof(*snap->entries));
+		if (snap->entries == NULL) {
+			fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+			exit(1);
+		}
+	}
+	snap->entries[snap->nr].key = key;
+	snap->entries[snap->nr++].value = value;
+}
+
+static int _snapshot_entry_cmp(const void *a, const void *b)
+{
+	tree_key_t k1 = ((const snapshot_entry_t *)a)->key, k2 = ((const snapshot_entry_t *)b)->key;
+
+	return (k1 > k2) - (k1 < k2);
+}
+
+/*
+ * Ends the walk: merges the log entries that were live at snap->ts into the
+ * entries added in key order, and frees the log. A node may have been copied
+ * both from the chain and from the log; it is kept once.
+ */
+static inline void snapshot_end(snapshot_domain_t *dom, snapshot_t *snap)
+{
+	snapshot_log_entry_t *e, *next;
+	snapshot_entry_t *logged, *merged;
+	int i, j, k, nr_logged = 0, nr_chain = snap->nr;
+
+	__atomic_store_n(&dom->active, 0, __ATOMIC_SEQ_CST);
+	e = __atomic_exchange_n(&dom->log, NULL, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&dom->lock);
+
+	for (next = e; next != NULL; next = next->next)
+		nr_logged++;
+	XMALLOC(logged, nr_logged + 1);
+	for (nr_logged = 0; e != NULL; e = next) {
+		next = e->next;
+		if (e->ins_ts <= snap->ts && e->del_ts > snap->ts)
+			logged[nr_logged++] = e->entry;
+		free(e);
+	}
+	if (nr_logged == 0) {
+		free(logged);
+		return;
+	}
+	qsort(logged, nr_logged, sizeof(*logged), _snapshot_entry_cmp);
+
+	XMALLOC(merged, nr_chain + nr_logged);
+	for (i = 0, j = 0, k = 0; i < nr_chain || j < nr_logged; ) {
+		if (j == nr_logged || (i < nr_chain && snap->entries[i].key < logged[j].key))
+			merged[k] = snap->entries[i++];
+		else if (i == nr_chain || logged[j].key < snap->entries[i].key)
+			merged[k] = logged[j++];
+		else {
+			merged[k] = snap->entries[i++];
+			j++;
+		}
+		if (k == 0 || merged[k - 1].key != merged[k].key)
+			k++;
+	}
+	free(snap->entries);
+	free(logged);
+	snap->entries = merged;
+	snap->nr = snap->size = k;
+}
+
+static inline int snapshot_next(snapshot_t *snap, tree_key_t *key, tree_value_t *value)
+{
+	if (snap->pos == snap->nr)
+		return 0;
+	if (key != NULL)
+		*key = snap->entries[snap->pos].key;
+	if (value != NULL)
+		*value = snap->entries[snap->pos].value;
+	snap->pos++;
+	return 1;
+}
+
+static inline void snapshot_free(snapshot_t *snap)
+{
+	free(snap->entries);
+	free(snap);
+}
+#endif /* TREE_SNAPSHOT */
+
+#endif /* SNAPSHOT_H */
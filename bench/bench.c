@@ -0,0 +1,793 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#ifdef TREE_NUMA
+#include <numa.h>
+#endif
+
+#include "trees.h"
+
+#define CACHE_LINE_SIZE 64
+#define MAX_THREADS 1024
+#define NR_LAT_BUCKETS 40		//> Bucket i holds latencies in [2^i, 2^(i+1)) ns
+
+enum { OP_LOOKUP, OP_INSERT, OP_DELETE, OP_SCAN, NR_OPS };
+static const char *op_names[NR_OPS] = { "lookup", "insert", "delete", "scan" };
+static const char *numa_policy_names[] = { "first-touch", "local", "interleave" };
+static const char *contention_names[] = { "spin", "pause", "backoff", "yield", "adaptive" };
+
+typedef struct {
+	int nr_threads;
+	int duration;			//> In milliseconds
+	int max_key;
+	int init_size;
+	int lookup_pct, insert_pct;
+	int scan_pct;			//> delete_pct = 100 - lookup_pct - insert_pct - scan_pct
+	int scan_width;
+	int scan_mode;
+	int values;			//> Lookups call get() and inserts call put()
+	int bulk_threads;		//> > 0 => pre-fill with bulk_load instead of warmup
+	int batch;			//> Keys per insert/delete batch, 0 => single-key operations
+	int batch_loop;			//> Issue the keys of a batch one at a time
+	int lookup_batch;		//> Keys per lookup batch, 0 => single-key lookups
+	int maintenance;		//> > 0 => relaxed rebalancing with this many threads
+	int numa_policy;		//> NUMA_POLICY_* of the tree nodes
+	int contention;			//> CONTENTION_* of the lock retry loops, -1 => tree default
+	int yield_after;		//> Failures in a row before yielding, 0 => tree default
+	int top_levels;			//> > 0 => descents start below a snapshot of this many levels
+	int top_period;			//> Rebuild period of that snapshot in ms
+	int snapshot_period;		//> > 0 => the main thread takes a snapshot every so many ms
+	const char *checkpoint;		//> Load the initial tree from this file, or save it there
+	int nr_shards;			//> Shards of bst-shard and avl-shard, 0 => default
+	const char *wal;		//> Replay this write-ahead log, then log the run to it
+	int wal_period;			//> Group commit period of the log in us
+	unsigned int seed;
+	int pin;
+	int histogram;
+	const char *tree;
+} bench_params_t;
+
+typedef struct {
+	int tid;
+	int socket;			//> NUMA node of the pinned cpu, -1 if not pinned
+	const tree_ops_t *ops;
+	void *tree;
+	void *thread_data;
+	unsigned long long rng;
+
+	unsigned long nr_ops[NR_OPS];
+	unsigned long nr_success[NR_OPS];
+	unsigned long lat[NR_OPS][NR_LAT_BUCKETS];
+	unsigned long nr_bad_values;	//> get() results that no put() ever stored
+	tree_key_t *batch_keys;
+	int *batch_results;
+} __attribute__((aligned(CACHE_LINE_SIZE))) bench_thread_t;
+
+static bench_params_t params = {
+	.nr_threads = 1,
+	.duration = 5000,
+	.max_key = 2000000,
+	.init_size = 1000000,
+	.lookup_pct = 80,
+	.insert_pct = 10,
+	.scan_pct = 0,
+	.scan_width = 100,
+	.scan_mode = RANGE_SCAN_WEAK,
+	.values = 0,
+	.bulk_threads = 0,
+	.batch = 0,
+	.batch_loop = 0,
+	.lookup_batch = 0,
+	.maintenance = 0,
+	.numa_policy = NUMA_POLICY_FIRST_TOUCH,
+	.contention = -1,
+	.yield_after = 0,
+	.top_levels = 0,
+	.top_period = 10,
+	.snapshot_period = 0,
+	.checkpoint = NULL,
+	.nr_shards = 0,
+	.wal = NULL,
+	.wal_period = 1000,
+	.seed = 1024,
+	.pin = 1,
+	.histogram = 0,
+	.tree = "all",
+};
+
+static pthread_barrier_t start_barrier;
+static int stop_flag;
+
+/* Online cpus ordered by socket, see init_topology. */
+static int nr_cpus, nr_sockets, max_socket;
+static int *cpus, *cpu_sockets;
+
+/* Value stored by put() for key; warmup stores VALUE_NONE. */
+#define KEY_VALUE(key) ((tree_value_t)(long)((key) + 1))
+
+static inline unsigned long long xorshift64(unsigned long long *state)
+{
+	unsigned long long x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int lat_bucket(unsigned long long ns)
+{
+	int b = (ns == 0) ? 0 : 63 - __builtin_clzll(ns);
+	return (b < NR_LAT_BUCKETS) ? b : NR_LAT_BUCKETS - 1;
+}
+
+/*
+ * Orders the online cpus by socket (NUMA node), so that consecutive threads
+ * fill one socket before they move on to the next. Without TREE_NUMA, or if
+ * libnuma is not usable, all cpus belong to socket 0.
+ */
+static void init_topology(void)
+{
+	long nr_online = sysconf(_SC_NPROCESSORS_ONLN);
+	int cpu, socket;
+
+	cpus = malloc(nr_online * sizeof(*cpus));
+	cpu_sockets = malloc(nr_online * sizeof(*cpu_sockets));
+	if (cpus == NULL || cpu_sockets == NULL) {
+		fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+		exit(1);
+	}
+#ifdef TREE_NUMA
+	if (numa_available() >= 0)
+		max_socket = numa_max_node();
+#endif
+	for (socket = 0; socket <= max_socket; socket++) {
+		int first = nr_cpus;
+
+		for (cpu = 0; cpu < nr_online; cpu++) {
+#ifdef TREE_NUMA
+			if (max_socket > 0 && numa_node_of_cpu(cpu) != socket)
+				continue;
+#endif
+			cpus[nr_cpus] = cpu;
+			cpu_sockets[nr_cpus++] = socket;
+		}
+		if (nr_cpus > first)
+			nr_sockets++;
+	}
+}
+
+/* Returns the socket of the cpu the thread is pinned to. */
+static int pin_thread(int tid)
+{
+	cpu_set_t set;
+	int i = tid % nr_cpus;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpus[i], &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+		fprintf(stderr, "Warning: could not pin thread %d\n", tid);
+		return -1;
+	}
+	return cpu_sockets[i];
+}
+
+static int scan_cb(tree_key_t key, tree_value_t value, void *arg)
+{
+	return 0;
+}
+
+/*
+ * Pre-fills the tree with init_size distinct random keys from [0, max_key)
+ * through bulk_load. Selection sampling produces them already sorted.
+ */
+static int bulk_fill(const tree_ops_t *ops, void *tree)
+{
+	tree_key_t *keys;
+	int i, n = 0, ret;
+	unsigned long long rng = (params.seed + 1) * 0x9e3779b97f4a7c15ULL;
+
+	keys = malloc(params.init_size * sizeof(*keys));
+	if (params.init_size > 0 && keys == NULL) {
+		fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+		exit(1);
+	}
+	for (i = 0; i < params.max_key && n < params.init_size; i++)
+		if (xorshift64(&rng) % (params.max_key - i) < (unsigned)(params.init_size - n))
+			keys[n++] = i;
+
+	ret = ops->bulk_load(tree, keys, NULL, n, params.bulk_threads);
+	free(keys);
+	return ret;
+}
+
+/*
+ * Inserts or deletes a batch of params.batch random keys drawn from a window
+ * of 2 * params.batch keys, like a sorted ingest batch would touch.
+ */
+static int batch_op(bench_thread_t *t, int op, int start)
+{
+	const tree_ops_t *ops = t->ops;
+	int i, ret = 0;
+
+	for (i = 0; i < params.batch; i++)
+		t->batch_keys[i] = (start + xorshift64(&t->rng) % (2 * params.batch)) % params.max_key;
+
+	if (params.batch_loop) {
+		for (i = 0; i < params.batch; i++)
+			ret += (op == OP_INSERT) ? ops->insert(t->tree, t->thread_data, t->batch_keys[i], VALUE_NONE) :
+			                           ops->delete(t->tree, t->thread_data, t->batch_keys[i]);
+		return ret;
+	}
+	if (op == OP_INSERT)
+		return ops->insert_batch(t->tree, t->thread_data, t->batch_keys, NULL, params.batch);
+	return ops->delete_batch(t->tree, t->thread_data, t->batch_keys, params.batch);
+}
+
+/*
+ * Looks up a batch of params.lookup_batch random keys from the whole key
+ * range, like the keys of unrelated requests.
+ */
+static int lookup_batch_op(bench_thread_t *t)
+{
+	const tree_ops_t *ops = t->ops;
+	int i, ret = 0;
+
+	for (i = 0; i < params.lookup_batch; i++)
+		t->batch_keys[i] = (xorshift64(&t->rng) >> 8) % params.max_key;
+
+	if (params.batch_loop) {
+		for (i = 0; i < params.lookup_batch; i++)
+			ret += ops->lookup(t->tree, t->thread_data, t->batch_keys[i]);
+		return ret;
+	}
+	return ops->lookup_batch(t->tree, t->thread_data, t->batch_keys, params.lookup_batch,
+	                         t->batch_results);
+}
+
+static void *bench_thread(void *arg)
+{
+	bench_thread_t *t = arg;
+	const tree_ops_t *ops = t->ops;
+	int lookup_thresh = params.lookup_pct;
+	int insert_thresh = params.lookup_pct + params.insert_pct;
+	int scan_thresh = insert_thresh + params.scan_pct;
+	int nr_batch_keys;
+
+	t->socket = params.pin ? pin_thread(t->tid) : -1;
+	t->thread_data = ops->thread_data_new(t->tid);
+	nr_batch_keys = (params.batch > params.lookup_batch) ? params.batch : params.lookup_batch;
+	t->batch_keys = malloc((nr_batch_keys + 1) * sizeof(*t->batch_keys));
+	t->batch_results = malloc((params.lookup_batch + 1) * sizeof(*t->batch_results));
+	if (t->batch_keys == NULL || t->batch_results == NULL) {
+		fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+		exit(1);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	while (!__atomic_load_n(&stop_flag, __ATOMIC_RELAXED)) {
+		unsigned long long r = xorshift64(&t->rng);
+		int key = (r >> 8) % params.max_key;
+		int choice = r % 100;
+		int op, ret, nr_keys = 1;
+		unsigned long long start = now_ns();
+
+		if (choice < lookup_thresh) {
+			op = OP_LOOKUP;
+			if (params.lookup_batch > 0) {
+				ret = lookup_batch_op(t);
+				nr_keys = params.lookup_batch;
+			} else if (params.values) {
+				tree_value_t value;
+				ret = ops->get(t->tree, t->thread_data, key, &value);
+				if (ret && value != VALUE_NONE && value != KEY_VALUE(key))
+					t->nr_bad_values++;
+			} else {
+				ret = ops->lookup(t->tree, t->thread_data, key);
+			}
+		} else if (choice < insert_thresh) {
+			op = OP_INSERT;
+			if (params.batch > 0) {
+				ret = batch_op(t, op, key);
+				nr_keys = params.batch;
+			} else if (params.values) {
+				ret = ops->put(t->tree, t->thread_data, key, KEY_VALUE(key), NULL);
+			} else {
+				ret = ops->insert(t->tree, t->thread_data, key, VALUE_NONE);
+			}
+		} else if (choice < scan_thresh) {
+			op = OP_SCAN;
+			ret = ops->range_scan(t->tree, t->thread_data, key, key + params.scan_width - 1,
+			                      params.scan_mode, scan_cb, NULL);
+		} else {
+			op = OP_DELETE;
+			if (params.batch > 0) {
+				ret = batch_op(t, op, key);
+				nr_keys = params.batch;
+			} else {
+				ret = ops->delete(t->tree, t->thread_data, key);
+			}
+		}
+
+		//> Batches are accounted per key, with the average latency of their keys
+		t->lat[op][lat_bucket((now_ns() - start) / nr_keys)] += nr_keys;
+		t->nr_ops[op] += nr_keys;
+		t->nr_success[op] += ret;
+	}
+	free(t->batch_results);
+	free(t->batch_keys);
+
+	return NULL;
+}
+
+static void print_latencies(bench_thread_t *total)
+{
+	static const double pcts[] = { 50.0, 90.0, 99.0, 99.9 };
+	int op, b, i;
+
+	printf("Latency (ns, upper bound of log2 bucket):\n");
+	for (op = 0; op < NR_OPS; op++) {
+		unsigned long nr = total->nr_ops[op], sum = 0;
+		if (nr == 0)
+			continue;
+		printf("  %-7s", op_names[op]);
+		for (i = 0, b = 0; i < (int)(sizeof(pcts) / sizeof(pcts[0])); i++) {
+			while (b < NR_LAT_BUCKETS && sum + total->lat[op][b] < pcts[i] / 100.0 * nr)
+				sum += total->lat[op][b++];
+			printf("  p%-4g %8llu", pcts[i], 1ULL << (b + 1));
+		}
+		printf("\n");
+
+		if (!params.histogram)
+			continue;
+		for (b = 0; b < NR_LAT_BUCKETS; b++) {
+			if (total->lat[op][b] == 0)
+				continue;
+			printf("    [%10llu, %10llu) %12lu %6.2f%%\n", 1ULL << b, 1ULL << (b + 1),
+			       total->lat[op][b], 100.0 * total->lat[op][b] / nr);
+		}
+	}
+}
+
+static void print_sockets(bench_thread_t *threads, unsigned long long elapsed)
+{
+	int socket, i, op;
+
+	for (socket = 0; socket <= max_socket; socket++) {
+		unsigned long nr_ops = 0;
+		int nr_threads = 0;
+
+		for (i = 0; i < params.nr_threads; i++) {
+			if (threads[i].socket != socket)
+				continue;
+			nr_threads++;
+			for (op = 0; op < NR_OPS; op++)
+				nr_ops += threads[i].nr_ops[op];
+		}
+		if (nr_threads > 0)
+			printf("  socket %d: %.3f Mops/s (%d threads)\n", socket,
+			       nr_ops / (elapsed / 1e3), nr_threads);
+	}
+}
+
+/*
+ * Takes a snapshot every params.snapshot_period ms until end, while the
+ * workers run. Returns the number of snapshots whose keys were not strictly
+ * increasing or, with -V, that held a value no put() stored.
+ */
+static unsigned long snapshot_loop(const tree_ops_t *ops, void *tree, unsigned long long end)
+{
+	void *thread_data = ops->thread_data_new(params.nr_threads);
+	unsigned long nr = 0, nr_keys = 0, nr_bad = 0;
+	unsigned long long ns = 0, start;
+
+	while ((start = now_ns()) < end) {
+		void *snap = ops->snapshot_open(tree, thread_data);
+		tree_key_t key, prev = 0;
+		tree_value_t value;
+		int first = 1, bad = 0;
+
+		ns += now_ns() - start;
+		while (ops->snapshot_next(snap, &key, &value)) {
+			if ((!first && key <= prev) ||
+			    (params.values && value != VALUE_NONE && value != KEY_VALUE(key)))
+				bad = 1;
+			prev = key;
+			first = 0;
+		}
+		nr_keys += ops->snapshot_size(snap);
+		ops->snapshot_close(snap);
+		nr++;
+		nr_bad += bad;
+		usleep(params.snapshot_period * 1000);
+	}
+	printf("Snapshots: %lu taken, %.0f keys and %.2f ms each on average, %lu inconsistent\n",
+	       nr, nr ? (double)nr_keys / nr : 0.0, nr ? ns / 1e6 / nr : 0.0, nr_bad);
+	return nr_bad;
+}
+
+/* Returns the requested feature that ops lacks, or NULL if it has them all. */
+static const char *missing_feature(const tree_ops_t *ops)
+{
+	if (params.snapshot_period > 0 && ops->snapshot_open == NULL)
+#ifdef TREE_SNAPSHOT
+		return "point-in-time snapshots (-S)";
+#else
+		return "point-in-time snapshots (-S), which need a build with -DTREE_SNAPSHOT";
+#endif
+	if (params.checkpoint != NULL && ops->save == NULL)
+		return "checkpoints (-F)";
+	if (params.wal != NULL && ops->wal_start == NULL)
+		return "write-ahead logging (-W)";
+	if (params.top_levels > 0 && ops->top_cache_start == NULL)
+		return "top-of-tree snapshots (-K)";
+	return NULL;
+}
+
+static int run_bench(const tree_ops_t *ops)
+{
+	bench_thread_t *threads;
+	pthread_t *tids;
+	bench_thread_t total;
+	void *tree, *total_data;
+	unsigned long long start, elapsed;
+	unsigned long nr_ops = 0, nr_bad_snapshots = 0, nr_deferred, nr_full;
+	long expected_size, size;
+	int i, op, b, init, valid;
+
+	printf("=======================\n");
+	printf("Tree: %s\n", ops->name());
+	if (ops->numa_policy(params.numa_policy) != params.numa_policy)
+		printf("NUMA policy %s not available (built without NUMA=1 or a single node), "
+		       "using first-touch\n", numa_policy_names[params.numa_policy]);
+	tree = ops->new();
+	if (params.contention >= 0 &&
+	    ops->contention(tree, params.contention, params.yield_after) == 0) {
+		fprintf(stderr, "Invalid contention manager\n");
+		exit(1);
+	}
+
+	start = now_ns();
+	if (params.checkpoint != NULL && access(params.checkpoint, F_OK) == 0) {
+		init = ops->load(tree, params.checkpoint, params.bulk_threads > 0 ? params.bulk_threads : 1);
+		if (init < 0) {
+			fprintf(stderr, "Cannot load checkpoint %s\n", params.checkpoint);
+			exit(1);
+		}
+		printf("Loaded %d nodes from %s in %.2f s\n", init, params.checkpoint,
+		       (now_ns() - start) / 1e9);
+	} else if (params.bulk_threads > 0) {
+		init = bulk_fill(ops, tree);
+		printf("Bulk load: %d nodes in %.2f s (%d threads)\n", init,
+		       (now_ns() - start) / 1e9, params.bulk_threads);
+	} else {
+		init = ops->warmup(tree, params.init_size, params.max_key, params.seed, 0);
+		printf("Warmup: %d nodes in %.2f s\n", init, (now_ns() - start) / 1e9);
+	}
+	if (params.checkpoint != NULL && access(params.checkpoint, F_OK) != 0) {
+		start = now_ns();
+		if (ops->save(tree, ops->thread_data_new(0), params.checkpoint) < 0) {
+			perror(params.checkpoint);
+			exit(1);
+		}
+		printf("Saved %d nodes to %s in %.2f s\n", init, params.checkpoint,
+		       (now_ns() - start) / 1e9);
+	}
+	if (params.wal != NULL) {
+		if (access(params.wal, F_OK) == 0) {
+			long nr_records;
+
+			start = now_ns();
+			nr_records = ops->wal_replay(tree, ops->thread_data_new(0), params.wal,
+			                             params.bulk_threads > 0 ? params.bulk_threads : 1);
+			if (nr_records < 0) {
+				fprintf(stderr, "Cannot replay log %s\n", params.wal);
+				exit(1);
+			}
+			init = ops->size(tree);
+			printf("Replayed %ld records from %s in %.2f s, %d nodes\n", nr_records,
+			       params.wal, (now_ns() - start) / 1e9, init);
+		}
+		if (ops->wal_start(tree, params.wal, params.wal_period) == 0) {
+			fprintf(stderr, "Cannot open log %s\n", params.wal);
+			exit(1);
+		}
+	}
+
+	if (params.maintenance > 0 && ops->maintenance_start != NULL &&
+	    ops->maintenance_start(tree, params.maintenance) == 0) {
+		fprintf(stderr, "Failed to start %d maintenance threads\n", params.maintenance);
+		exit(1);
+	}
+	if (params.top_levels > 0 &&
+	    ops->top_cache_start(tree, params.top_levels, params.top_period) == 0) {
+		fprintf(stderr, "Failed to start the top-of-tree snapshot\n");
+		exit(1);
+	}
+
+	threads = aligned_alloc(CACHE_LINE_SIZE, params.nr_threads * sizeof(*threads));
+	tids = malloc(params.nr_threads * sizeof(*tids));
+	if (threads == NULL || tids == NULL) {
+		fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+		exit(1);
+	}
+	memset(threads, 0, params.nr_threads * sizeof(*threads));
+
+	__atomic_store_n(&stop_flag, 0, __ATOMIC_RELAXED);
+	pthread_barrier_init(&start_barrier, NULL, params.nr_threads + 1);
+	for (i = 0; i < params.nr_threads; i++) {
+		threads[i].tid = i;
+		threads[i].ops = ops;
+		threads[i].tree = tree;
+		threads[i].rng = (params.seed + 1) * 0x9e3779b97f4a7c15ULL * (i + 1);
+		pthread_create(&tids[i], NULL, bench_thread, &threads[i]);
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	if (params.snapshot_period > 0)
+		nr_bad_snapshots = snapshot_loop(ops, tree, start + params.duration * 1000000ULL);
+	else
+		usleep(params.duration * 1000);
+	__atomic_store_n(&stop_flag, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < params.nr_threads; i++)
+		pthread_join(tids[i], NULL);
+	elapsed = now_ns() - start;
+	pthread_barrier_destroy(&start_barrier);
+	if (params.wal != NULL)
+		printf("Log: %ld records written to %s\n", ops->wal_stop(tree), params.wal);
+	if (params.top_levels > 0)
+		ops->top_cache_stop(tree);
+	if (params.maintenance > 0 && ops->maintenance_stop != NULL) {
+		ops->maintenance_stop(tree, &nr_deferred, &nr_full);
+		printf("Maintenance: %lu violations deferred, %lu rebalanced inline (shard full)\n",
+		       nr_deferred, nr_full);
+	}
+
+	memset(&total, 0, sizeof(total));
+	total_data = ops->thread_data_new(-1);
+	for (i = 0; i < params.nr_threads; i++) {
+		for (op = 0; op < NR_OPS; op++) {
+			total.nr_ops[op] += threads[i].nr_ops[op];
+			total.nr_success[op] += threads[i].nr_success[op];
+			for (b = 0; b < NR_LAT_BUCKETS; b++)
+				total.lat[op][b] += threads[i].lat[op][b];
+		}
+		total.nr_bad_values += threads[i].nr_bad_values;
+		ops->thread_data_add(total_data, threads[i].thread_data, total_data);
+	}
+
+	printf("Operations:\n");
+	for (op = 0; op < NR_OPS; op++) {
+		nr_ops += total.nr_ops[op];
+		if (op == OP_SCAN)
+			printf("  %-7s %12lu (%lu keys reported)\n", op_names[op],
+			       total.nr_ops[op], total.nr_success[op]);
+		else
+			printf("  %-7s %12lu (%lu successful)\n", op_names[op],
+			       total.nr_ops[op], total.nr_success[op]);
+	}
+	printf("Throughput: %.3f Mops/s (%lu ops in %.2f s, %d threads)\n",
+	       nr_ops / (elapsed / 1e3), nr_ops, elapsed / 1e9, params.nr_threads);
+	if (nr_sockets > 1 && params.pin)
+		print_sockets(threads, elapsed);
+	print_latencies(&total);
+	printf("Thread data:\n");
+	ops->thread_data_print(total_data);
+	printf("\n");
+
+	expected_size = init + total.nr_success[OP_INSERT] - total.nr_success[OP_DELETE];
+	printf("Expected tree size: %ld (excluding the root sentinel)\n", expected_size);
+	size = ops->size(tree);
+	printf("size(): %ld %s\n", size, (size == expected_size) ? "[OK]" : "[BAD]");
+	valid = ops->validate(tree) && size == expected_size;
+	if (params.snapshot_period > 0) {
+		void *snap = ops->snapshot_open(tree, total_data);
+
+		size = ops->snapshot_size(snap);
+		ops->snapshot_close(snap);
+		printf("Final snapshot: %ld keys %s\n", size, (size == expected_size) ? "[OK]" : "[BAD]");
+		valid &= (size == expected_size) && nr_bad_snapshots == 0;
+	}
+	if (params.values) {
+		printf("Inconsistent get() values: %lu\n", total.nr_bad_values);
+		valid &= (total.nr_bad_values == 0);
+	}
+
+	free(threads);
+	free(tids);
+	return valid;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "Usage: %s [options]\n"
+	        "  -T tree      tree to run: bst, avl, bst-shard, avl-shard or all (default %s)\n"
+	        "  -t threads   number of worker threads (default %d)\n"
+	        "  -d ms        duration of the measurement in ms (default %d)\n"
+	        "  -m max_key   keys are drawn from [0, max_key) (default %d)\n"
+	        "  -i size      initial tree size (default %d)\n"
+	        "  -B threads   pre-fill the tree with bulk_load using up to this many threads\n"
+	        "  -l pct       lookup percentage (default %d)\n"
+	        "  -n pct       insert percentage (default %d)\n"
+	        "  -r pct       range scan percentage, deletes get the rest (default %d)\n"
+	        "  -w width     width of the scanned key range (default %d)\n"
+	        "  -b size      inserts and deletes use insert_batch/delete_batch on batches of\n"
+	        "               size keys drawn from a window of 2 * size keys\n"
+	        "  -a size      lookups use lookup_batch on batches of size random keys (not with -V)\n"
+	        "  -X           issue the keys of each batch one at a time instead\n"
+	        "  -R threads   AVL only: defer rebalancing to this many maintenance threads\n"
+	        "  -K levels    descents start below a snapshot of the top levels (1-16) of the tree\n"
+	        "  -k ms        rebuild period of that snapshot (default %d)\n"
+	        "  -S ms        take a point-in-time snapshot every ms ms during the run\n"
+	        "               (needs -DTREE_SNAPSHOT)\n"
+	        "  -F file      load the initial tree from the checkpoint file, or fill the tree\n"
+	        "               as usual and save it to file if file does not exist\n"
+	        "  -W file      replay the write-ahead log file if it exists, then log every\n"
+	        "               update of the run to it\n"
+	        "  -G us        group commit period of that log (default %d)\n"
+	        "  -Z shards    initial number of shards of bst-shard and avl-shard (default %d)\n"
+	        "  -C cm[:n]    contention manager of the lock retry loops: spin, pause, backoff,\n"
+	        "               yield or adaptive (default), yielding after n failures in a row\n"
+	        "  -N policy    placement of the tree nodes: first-touch, local or interleave\n"
+	        "               (default first-touch, others need NUMA=1)\n"
+	        "  -L           use linearizable instead of weakly consistent range scans\n"
+	        "  -V           lookups call get() and inserts call put(), values are checked\n"
+	        "  -s seed      random seed (default %u)\n"
+	        "  -P           do not pin threads to cpus\n"
+	        "  -H           print the full latency histograms\n",
+	        prog, params.tree, params.nr_threads, params.duration, params.max_key,
+	        params.init_size, params.lookup_pct, params.insert_pct, params.scan_pct,
+	        params.scan_width, params.top_period, params.wal_period, shard_config(0),
+	        params.seed);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, matched = 0, ran = 0, ok = 1;
+	unsigned int i;
+	const char *numa_policy = NULL, *missing;
+	char *contention = NULL, *yield_after;
+
+	while ((opt = getopt(argc, argv, "T:t:d:m:i:B:l:n:r:w:b:a:XR:K:k:S:F:W:G:Z:N:C:LVs:PHh")) != -1) {
+		switch (opt) {
+		case 'T': params.tree = optarg; break;
+		case 't': params.nr_threads = atoi(optarg); break;
+		case 'd': params.duration = atoi(optarg); break;
+		case 'm': params.max_key = atoi(optarg); break;
+		case 'i': params.init_size = atoi(optarg); break;
+		case 'B': params.bulk_threads = atoi(optarg); break;
+		case 'l': params.lookup_pct = atoi(optarg); break;
+		case 'n': params.insert_pct = atoi(optarg); break;
+		case 'r': params.scan_pct = atoi(optarg); break;
+		case 'w': params.scan_width = atoi(optarg); break;
+		case 'b': params.batch = atoi(optarg); break;
+		case 'a': params.lookup_batch = atoi(optarg); break;
+		case 'X': params.batch_loop = 1; break;
+		case 'R': params.maintenance = atoi(optarg); break;
+		case 'K': params.top_levels = atoi(optarg); break;
+		case 'k': params.top_period = atoi(optarg); break;
+		case 'S': params.snapshot_period = atoi(optarg); break;
+		case 'F': params.checkpoint = optarg; break;
+		case 'W': params.wal = optarg; break;
+		case 'G': params.wal_period = atoi(optarg); break;
+		case 'Z': params.nr_shards = atoi(optarg); break;
+		case 'N': numa_policy = optarg; break;
+		case 'C': contention = optarg; break;
+		case 'L': params.scan_mode = RANGE_SCAN_LINEARIZABLE; break;
+		case 'V': params.values = 1; break;
+		case 's': params.seed = strtoul(optarg, NULL, 10); break;
+		case 'P': params.pin = 0; break;
+		case 'H': params.histogram = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (numa_policy != NULL) {
+		params.numa_policy = -1;
+		for (i = 0; i < sizeof(numa_policy_names) / sizeof(numa_policy_names[0]); i++)
+			if (strcmp(numa_policy, numa_policy_names[i]) == 0)
+				params.numa_policy = i;
+	}
+	if (contention != NULL) {
+		yield_after = strchr(contention, ':');
+		if (yield_after != NULL) {
+			*yield_after++ = '\0';
+			params.yield_after = atoi(yield_after);
+			if (params.yield_after < 1)
+				usage(argv[0]);
+		}
+		for (i = 0; i < sizeof(contention_names) / sizeof(contention_names[0]); i++)
+			if (strcmp(contention, contention_names[i]) == 0)
+				params.contention = i;
+		if (params.contention < 0)
+			usage(argv[0]);
+	}
+	if (params.numa_policy < 0 || params.nr_threads < 1 || params.nr_threads > MAX_THREADS ||
+	    params.max_key < 1 || params.init_size > params.max_key || params.bulk_threads < 0 ||
+	    params.lookup_pct < 0 || params.insert_pct < 0 || params.scan_pct < 0 ||
+	    params.scan_width < 1 || params.batch < 0 || params.batch > params.max_key ||
+	    params.lookup_batch < 0 || (params.lookup_batch > 0 && params.values) ||
+	    params.maintenance < 0 || params.top_levels < 0 || params.top_levels > 16 ||
+	    params.top_period < 1 || params.snapshot_period < 0 || params.wal_period < 1 ||
+	    params.nr_shards < 0 ||
+	    (params.nr_shards > 0 && shard_config(params.nr_shards) != params.nr_shards) ||
+	    params.lookup_pct + params.insert_pct + params.scan_pct > 100)
+		usage(argv[0]);
+
+	init_topology();
+	printf("Threads: %d, duration: %d ms, key range: [0, %d), initial size: %d\n",
+	       params.nr_threads, params.duration, params.max_key, params.init_size);
+	if (nr_sockets > 1)
+		printf("Sockets: %d, threads are pinned socket by socket%s\n", nr_sockets,
+		       params.pin ? "" : " (disabled with -P)");
+	printf("NUMA policy: %s\n", numa_policy_names[params.numa_policy]);
+	if (params.contention >= 0) {
+		printf("Contention manager: %s", contention_names[params.contention]);
+		if (params.yield_after > 0)
+			printf(", yield after %d failures", params.yield_after);
+		printf("\n");
+	}
+	printf("Workload: %d%% lookups, %d%% inserts, %d%% deletes, %d%% %s scans of %d keys\n",
+	       params.lookup_pct, params.insert_pct,
+	       100 - params.lookup_pct - params.insert_pct - params.scan_pct, params.scan_pct,
+	       (params.scan_mode == RANGE_SCAN_LINEARIZABLE) ? "linearizable" : "weak",
+	       params.scan_width);
+	if (params.values)
+		printf("Lookups call get() and inserts call put()\n");
+	if (params.batch > 0)
+		printf("Inserts and deletes in batches of %d keys%s\n", params.batch,
+		       params.batch_loop ? ", issued one at a time" : "");
+	if (params.lookup_batch > 0)
+		printf("Lookups in batches of %d keys%s\n", params.lookup_batch,
+		       params.batch_loop ? ", issued one at a time" : "");
+	if (params.maintenance > 0)
+		printf("AVL rebalancing deferred to %d maintenance threads\n", params.maintenance);
+	if (params.top_levels > 0)
+		printf("Descents start below a snapshot of the top %d levels, rebuilt every %d ms\n",
+		       params.top_levels, params.top_period);
+	if (params.snapshot_period > 0)
+		printf("Point-in-time snapshot every %d ms\n", params.snapshot_period);
+	if (params.wal != NULL)
+		printf("Updates are logged to %s, group commit every %d us\n", params.wal,
+		       params.wal_period);
+	if (params.nr_shards > 0)
+		printf("Sharded trees start with %d shards\n", params.nr_shards);
+
+	for (i = 0; i < NR_TREES; i++) {
+		if (strcmp(params.tree, "all") != 0 && strcmp(params.tree, tree_ops[i].id) != 0)
+			continue;
+		matched++;
+		if ((missing = missing_feature(&tree_ops[i])) != NULL) {
+			if (strcmp(params.tree, "all") != 0) {
+				fprintf(stderr, "%s does not support %s\n", tree_ops[i].id, missing);
+				return 1;
+			}
+			printf("=======================\n");
+			printf("Skipping %s: no support for %s\n", tree_ops[i].id, missing);
+			continue;
+		}
+		ok &= run_bench(&tree_ops[i]);
+		ran++;
+	}
+	if (matched == 0)
+		usage(argv[0]);
+	if (ran == 0)
+		return 1;
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Compares the contention managers of the lock retry loops (-C) on an
+# update-heavy workload over a small key range, from one thread per cpu up
+# to OVERSUB times as many threads as cpus. Threads beyond the cpus are not
+# pinned. With TREE_STATS=1 the yields per run are reported as well.
+#
+# Usage: bench/contention.sh [extra bench options]
+# e.g.   OVERSUB="1 4 16" POLICIES="spin adaptive" bench/contention.sh -d 5000
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:-"-O3 -g"}
+POLICIES=${POLICIES:-"spin pause backoff yield adaptive"}
+OVERSUB=${OVERSUB:-"1 2 4 8"}
+WORKLOAD=${WORKLOAD:-"-d 2000 -m 4096 -i 2048 -l 20 -n 40"}
+NR_CPUS=$(getconf _NPROCESSORS_ONLN)
+SRCS="bench/bench.c bst-log-order/bst_log_order_fg_spinlock.c avl-log-order/avl_logical_ordering.c
+      shard/shard.c"
+
+if [ "${TREE_STATS:-0}" = 1 ]; then
+	$CC $CFLAGS -pthread -DTREE_STATS -o bench/bench-stats $SRCS
+	BENCH=./bench/bench-stats
+else
+	make -s bench/bench
+	BENCH=./bench/bench
+fi
+
+printf "%-9s %-9s %8s %10s %10s\n" tree policy threads Mops/s yields
+for tree in bst avl bst-shard avl-shard; do
+	for x in $OVERSUB; do
+		t=$((NR_CPUS * x))
+		pin=
+		[ $t -gt $NR_CPUS ] && pin=-P
+		for policy in $POLICIES; do
+			$BENCH -T $tree -t $t $pin -C $policy $WORKLOAD "$@" > bench/.out-$$ || true
+			mops=$(sed -n 's/^Throughput: \([0-9.]*\) Mops.*/\1/p' bench/.out-$$)
+			yields=$(sed -n 's/.*Contention:.* yields \([0-9]*\).*/\1/p' bench/.out-$$ | tail -1)
+			printf "%-9s %-9s %8s %10s %10s\n" $tree $policy $t "$mops" "${yields:-n/a}"
+		done
+	done
+done
+rm -f bench/.out-$$
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Measures the optimistic insert fast path: the share of inserts it links
+# and the throughput with and without it (-DNO_FAST_INSERT), at low
+# contention (large key range) and high contention (small key range).
+#
+# Usage: bench/fast_path.sh [extra bench options]
+# e.g.   bench/fast_path.sh -d 2000 -l 50 -n 25
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:-"-O3 -g"}
+THREADS=${THREADS:-"1 2 4 8 16 32 64"}
+LOW=${LOW:-"-m 2000000 -i 1000000"}
+HIGH=${HIGH:-"-m 1024 -i 512"}
+SRCS="bench/bench.c bst-log-order/bst_log_order_fg_spinlock.c avl-log-order/avl_logical_ordering.c
+      shard/shard.c"
+
+$CC $CFLAGS -pthread -DTREE_STATS -o bench/bench-fast $SRCS
+$CC $CFLAGS -pthread -DTREE_STATS -DNO_FAST_INSERT -o bench/bench-nofast $SRCS
+
+printf "%-6s %-10s %8s %12s %12s %10s\n" tree contention threads Mops/s no_fast fast_path
+for tree in bst avl; do
+	for contention in low high; do
+		case $contention in
+		low)  keys=$LOW ;;
+		high) keys=$HIGH ;;
+		esac
+		for t in $THREADS; do
+			./bench/bench-fast -T $tree -t $t $keys "$@" > bench/.out-$$ || true
+			mops=$(sed -n 's/^Throughput: \([0-9.]*\) Mops.*/\1/p' bench/.out-$$)
+			fast=$(sed -n 's/^  Insert fast path: .*(\([0-9.]*%\))$/\1/p' bench/.out-$$)
+			./bench/bench-nofast -T $tree -t $t $keys "$@" > bench/.out-$$ || true
+			slow=$(sed -n 's/^Throughput: \([0-9.]*\) Mops.*/\1/p' bench/.out-$$)
+			printf "%-6s %-10s %8s %12s %12s %10s\n" $tree $contention $t "$mops" "$slow" "$fast"
+		done
+	done
+done
+rm -f bench/.out-$$
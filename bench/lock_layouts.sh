@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Compares the node lock layouts (pthread spinlocks, 1-byte TTAS locks and
+# futex-backed locks) for 1 to 128 threads.
+#
+# Usage: bench/lock_layouts.sh [extra bench options]
+# e.g.   bench/lock_layouts.sh -d 2000 -m 2000000 -i 1000000 -l 80 -n 10
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:-"-O3 -g"}
+THREADS=${THREADS:-"1 2 4 8 16 32 64 128"}
+SRCS="bench/bench.c bst-log-order/bst_log_order_fg_spinlock.c avl-log-order/avl_logical_ordering.c
+      shard/shard.c"
+
+for lock in spin ttas futex; do
+	case $lock in
+	spin)  defs="" ;;
+	ttas)  defs="-DNODE_LOCK_TTAS" ;;
+	futex) defs="-DNODE_LOCK_FUTEX" ;;
+	esac
+	$CC $CFLAGS -pthread $defs -o bench/bench-$lock $SRCS
+done
+
+printf "%-6s %-8s %8s %12s %12s\n" tree lock threads node_size Mops/s
+for tree in bst avl; do
+	for lock in spin ttas futex; do
+		for t in $THREADS; do
+			./bench/bench-$lock -T $tree -t $t "$@" > bench/.out-$$ || true
+			size=$(sed -n 's/^Size of tree node is \([0-9]*\)/\1/p' bench/.out-$$)
+			mops=$(sed -n 's/^Throughput: \([0-9.]*\) Mops.*/\1/p' bench/.out-$$)
+			printf "%-6s %-8s %8s %12s %12s\n" $tree $lock $t "$size" "$mops"
+		done
+	done
+done
+rm -f bench/.out-$$
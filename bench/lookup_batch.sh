@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Compares batched lookups (lookup_batch) with the same batches issued one
+# lookup at a time (-X), on read-only workloads over bulk-loaded trees that
+# fit in the caches or not.
+#
+# Usage: bench/lookup_batch.sh [extra bench options]
+# e.g.   SIZES=10000000 BATCHES="16 32" bench/lookup_batch.sh -t 4
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+SIZES=${SIZES:-"10000 1000000 10000000"}
+BATCHES=${BATCHES:-"8 16 32"}
+
+make -s bench/bench
+
+mops() {
+	./bench/bench -m $((size * 2)) -i $size -B 1 -l 100 -n 0 "$@" > bench/.out-$$ || true
+	sed -n 's/^Throughput: \([0-9.]*\) Mops.*/\1/p' bench/.out-$$
+}
+
+printf "%-6s %10s %6s %10s %10s %8s\n" tree keys batch scalar batched speedup
+for tree in bst avl; do
+	for size in $SIZES; do
+		for batch in $BATCHES; do
+			scalar=$(mops -T $tree -a $batch -X "$@")
+			batched=$(mops -T $tree -a $batch "$@")
+			speedup=$(echo "$scalar $batched" | awk '{ if ($1 > 0) printf "%.2fx", $2 / $1 }')
+			printf "%-6s %10s %6s %10s %10s %8s\n" $tree $size $batch "$scalar" "$batched" "$speedup"
+		done
+	done
+done
+rm -f bench/.out-$$
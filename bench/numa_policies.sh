@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+# Compares the placement of the tree nodes (-N) on a NUMA machine: total and
+# per-socket throughput with first-touch, local and interleaved placement.
+# Threads fill one socket before the next, so thread counts up to the size
+# of one socket stay local.
+#
+# Usage: bench/numa_policies.sh [extra bench options]
+# e.g.   THREADS="16 32 64" bench/numa_policies.sh -T avl -d 2000
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:-"-O3 -g"}
+THREADS=${THREADS:-"1 2 4 8 16 32 64 128"}
+SRCS="bench/bench.c bst-log-order/bst_log_order_fg_spinlock.c avl-log-order/avl_logical_ordering.c
+      shard/shard.c"
+
+$CC $CFLAGS -pthread -DTREE_NUMA -o bench/bench-numa $SRCS -lnuma
+
+for policy in first-touch local interleave; do
+	for t in $THREADS; do
+		echo "== $policy, $t threads"
+		./bench/bench-numa -N $policy -t $t "$@" |
+			grep -E '^Tree:|^Throughput:|^  socket|not available' || true
+	done
+done
@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Compares inline AVL rebalancing with relaxed rebalancing (-R): throughput
+# and the p99 latency of inserts and deletes, on an update-heavy workload.
+#
+# Usage: bench/relaxed_avl.sh [extra bench options]
+# e.g.   MAINTENANCE=2 bench/relaxed_avl.sh -d 2000
+#
+# The maintenance threads are not pinned and are not counted in -t. The
+# tree is validated after avl_maintenance_stop, including its heights and
+# balance; the last column reports it and the script fails if a run did not
+# end with a strict AVL tree.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+THREADS=${THREADS:-"1 2 4 8 16 32 64"}
+MAINTENANCE=${MAINTENANCE:-1}
+WORKLOAD=${WORKLOAD:-"-m 2000000 -i 1000000 -l 0 -n 50"}
+
+make -s bench/bench
+
+p99() {
+	sed -n "s/^  $1 .* p99 *\([0-9]*\) .*/\1/p" bench/.out-$$
+}
+
+printf "%8s %10s %12s %12s %10s %12s %12s %6s\n" threads Mops/s insert_p99 delete_p99 \
+       relaxed insert_p99 delete_p99 valid
+bad=0
+for t in $THREADS; do
+	./bench/bench -T avl -t $t $WORKLOAD "$@" > bench/.out-$$ || true
+	mops=$(sed -n 's/^Throughput: \([0-9.]*\) Mops.*/\1/p' bench/.out-$$)
+	ins=$(p99 insert)
+	del=$(p99 delete)
+	valid=OK
+	./bench/bench -T avl -t $t -R $MAINTENANCE $WORKLOAD "$@" > bench/.out-$$ || valid=BAD
+	rmops=$(sed -n 's/^Throughput: \([0-9.]*\) Mops.*/\1/p' bench/.out-$$)
+	rins=$(p99 insert)
+	rdel=$(p99 delete)
+	printf "%8s %10s %12s %12s %10s %12s %12s %6s\n" $t "$mops" "$ins" "$del" "$rmops" "$rins" "$rdel" $valid
+	[ $valid = OK ] || bad=1
+done
+rm -f bench/.out-$$
+exit $bad
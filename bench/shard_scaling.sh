@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Compares each tree with its range-partitioned front-end (bst-shard,
+# avl-shard) on an update-heavy workload, from 1 to 128 threads. With more
+# threads than cpus the threads are not pinned.
+#
+# Usage: bench/shard_scaling.sh [extra bench options]
+# e.g.   SHARDS=64 THREADS="1 8 64" bench/shard_scaling.sh -d 2000
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+THREADS=${THREADS:-"1 2 4 8 16 32 64 128"}
+SHARDS=${SHARDS:-16}
+WORKLOAD=${WORKLOAD:-"-m 2000000 -i 1000000 -l 50 -n 25"}
+NR_CPUS=$(getconf _NPROCESSORS_ONLN)
+
+make -s bench/bench
+
+mops() {
+	./bench/bench "$@" > bench/.out-$$ || true
+	sed -n 's/^Throughput: \([0-9.]*\) Mops.*/\1/p' bench/.out-$$
+}
+
+printf "%-6s %8s %10s %10s %8s\n" tree threads Mops/s sharded speedup
+for tree in bst avl; do
+	for t in $THREADS; do
+		pin=
+		[ $t -gt $NR_CPUS ] && pin=-P
+		plain=$(mops -T $tree -t $t $pin $WORKLOAD "$@")
+		sharded=$(mops -T $tree-shard -Z $SHARDS -t $t $pin $WORKLOAD "$@")
+		speedup=$(echo "$plain $sharded" | awk '$1 > 0 { printf "%.2f", $2 / $1 }')
+		printf "%-6s %8s %10s %10s %8s\n" $tree $t "$plain" "$sharded" "${speedup:-n/a}"
+	done
+done
+rm -f bench/.out-$$
@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# Compares the node layouts with and without the read-optimized side part
+# (-DNODE_SIDE_LOCKS) on a 99% read workload at high thread counts:
+# throughput and coherence misses per operation. The 1% of writes are
+# put()s, which lock and write nodes that lookups keep reading. The misses
+# of a run of DELAY ms are subtracted so that the setup cost is not
+# counted. The default EVENT counts loads served from a line that another
+# core had modified (Intel); set EVENT on other cpus. Without perf only the
+# throughput is reported. With more threads than cpus the threads are not
+# pinned.
+#
+# Usage: bench/side_locks.sh [extra bench options]
+# e.g.   THREADS="32 64" EVENT=LLC-load-misses bench/side_locks.sh -m 200000 -i 100000
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:-"-O3 -g"}
+THREADS=${THREADS:-"16 64 128"}
+DURATION=${DURATION:-5000}
+DELAY=${DELAY:-1}
+EVENT=${EVENT:-mem_load_l3_hit_retired.xsnp_hitm}
+WORKLOAD=${WORKLOAD:-"-m 2000000 -i 1000000 -l 99 -n 1 -V"}
+NR_CPUS=$(getconf _NPROCESSORS_ONLN)
+SRCS="bench/bench.c bst-log-order/bst_log_order_fg_spinlock.c avl-log-order/avl_logical_ordering.c
+      shard/shard.c"
+LAYOUTS="packed side split split-side"
+
+for layout in $LAYOUTS; do
+	case $layout in
+	packed)     defs="" ;;
+	side)       defs="-DNODE_SIDE_LOCKS" ;;
+	split)      defs="-DNODE_SPLIT" ;;
+	split-side) defs="-DNODE_SPLIT -DNODE_SIDE_LOCKS" ;;
+	esac
+	$CC $CFLAGS -pthread $defs -o bench/bench-$layout $SRCS
+done
+
+PERF=
+if command -v perf > /dev/null 2>&1 && perf stat -x, -e $EVENT true > /dev/null 2>&1; then
+	PERF="perf stat -x, -e $EVENT -o bench/.perf-$$"
+else
+	echo "perf or the $EVENT event is not available, reporting throughput only"
+fi
+
+# run layout tree threads duration [options]: sets mops, ops and misses
+run() {
+	layout=$1 tree=$2 t=$3 d=$4
+	shift 4
+	pin=
+	[ $t -gt $NR_CPUS ] && pin=-P
+	$PERF ./bench/bench-$layout -T $tree -t $t $pin -d $d $WORKLOAD "$@" > bench/.out-$$ || true
+	mops=$(sed -n 's/^Throughput: \([0-9.]*\) Mops.*/\1/p' bench/.out-$$)
+	ops=$(sed -n 's/^Throughput: .*(\([0-9]*\) ops.*/\1/p' bench/.out-$$)
+	misses=
+	[ -n "$PERF" ] && misses=$(sed -n "s/^\([0-9]*\),.*$EVENT.*/\1/p" bench/.perf-$$)
+	return 0
+}
+
+printf "%-6s %-10s %8s %10s %12s\n" tree layout threads Mops/s misses/op
+for tree in bst avl; do
+	for t in $THREADS; do
+		for layout in $LAYOUTS; do
+			run $layout $tree $t $DELAY "$@"
+			base=$misses
+			run $layout $tree $t $DURATION "$@"
+			if [ -n "$misses" ] && [ -n "$base" ] && [ -n "$ops" ] && [ "$ops" -gt 0 ]; then
+				mpo=$(echo "$misses $base $ops" | awk '{ printf "%.3f", ($1 - $2) / $3 }')
+			else
+				mpo=n/a
+			fi
+			printf "%-6s %-10s %8s %10s %12s\n" $tree $layout $t "$mops" "$mpo"
+		done
+	done
+done
+rm -f bench/.out-$$ bench/.perf-$$
@@ -0,0 +1,74 @@
+#!/bin/sh
+#
+# Compares the default node layout with the split hot/cold layout
+# (-DNODE_SPLIT) on read-only workloads: throughput and last-level cache
+# misses per lookup, for trees of 1M to 100M keys. The trees are bulk
+# loaded. The misses of a run of DELAY ms are subtracted so that the setup
+# cost is not counted. Without perf only the throughput is reported.
+#
+# Usage: bench/split_layout.sh [extra bench options]
+# e.g.   SIZES="1000000 10000000" THREADS=4 bench/split_layout.sh -P
+#
+# 100M keys need 6.4 to 12.8 GB for the nodes, depending on tree and layout.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:-"-O3 -g"}
+SIZES=${SIZES:-"1000000 10000000 100000000"}
+THREADS=${THREADS:-1}
+DURATION=${DURATION:-5000}
+DELAY=${DELAY:-1}
+EVENT=${EVENT:-LLC-load-misses}
+SRCS="bench/bench.c bst-log-order/bst_log_order_fg_spinlock.c avl-log-order/avl_logical_ordering.c
+      shard/shard.c"
+
+$CC $CFLAGS -pthread -o bench/bench-packed $SRCS
+$CC $CFLAGS -pthread -DNODE_SPLIT -o bench/bench-split $SRCS
+
+PERF=
+if command -v perf > /dev/null 2>&1 && perf stat -x, -e $EVENT true > /dev/null 2>&1; then
+	PERF="perf stat -x, -e $EVENT -o bench/.perf-$$"
+else
+	echo "perf or the $EVENT event is not available, reporting throughput only"
+fi
+
+# run binary tree duration size [options]: sets mops, ops and misses
+run() {
+	bin=$1 tree=$2 d=$3 size=$4
+	shift 4
+	$PERF ./bench/$bin -T $tree -t $THREADS -d $d -m $((size * 2)) -i $size -B $THREADS \
+	      -l 100 -n 0 "$@" > bench/.out-$$ || true
+	mops=$(sed -n 's/^Throughput: \([0-9.]*\) Mops.*/\1/p' bench/.out-$$)
+	ops=$(sed -n 's/^Throughput: .*(\([0-9]*\) ops.*/\1/p' bench/.out-$$)
+	misses=
+	[ -n "$PERF" ] && misses=$(sed -n "s/^\([0-9]*\),.*$EVENT.*/\1/p" bench/.perf-$$)
+	return 0
+}
+
+# misses_per_lookup binary tree size [options]
+misses_per_lookup() {
+	bin=$1 tree=$2 size=$3
+	shift 3
+	run $bin $tree $DELAY $size "$@"
+	base=$misses
+	run $bin $tree $DURATION $size "$@"
+	if [ -n "$misses" ] && [ -n "$base" ] && [ -n "$ops" ] && [ "$ops" -gt 0 ]; then
+		mpl=$(echo "$misses $base $ops" | awk '{ printf "%.2f", ($1 - $2) / $3 }')
+	else
+		mpl=n/a
+	fi
+}
+
+printf "%-6s %12s %10s %12s %10s %12s\n" tree keys Mops/s misses/op split misses/op
+for tree in bst avl; do
+	for size in $SIZES; do
+		misses_per_lookup bench-packed $tree $size "$@"
+		pmops=$mops pmpl=$mpl
+		misses_per_lookup bench-split $tree $size "$@"
+		printf "%-6s %12s %10s %12s %10s %12s\n" $tree $size "$pmops" "$pmpl" "$mops" "$mpl"
+	done
+done
+rm -f bench/.out-$$ bench/.perf-$$
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Compares descents from the root with descents that start below a snapshot
+# of the top levels (-K), for a read-mostly and an update-heavy workload. The
+# average pred/succ fixup length shows what stale start nodes cost.
+#
+# Usage: bench/top_cache.sh [extra bench options]
+# e.g.   LEVELS=10 PERIOD=50 bench/top_cache.sh -d 2000
+#
+# The rebuilder thread is not pinned and is not counted in -t.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:-"-O3 -g"}
+THREADS=${THREADS:-"1 2 4 8 16 32 64"}
+LEVELS=${LEVELS:-8}
+PERIOD=${PERIOD:-10}
+READ=${READ:-"-l 90 -n 5"}
+UPDATE=${UPDATE:-"-l 50 -n 25"}
+SRCS="bench/bench.c bst-log-order/bst_log_order_fg_spinlock.c avl-log-order/avl_logical_ordering.c
+      shard/shard.c"
+
+$CC $CFLAGS -pthread -DTREE_STATS -o bench/bench-stats $SRCS
+
+fixup() {
+	sed -n 's/^  Fixup: \([0-9.]*\) .*/\1/p' bench/.out-$$
+}
+
+printf "%-6s %-8s %8s %10s %8s %10s %8s\n" tree workload threads Mops/s fixup snapshot fixup
+for tree in bst avl; do
+	for workload in read update; do
+		case $workload in
+		read)   mix=$READ ;;
+		update) mix=$UPDATE ;;
+		esac
+		for t in $THREADS; do
+			./bench/bench-stats -T $tree -t $t $mix "$@" > bench/.out-$$ || true
+			mops=$(sed -n 's/^Throughput: \([0-9.]*\) Mops.*/\1/p' bench/.out-$$)
+			hops=$(fixup)
+			./bench/bench-stats -T $tree -t $t $mix -K $LEVELS -k $PERIOD "$@" > bench/.out-$$ || true
+			tmops=$(sed -n 's/^Throughput: \([0-9.]*\) Mops.*/\1/p' bench/.out-$$)
+			thops=$(fixup)
+			printf "%-6s %-8s %8s %10s %8s %10s %8s\n" $tree $workload $t "$mops" "$hops" "$tmops" "$thops"
+		done
+	done
+done
+rm -f bench/.out-$$
@@ -0,0 +1,231 @@
+#ifndef TREES_H
+#define TREES_H
+
+#include "../bst-log-order/key.h"
+
+/*
+ * Interface exported by the tree implementations
+ * (bst-log-order/bst_log_order_fg_spinlock.c, avl-log-order/avl_logical_ordering.c)
+ * and by their range-partitioned front-end (shard/shard.c).
+ */
+
+void *rbt_new(void);
+void *rbt_thread_data_new(int tid);
+void rbt_thread_data_print(void *thread_data);
+void rbt_thread_data_add(void *d1, void *d2, void *dst);
+int rbt_lookup(void *bst, void *thread_data, tree_key_t key);
+int rbt_lookup_batch(void *bst, void *thread_data, tree_key_t *keys, int n, int *results);
+int rbt_insert(void *bst, void *thread_data, tree_key_t key, tree_value_t value);
+int rbt_delete(void *bst, void *thread_data, tree_key_t key);
+int rbt_insert_batch(void *bst, void *thread_data, tree_key_t *keys, tree_value_t *values, int n);
+int rbt_delete_batch(void *bst, void *thread_data, tree_key_t *keys, int n);
+int rbt_get(void *bst, void *thread_data, tree_key_t key, tree_value_t *value);
+int rbt_put(void *bst, void *thread_data, tree_key_t key, tree_value_t value,
+            tree_value_t *old_value);
+int rbt_put_if_absent(void *bst, void *thread_data, tree_key_t key, tree_value_t value,
+                      tree_value_t *value_found);
+int rbt_compute_if_present(void *bst, void *thread_data, tree_key_t key,
+                           compute_fn_t fn, void *arg);
+int rbt_range_scan(void *bst, void *thread_data, tree_key_t lo, tree_key_t hi, int mode,
+                   range_scan_cb_t cb, void *arg);
+int rbt_ceiling(void *bst, void *thread_data, tree_key_t key, tree_key_t *key_found,
+                tree_value_t *value);
+int rbt_floor(void *bst, void *thread_data, tree_key_t key, tree_key_t *key_found,
+              tree_value_t *value);
+int rbt_next(void *bst, void *thread_data, tree_key_t key, tree_key_t *key_found,
+             tree_value_t *value);
+int rbt_prev(void *bst, void *thread_data, tree_key_t key, tree_key_t *key_found,
+             tree_value_t *value);
+int rbt_min(void *bst, void *thread_data, tree_key_t *key_found, tree_value_t *value);
+int rbt_max(void *bst, void *thread_data, tree_key_t *key_found, tree_value_t *value);
+void *rbt_cursor_open(void *bst, void *thread_data, tree_key_t key);
+int rbt_cursor_next(void *cursor, tree_key_t *key, tree_value_t *value);
+void rbt_cursor_close(void *cursor);
+long rbt_size(void *bst);
+/* Built with -DTREE_SNAPSHOT only. */
+void *rbt_snapshot_open(void *bst, void *thread_data);
+long rbt_snapshot_size(void *snapshot);
+int rbt_snapshot_next(void *snapshot, tree_key_t *key, tree_value_t *value);
+void rbt_snapshot_close(void *snapshot);
+int rbt_validate(void *bst);
+int rbt_warmup(void *bst, int nr_nodes, int max_key, unsigned int seed, int force);
+int rbt_bulk_load(void *bst, tree_key_t *keys, tree_value_t *values, int n, int nr_threads);
+long rbt_save(void *bst, void *thread_data, const char *path);
+long rbt_load(void *bst, const char *path, int nr_threads);
+int rbt_wal_start(void *bst, const char *path, int period_us);
+void rbt_wal_sync(void *bst);
+long rbt_wal_stop(void *bst);
+long rbt_wal_replay(void *bst, void *thread_data, const char *path, int nr_threads);
+int rbt_numa_policy(int policy);
+int rbt_contention(void *bst, int policy, int yield_after);
+int rbt_top_cache_start(void *bst, int levels, int period_ms);
+void rbt_top_cache_stop(void *bst);
+char *rbt_name(void);
+
+void *avl_new(void);
+void *avl_thread_data_new(int tid);
+void avl_thread_data_free(void *thread_data);
+void avl_thread_data_print(void *thread_data);
+void avl_thread_data_add(void *d1, void *d2, void *dst);
+int avl_lookup(void *avl, void *thread_data, tree_key_t key);
+int avl_lookup_batch(void *avl, void *thread_data, tree_key_t *keys, int n, int *results);
+int avl_insert(void *avl, void *thread_data, tree_key_t key, tree_value_t value);
+int avl_delete(void *avl, void *thread_data, tree_key_t key);
+int avl_insert_batch(void *avl, void *thread_data, tree_key_t *keys, tree_value_t *values, int n);
+int avl_delete_batch(void *avl, void *thread_data, tree_key_t *keys, int n);
+int avl_get(void *avl, void *thread_data, tree_key_t key, tree_value_t *value);
+int avl_put(void *avl, void *thread_data, tree_key_t key, tree_value_t value,
+            tree_value_t *old_value);
+int avl_put_if_absent(void *avl, void *thread_data, tree_key_t key, tree_value_t value,
+                      tree_value_t *value_found);
+int avl_compute_if_present(void *avl, void *thread_data, tree_key_t key,
+                           compute_fn_t fn, void *arg);
+int avl_range_scan(void *avl, void *thread_data, tree_key_t lo, tree_key_t hi, int mode,
+                   range_scan_cb_t cb, void *arg);
+int avl_ceiling(void *avl, void *thread_data, tree_key_t key, tree_key_t *key_found,
+                tree_value_t *value);
+int avl_floor(void *avl, void *thread_data, tree_key_t key, tree_key_t *key_found,
+              tree_value_t *value);
+int avl_next(void *avl, void *thread_data, tree_key_t key, tree_key_t *key_found,
+             tree_value_t *value);
+int avl_prev(void *avl, void *thread_data, tree_key_t key, tree_key_t *key_found,
+             tree_value_t *value);
+int avl_min(void *avl, void *thread_data, tree_key_t *key_found, tree_value_t *value);
+int avl_max(void *avl, void *thread_data, tree_key_t *key_found, tree_value_t *value);
+void *avl_cursor_open(void *avl, void *thread_data, tree_key_t key);
+int avl_cursor_next(void *cursor, tree_key_t *key, tree_value_t *value);
+void avl_cursor_close(void *cursor);
+/* Built with -DAVL_ORDER_STATS only. */
+int avl_rank(void *avl, void *thread_data, tree_key_t key);
+int avl_select(void *avl, void *thread_data, int i, tree_key_t *key, tree_value_t *value);
+long avl_size(void *avl);
+/* Built with -DTREE_SNAPSHOT only. */
+void *avl_snapshot_open(void *avl, void *thread_data);
+long avl_snapshot_size(void *snapshot);
+int avl_snapshot_next(void *snapshot, tree_key_t *key, tree_value_t *value);
+void avl_snapshot_close(void *snapshot);
+int avl_validate(void *avl);
+int avl_warmup(void *avl, int nr_nodes, int max_key, unsigned int seed, int force);
+int avl_bulk_load(void *avl, tree_key_t *keys, tree_value_t *values, int n, int nr_threads);
+long avl_save(void *avl, void *thread_data, const char *path);
+long avl_load(void *avl, const char *path, int nr_threads);
+int avl_wal_start(void *avl, const char *path, int period_us);
+void avl_wal_sync(void *avl);
+long avl_wal_stop(void *avl);
+long avl_wal_replay(void *avl, void *thread_data, const char *path, int nr_threads);
+int avl_numa_policy(int policy);
+int avl_contention(void *avl, int policy, int yield_after);
+int avl_maintenance_start(void *avl, int nr_threads);
+void avl_maintenance_stop(void *avl, unsigned long *nr_deferred, unsigned long *nr_full);
+int avl_top_cache_start(void *avl, int levels, int period_ms);
+void avl_top_cache_stop(void *avl);
+char *avl_name(void);
+
+/* Sharded BST and AVL tree; the shard_* functions without a prefix serve both. */
+void *shard_bst_new(void);
+void *shard_bst_thread_data_new(int tid);
+int shard_bst_numa_policy(int policy);
+char *shard_bst_name(void);
+void *shard_avl_new(void);
+void *shard_avl_thread_data_new(int tid);
+int shard_avl_numa_policy(int policy);
+char *shard_avl_name(void);
+int shard_config(int nr_shards);
+void shard_thread_data_print(void *thread_data);
+void shard_thread_data_add(void *d1, void *d2, void *dst);
+int shard_lookup(void *tree, void *thread_data, tree_key_t key);
+int shard_lookup_batch(void *tree, void *thread_data, tree_key_t *keys, int n, int *results);
+int shard_insert(void *tree, void *thread_data, tree_key_t key, tree_value_t value);
+int shard_delete(void *tree, void *thread_data, tree_key_t key);
+int shard_insert_batch(void *tree, void *thread_data, tree_key_t *keys, tree_value_t *values, int n);
+int shard_delete_batch(void *tree, void *thread_data, tree_key_t *keys, int n);
+int shard_get(void *tree, void *thread_data, tree_key_t key, tree_value_t *value);
+int shard_put(void *tree, void *thread_data, tree_key_t key, tree_value_t value,
+              tree_value_t *old_value);
+int shard_range_scan(void *tree, void *thread_data, tree_key_t lo, tree_key_t hi, int mode,
+                     range_scan_cb_t cb, void *arg);
+long shard_size(void *tree);
+int shard_validate(void *tree);
+int shard_warmup(void *tree, int nr_nodes, int max_key, unsigned int seed, int force);
+int shard_bulk_load(void *tree, tree_key_t *keys, tree_value_t *values, int n, int nr_threads);
+int shard_contention(void *tree, int policy, int yield_after);
+
+typedef struct {
+	const char *id;			//> Name used on the command line
+	void *(*new)(void);
+	void *(*thread_data_new)(int tid);
+	void (*thread_data_print)(void *thread_data);
+	void (*thread_data_add)(void *d1, void *d2, void *dst);
+	int (*lookup)(void *tree, void *thread_data, tree_key_t key);
+	int (*lookup_batch)(void *tree, void *thread_data, tree_key_t *keys, int n, int *results);
+	int (*insert)(void *tree, void *thread_data, tree_key_t key, tree_value_t value);
+	int (*delete)(void *tree, void *thread_data, tree_key_t key);
+	int (*insert_batch)(void *tree, void *thread_data, tree_key_t *keys, tree_value_t *values,
+	                    int n);
+	int (*delete_batch)(void *tree, void *thread_data, tree_key_t *keys, int n);
+	int (*get)(void *tree, void *thread_data, tree_key_t key, tree_value_t *value);
+	int (*put)(void *tree, void *thread_data, tree_key_t key, tree_value_t value,
+	           tree_value_t *old_value);
+	int (*range_scan)(void *tree, void *thread_data, tree_key_t lo, tree_key_t hi, int mode,
+	                  range_scan_cb_t cb, void *arg);
+	long (*size)(void *tree);
+	void *(*snapshot_open)(void *tree, void *thread_data);	//> NULL without TREE_SNAPSHOT
+	long (*snapshot_size)(void *snapshot);
+	int (*snapshot_next)(void *snapshot, tree_key_t *key, tree_value_t *value);
+	void (*snapshot_close)(void *snapshot);
+	int (*validate)(void *tree);
+	int (*warmup)(void *tree, int nr_nodes, int max_key, unsigned int seed, int force);
+	int (*bulk_load)(void *tree, tree_key_t *keys, tree_value_t *values, int n, int nr_threads);
+	long (*save)(void *tree, void *thread_data, const char *path);	//> NULL if sharded
+	long (*load)(void *tree, const char *path, int nr_threads);
+	int (*wal_start)(void *tree, const char *path, int period_us);	//> NULL if sharded
+	void (*wal_sync)(void *tree);
+	long (*wal_stop)(void *tree);
+	long (*wal_replay)(void *tree, void *thread_data, const char *path, int nr_threads);
+	int (*numa_policy)(int policy);
+	int (*contention)(void *tree, int policy, int yield_after);
+	int (*maintenance_start)(void *tree, int nr_threads);	//> NULL if rebalancing is not relaxed
+	void (*maintenance_stop)(void *tree, unsigned long *nr_deferred, unsigned long *nr_full);
+	int (*top_cache_start)(void *tree, int levels, int period_ms);	//> NULL if sharded
+	void (*top_cache_stop)(void *tree);
+	char *(*name)(void);
+} tree_ops_t;
+
+#ifdef TREE_SNAPSHOT
+#define SNAPSHOT_OPS(p) p##_snapshot_open, p##_snapshot_size, p##_snapshot_next, p##_snapshot_close
+#else
+#define SNAPSHOT_OPS(p) NULL, NULL, NULL, NULL
+#endif
+
+static const tree_ops_t tree_ops[] = {
+	{ "bst", rbt_new, rbt_thread_data_new, rbt_thread_data_print, rbt_thread_data_add,
+	  rbt_lookup, rbt_lookup_batch, rbt_insert, rbt_delete, rbt_insert_batch, rbt_delete_batch,
+	  rbt_get, rbt_put, rbt_range_scan, rbt_size,
+	  SNAPSHOT_OPS(rbt), rbt_validate, rbt_warmup, rbt_bulk_load,
+	  rbt_save, rbt_load, rbt_wal_start, rbt_wal_sync, rbt_wal_stop, rbt_wal_replay,
+	  rbt_numa_policy, rbt_contention, NULL, NULL, rbt_top_cache_start, rbt_top_cache_stop,
+	  rbt_name },
+	{ "avl", avl_new, avl_thread_data_new, avl_thread_data_print, avl_thread_data_add,
+	  avl_lookup, avl_lookup_batch, avl_insert, avl_delete, avl_insert_batch, avl_delete_batch,
+	  avl_get, avl_put, avl_range_scan, avl_size,
+	  SNAPSHOT_OPS(avl), avl_validate, avl_warmup, avl_bulk_load,
+	  avl_save, avl_load, avl_wal_start, avl_wal_sync, avl_wal_stop, avl_wal_replay,
+	  avl_numa_policy, avl_contention, avl_maintenance_start, avl_maintenance_stop,
+	  avl_top_cache_start, avl_top_cache_stop, avl_name },
+	{ "bst-shard", shard_bst_new, shard_bst_thread_data_new, shard_thread_data_print,
+	  shard_thread_data_add, shard_lookup, shard_lookup_batch, shard_insert, shard_delete,
+	  shard_insert_batch, shard_delete_batch, shard_get, shard_put, shard_range_scan, shard_size,
+	  NULL, NULL, NULL, NULL, shard_validate, shard_warmup, shard_bulk_load, NULL, NULL,
+	  NULL, NULL, NULL, NULL,
+	  shard_bst_numa_policy, shard_contention, NULL, NULL, NULL, NULL, shard_bst_name },
+	{ "avl-shard", shard_avl_new, shard_avl_thread_data_new, shard_thread_data_print,
+	  shard_thread_data_add, shard_lookup, shard_lookup_batch, shard_insert, shard_delete,
+	  shard_insert_batch, shard_delete_batch, shard_get, shard_put, shard_range_scan, shard_size,
+	  NULL, NULL, NULL, NULL, shard_validate, shard_warmup, shard_bulk_load, NULL, NULL,
+	  NULL, NULL, NULL, NULL,
+	  shard_avl_numa_policy, shard_contention, NULL, NULL, NULL, NULL, shard_avl_name },
+};
+
+#define NR_TREES (sizeof(tree_ops) / sizeof(tree_ops[0]))
+
+#endif /* TREES_H */
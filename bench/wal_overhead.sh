@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Measures the throughput lost to the write-ahead log (-W) on an
+# update-heavy workload, for several group commit periods (-G), and checks
+# it against BUDGET percent. The log goes to LOG_DIR, which should be on the
+# device whose sync latency matters. Each run starts from a fresh log.
+#
+# Usage: bench/wal_overhead.sh [extra bench options]
+# e.g.   LOG_DIR=/mnt/nvme PERIODS="100 1000" bench/wal_overhead.sh -t 8
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+PERIODS=${PERIODS:-"100 1000 10000"}
+BUDGET=${BUDGET:-10}
+LOG_DIR=${LOG_DIR:-/tmp}
+WORKLOAD=${WORKLOAD:-"-d 2000 -m 2000000 -i 1000000 -l 50 -n 25"}
+LOG=$LOG_DIR/wal_overhead.$$
+
+make -s bench/bench
+
+mops() {
+	rm -f $LOG
+	./bench/bench "$@" > bench/.out-$$ || true
+	sed -n 's/^Throughput: \([0-9.]*\) Mops.*/\1/p' bench/.out-$$
+}
+
+printf "%-6s %10s %10s %10s %8s\n" tree period Mops/s logged loss
+for tree in bst avl; do
+	plain=$(mops -T $tree $WORKLOAD "$@")
+	for p in $PERIODS; do
+		logged=$(mops -T $tree -W $LOG -G $p $WORKLOAD "$@")
+		loss=$(echo "$plain $logged $BUDGET" |
+		       awk '$1 > 0 { l = 100 * (1 - $2 / $1);
+		                     printf "%.1f%%%s", l, (l > $3) ? " over budget" : "" }')
+		printf "%-6s %8sus %10s %10s %8s\n" $tree $p "$plain" "$logged" "${loss:-n/a}"
+	done
+done
+rm -f bench/.out-$$ $LOG
@@ -0,0 +1,79 @@
+#ifndef ATOMICS_H
+#define ATOMICS_H
+
+/*
+ * Accessors for node fields that are read without holding a lock.
+ *
+ * Every pointer or value that a lock-free traversal may follow is written
+ * with STORE/STORE_REL and read with LOAD/LOAD_ACQ, so the compiler can
+ * neither tear nor hoist the accesses. A node is always published with a
+ * release store after it has been fully initialized, and traversals read
+ * the published pointer with an acquire load. The generic __atomic builtins
+ * accept any scalar VALUE_TYPE, floating point included.
+ */
+
+#define ATOMIC_LOAD(x,order) \
+	({ __typeof__(x) __v; __atomic_load(&(x), &__v, order); __v; })
+#define ATOMIC_STORE(x,v,order) \
+	do { __typeof__(x) __v = (v); __atomic_store(&(x), &__v, order); } while(0)
+
+#define LOAD(x) ATOMIC_LOAD(x, __ATOMIC_RELAXED)
+#define LOAD_ACQ(x) ATOMIC_LOAD(x, __ATOMIC_ACQUIRE)
+#define STORE(x,v) ATOMIC_STORE(x, v, __ATOMIC_RELAXED)
+#define STORE_REL(x,v) ATOMIC_STORE(x, v, __ATOMIC_RELEASE)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/*
+ * Per-node version.
+ * Bit 0 is set while a writer that holds the node's succLock modifies the
+ * node's succ pointer, value or deleted flag, bit 15 is set once the node
+ * has been logically deleted and the remaining bits count completed writes.
+ * A reader that sees the same even version before and after reading some
+ * fields has read a consistent snapshot of them.
+ */
+typedef unsigned short node_version_t;
+
+#define VERSION_WRITING 0x0001
+#define VERSION_DELETED 0x8000
+#define VERSION_COUNT 0x7ffe
+
+#define VERSION_VALID(v) (!((v) & VERSION_DELETED))
+#define NODE_VALID(node) VERSION_VALID(LOAD_ACQ((node)->version))
+
+static inline void version_write_begin(node_version_t *version)
+{
+	STORE(*version, LOAD(*version) | VERSION_WRITING);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* flags is either 0 or VERSION_DELETED. */
+static inline void version_write_end(node_version_t *version, node_version_t flags)
+{
+	node_version_t v = LOAD(*version);
+
+	STORE_REL(*version, (node_version_t)((((v & VERSION_COUNT) + 2) & VERSION_COUNT) |
+	                                     (v & VERSION_DELETED) | flags));
+}
+
+static inline node_version_t version_read_begin(node_version_t *version)
+{
+	node_version_t v;
+
+	while ((v = LOAD_ACQ(*version)) & VERSION_WRITING)
+		cpu_relax();
+	return v;
+}
+
+/* Returns nonzero if a writer modified the node since version_read_begin. */
+static inline int version_read_retry(node_version_t *version, node_version_t v)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return LOAD(*version) != v;
+}
+
+#endif /* ATOMICS_H */
@@ -1,342 +1,1271 @@
-#include <pthread.h> //> pthread_spinlock_t
+#include <pthread.h>
 #include <limits.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "alloc.h"
+#include "atomics.h"
+#include "epoch.h"
+#include "key.h"
+#include "lock.h"
+#include "snapshot.h"
+#include "checkpoint.h"
+#include "wal.h"
+#include "contention.h"
 
-#define MINVAL -999999
 #define CACHE_LINE_SIZE 64
 
+/*
+ * -DNODE_SPLIT splits every node in two. The hot part holds the fields of the
+ * descent: 32 bytes with int keys, two nodes per cache line. The cold part
+ * holds the list pointers, the parent, the value and the locks, and comes
+ * from a separate pool. COLD(node) reaches the cold fields in both layouts.
+ *
+ * -DNODE_SIDE_LOCKS is the read-optimized layout: the two locks, which every
+ * update writes, move to a side part of one cache line that lookups never
+ * read. SIDE(node) reaches them in all layouts. It combines with NODE_SPLIT.
+ *
+ * -DTREE_SNAPSHOT adds the insert and delete times of the node for the
+ * snapshots of snapshot.h, 16 bytes that no longer fit in one cache line
+ * unless the node is split.
+ */
+#ifdef NODE_SIDE_LOCKS
+typedef struct {
+	node_lock_t succLock;
+	node_lock_t treeLock;
+} __attribute__((aligned(CACHE_LINE_SIZE))) bst_node_side_t;
+
+#define NODE_NR_SIDE_POOLS 1
+#else
+#define NODE_NR_SIDE_POOLS 0
+#endif
+
+#ifdef NODE_SPLIT
+struct bst_node;
+
+typedef struct {
+	struct bst_node *pred;
+	struct bst_node *succ;
+	struct bst_node *parent;
+	tree_value_t value;
+
+#ifdef NODE_SIDE_LOCKS
+	bst_node_side_t *side;
+#else
+	node_lock_t succLock;
+	node_lock_t treeLock;
+#endif
+#ifdef TREE_SNAPSHOT
+	snapshot_ts_t ins_ts, del_ts;	//> See snapshot.h
+#endif
+} __attribute__((aligned(CACHE_LINE_SIZE))) bst_node_cold_t;
+
+typedef struct bst_node {
+	tree_key_t key;
+	node_version_t version;		//> Deleted flag and write counter, see atomics.h
+	struct bst_node *link[2];
+	bst_node_cold_t *cold;
+} bst_node_t;
+
+#define COLD(node) ((node)->cold)
+#define NODE_NR_POOLS (2 + NODE_NR_SIDE_POOLS)
+#else
 typedef struct bst_node {
-	int key;
-	int valid; 			//> Valid = 1 => node exists, otherwise valid = 0
+	tree_key_t key;
+	node_version_t version;		//> Deleted flag and write counter, see atomics.h
 	struct bst_node *pred;
 	struct bst_node *succ;
 	struct bst_node *parent;
 	struct bst_node *link[2];
-	void *value;
+	tree_value_t value;
+
+#ifdef NODE_SIDE_LOCKS
+	bst_node_side_t *side;
+#else
+	node_lock_t succLock;
+	node_lock_t treeLock;
+#endif
+#ifdef TREE_SNAPSHOT
+	snapshot_ts_t ins_ts, del_ts;	//> See snapshot.h
+#endif
+
+	//> The aligned attribute pads the node to a multiple of CACHE_LINE_SIZE
+} __attribute__((aligned(CACHE_LINE_SIZE))) bst_node_t;
 
-	pthread_spinlock_t succLock;
-	pthread_spinlock_t treeLock;
+#define COLD(node) (node)
+#define NODE_NR_POOLS (1 + NODE_NR_SIDE_POOLS)
+#endif
+
+#ifdef NODE_SIDE_LOCKS
+#define SIDE(node) (COLD(node)->side)
+#else
+#define SIDE(node) COLD(node)
+#endif
+
+#define LOOKUP_BATCH_WIDTH 8		//> Descents in flight in *_lookup_batch
+#define TOP_MAX_LEVELS 16
+
+/*
+ * Read-only copy of the top levels of the tree (rbt_top_cache_start): the
+ * nodes in key order, each with its depth below root->link[0]. A descent
+ * starts from the deepest snapshot node on its path instead of the root, so
+ * the top of the tree is read from an array that is never written after it
+ * is published. A snapshot whose node was deleted is marked dead before the
+ * node is retired and is no longer used; one whose node moved since is only
+ * a worse starting point, the pred/succ fixup still ends at the right node.
+ */
+typedef struct {
+	int dead;
+	int nr;
+	tree_key_t *keys;
+	bst_node_t **nodes;
+	unsigned char *depths;
+} bst_top_t;
 
-	// FILL the padding
-	char padding[CACHE_LINE_SIZE - 2 * sizeof(int) -
-	             5 * sizeof(struct bst_node *) - sizeof(void *) - 2 * sizeof(pthread_spinlock_t)];
-} __attribute__((aligned(CACHE_LINE_SIZE))) bst_node_t;
+typedef struct {
+	int enabled;			//> Deletes look for their node in the snapshots while set
+	int stop;
+	int levels;
+	int period_ms;
+	pthread_t tid;
+	bst_top_t *pending;		//> Built and not yet validated, see _bst_top_publish
+	epoch_thread_t retired;		//> Replaced snapshots, freed after a grace period
+	unsigned long nr_published, nr_discarded, nr_dead;
+} bst_top_cache_t;
 
 typedef struct {
 	bst_node_t *root;
-
+	bst_top_t *top;			//> Current snapshot, NULL if none
+	bst_top_cache_t *top_cache;	//> NULL until the snapshot is first enabled
+	size_counter_t size;
+#ifdef TREE_SNAPSHOT
+	snapshot_domain_t snapshot;	//> Point-in-time copies, see rbt_snapshot_open
+#endif
+	wal_t *wal;			//> Write-ahead log, NULL unless rbt_wal_start
+	contention_t cm;		//> Policy of the lock retry loops, see rbt_contention
 } bst_t;
 
-static bst_node_t *bst_node_new(int key, void *value, bst_node_t *pred, bst_node_t *succ, bst_node_t *parent)
+#define STATS_LOOKUP 0
+#define STATS_INSERT 1
+#define STATS_DELETE 2
+#define STATS_GET 3
+#define STATS_UPDATE 4		//> put, put_if_absent and compute_if_present
+#define STATS_SCAN 5
+#define STATS_ORDER 6		//> ceiling, floor, next, prev, min, max and cursor steps
+#define STATS_NR_OPS 7
+
+/*
+ * Per-thread statistics, compiled in with -DTREE_STATS. The helpers do not
+ * see the thread data, so _bst_enter points bst_stats at the counters of the
+ * calling thread.
+ */
+typedef struct {
+	unsigned long nr_ops[STATS_NR_OPS];
+	unsigned long nr_restarts;		//> Validation failures that restart a search
+	unsigned long nr_trylock_fails;		//> Failed trylocks in acquireTreeLocks
+	unsigned long nr_yields;		//> sched_yield calls of the contention manager
+	unsigned long nr_locates;		//> Descents followed by the pred/succ fixup
+	unsigned long nr_fixup_hops;		//> pred/succ hops of those fixups
+	unsigned long nr_fast_inserts;		//> Inserts linked by _bst_insert_fast
+	unsigned long nr_slow_inserts;		//> Inserts linked under the full protocol
+} __attribute__((aligned(CACHE_LINE_SIZE))) bst_stats_t;
+
+#ifdef TREE_STATS
+static __thread bst_stats_t *bst_stats;
+#define STATS_ADD(field, n) do { if (bst_stats != NULL) bst_stats->field += (n); } while(0)
+#else
+#define STATS_ADD(field, n) do { } while(0)
+#endif
+#define STATS_INC(field) STATS_ADD(field, 1)
+
+static __thread int bst_tid;		//> tid of the thread data of the current operation
+
+typedef struct {
+	int tid;
+	epoch_thread_t epoch;		//> Per-thread state of the reclamation scheme
+	node_pool_t pool[NODE_NR_POOLS];	//> Nodes (and cold and side parts) allocated and reclaimed by this thread
+#ifdef TREE_STATS
+	bst_stats_t stats;
+#endif
+} __attribute__((aligned(CACHE_LINE_SIZE))) bst_thread_data_t;
+
+/*
+ * Iteration state of rbt_cursor_*. node is the next candidate along the succ
+ * chain; the cursor keeps the epoch of its thread entered, so node cannot be
+ * reclaimed while the cursor is open.
+ */
+typedef struct {
+	bst_t *bst;
+	bst_thread_data_t *data;
+	bst_node_t *node;
+} bst_cursor_t;
+
+static epoch_domain_t bst_epoch;	//> Shared by all bst_t instances
+static int numa_policy = NUMA_POLICY_FIRST_TOUCH;	//> See rbt_numa_policy
+
+/*
+ * Pools of the operations without thread data, see _bst_enter. The nodes
+ * they unlink may come from the pool of any thread or from a bulk_load
+ * array, so they are recycled here rather than handed to free().
+ */
+static node_pool_t bst_fallback_pool[NODE_NR_POOLS];
+static int bst_fallback_ready;
+static pthread_mutex_t bst_fallback_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define UPDATE_NONE 0		//> Only report the value of the existing node
+#define UPDATE_PUT 1		//> Overwrite the value of the existing node
+#define UPDATE_COMPUTE 2	//> Replace the value with fn(key, value, arg)
+
+/* What _bst_insert_helper does when the key already exists. */
+typedef struct {
+	int op;
+	tree_value_t value;		//> New value for UPDATE_PUT
+	compute_fn_t fn;		//> Update function for UPDATE_COMPUTE
+	void *arg;
+
+	int found;			//> Set when the key already existed
+	tree_value_t old_value;		//> Value of the existing node before the update
+} bst_update_t;
+
+static void bst_pool_init(node_pool_t *pool, int placement)
+{
+	node_pool_init(&pool[0], sizeof(bst_node_t), placement);
+#ifdef NODE_SPLIT
+	node_pool_init(&pool[1], sizeof(bst_node_cold_t), placement);
+#endif
+#ifdef NODE_SIDE_LOCKS
+	node_pool_init(&pool[NODE_NR_POOLS - 1], sizeof(bst_node_side_t), placement);
+#endif
+}
+
+/* pool is NULL or points to NODE_NR_POOLS pools, see bst_pool_init. */
+static bst_node_t *bst_node_new(node_pool_t *pool, tree_key_t key, tree_value_t value, bst_node_t *pred, bst_node_t *succ, bst_node_t *parent)
 {
         bst_node_t *ret;
 
-        XMALLOC(ret, 1);
+        if (pool != NULL)
+                ret = node_pool_alloc(&pool[0]);
+        else
+                XMALLOC_ALIGNED(ret, 1, CACHE_LINE_SIZE);
+#ifdef NODE_SPLIT
+	if (pool != NULL)
+		ret->cold = node_pool_alloc(&pool[1]);
+	else
+		XMALLOC_ALIGNED(ret->cold, 1, CACHE_LINE_SIZE);
+#endif
+#ifdef NODE_SIDE_LOCKS
+	if (pool != NULL)
+		SIDE(ret) = node_pool_alloc(&pool[NODE_NR_POOLS - 1]);
+	else
+		XMALLOC_ALIGNED(SIDE(ret), 1, CACHE_LINE_SIZE);
+#endif
         ret->key = key;
-	ret->valid = 1;
-	ret->pred = pred;
-	ret->succ = succ;
-	ret->parent = parent;
+	ret->version = 0;		//> Valid, no writes yet
+	COLD(ret)->pred = pred;
+	COLD(ret)->succ = succ;
+	COLD(ret)->parent = parent;
 	ret->link[0] = NULL;
 	ret->link[1] = NULL;
-        ret->value = value;
+        COLD(ret)->value = value;
 
-	pthread_spin_init(&ret->succLock, PTHREAD_PROCESS_SHARED);
-	pthread_spin_init(&ret->treeLock, PTHREAD_PROCESS_SHARED);
+	node_lock_init(&SIDE(ret)->succLock);
+	node_lock_init(&SIDE(ret)->treeLock);
+#ifdef TREE_SNAPSHOT
+	COLD(ret)->ins_ts = SNAPSHOT_TS_PENDING;
+	COLD(ret)->del_ts = SNAPSHOT_TS_PENDING;
+#endif
 
         return ret;
 }
 
+static void bst_node_free(node_pool_t *pool, bst_node_t *node)
+{
+#ifdef NODE_SIDE_LOCKS
+	if (pool != NULL)
+		node_pool_free(&pool[NODE_NR_POOLS - 1], SIDE(node));
+	else
+		free(SIDE(node));
+#endif
+#ifdef NODE_SPLIT
+	if (pool != NULL)
+		node_pool_free(&pool[1], node->cold);
+	else
+		free(node->cold);
+#endif
+	if (pool != NULL)
+		node_pool_free(&pool[0], node);
+	else
+		free(node);
+}
+
 bst_t *_bst_new_helper()
 {
 	bst_t *bst;
 	bst_node_t *parent;
 	
-	parent = bst_node_new(MINVAL, NULL, NULL, NULL, NULL);
-	XMALLOC(bst, 1);
-	bst->root = bst_node_new(INT_MAX, NULL, parent, parent, parent);
-	bst->root->parent = parent;
+	parent = bst_node_new(NULL, KEY_MIN, VALUE_NONE, NULL, NULL, NULL);
+	XMALLOC_ALIGNED(bst, 1, CACHE_LINE_SIZE);
+	size_counter_init(&bst->size);
+#ifdef TREE_SNAPSHOT
+	snapshot_domain_init(&bst->snapshot);
+#endif
+	bst->top = NULL;
+	bst->wal = NULL;
+	contention_init(&bst->cm);
+	bst->top_cache = NULL;
+	bst->root = bst_node_new(NULL, KEY_MAX, VALUE_NONE, parent, parent, parent);
+	COLD(bst->root)->parent = parent;
 	parent->link[1] = bst->root; 		//> Right child
-	parent->succ = bst->root;
-	parent->pred = bst->root;
-	parent->parent = bst->root;
+	COLD(parent)->succ = bst->root;
+	COLD(parent)->pred = bst->root;
+	COLD(parent)->parent = bst->root;
 	parent->link[0] = bst->root;
 
 	return bst;
 }
 
-static bst_node_t *lockParent(bst_node_t * node)
+/*
+ * Stamp the insert and the delete of node for the snapshots of
+ * -DTREE_SNAPSHOT, see snapshot.h.
+ */
+static inline void _bst_snapshot_insert(bst_t *bst, bst_node_t *node)
+{
+#ifdef TREE_SNAPSHOT
+	snapshot_stamp(&bst->snapshot, &COLD(node)->ins_ts);
+#endif
+}
+
+static inline void _bst_snapshot_delete(bst_t *bst, bst_node_t *node)
+{
+#ifdef TREE_SNAPSHOT
+	snapshot_delete(&bst->snapshot, node->key, COLD(node)->value, &COLD(node)->ins_ts,
+	                &COLD(node)->del_ts);
+#endif
+}
+
+/*
+ * Stamp the updates of node that a lookup or get observed, valid being what
+ * it read of the deleted flag. Returns valid.
+ */
+static inline int _bst_snapshot_read(bst_t *bst, bst_node_t *node, int valid)
+{
+#ifdef TREE_SNAPSHOT
+	snapshot_observe(&bst->snapshot, !valid, &COLD(node)->ins_ts, &COLD(node)->del_ts);
+#endif
+	return valid;
+}
+
+/*
+ * Log an insert, value update (WAL_INSERT) or delete of node if
+ * rbt_wal_start is on. Called with the locks of the linearization point
+ * still held, see wal.h.
+ */
+static inline void _bst_wal_append(bst_t *bst, int op, bst_node_t *node)
+{
+	wal_t *wal = LOAD_ACQ(bst->wal);
+
+	if(wal != NULL)
+		wal_append(wal, bst_tid, op, node->key, COLD(node)->value);
+}
+
+/* cm_end, counting the yields of the loop. */
+static inline void _bst_cm_end(cm_retry_t *r)
+{
+	STATS_ADD(nr_yields, r->nr_yields);
+	cm_end(r);
+}
+
+static bst_node_t *lockParent(bst_t *bst, bst_node_t * node)
 {	
-	bst_node_t *parent = node->parent;		
-	pthread_spin_lock(&parent->treeLock);
-
-	while ((node->parent != parent) || (parent->valid == 0)) {
-		pthread_spin_unlock(&parent->treeLock);
-		parent = node->parent;
-		while (parent->valid == 0) {
-			parent = node->parent;
+	bst_node_t *parent = LOAD_ACQ(COLD(node)->parent);
+	cm_retry_t r;
+
+	cm_begin(&r, &bst->cm);
+	cm_lock(&r, &SIDE(parent)->treeLock);
+
+	while ((LOAD(COLD(node)->parent) != parent) || !NODE_VALID(parent)) {
+		node_unlock(&SIDE(parent)->treeLock);
+		parent = LOAD_ACQ(COLD(node)->parent);
+		while (!NODE_VALID(parent)) {		//> Wait for the delete of parent to move node
+			cm_wait(&r);
+			parent = LOAD_ACQ(COLD(node)->parent);
 		}
-		pthread_spin_lock(&parent->treeLock);
+		cm_lock(&r, &SIDE(parent)->treeLock);
 	}
 
+	_bst_cm_end(&r);
 	return parent;
 }
 
-static int _bst_lookup_helper(bst_t *bst, int key)
+/* Index of the last snapshot key <= key, -1 if there is none. */
+static inline int _bst_top_search(bst_top_t *top, tree_key_t key)
+{
+	const tree_key_t *base = top->keys;
+	int half, n = top->nr;
+
+	while(n > 1){
+		half = n / 2;
+		base = (base[half] <= key) ? base + half : base;	//> cmov, no branch
+		n -= half;
+	}
+	return (base - top->keys) + (*base <= key) - 1;
+}
+
+/*
+ * Node to start the descent for key from. Between two neighbouring snapshot
+ * keys the path of key leaves the snapshot below the deeper of both nodes.
+ */
+static inline bst_node_t *_bst_top_start(bst_t *bst, tree_key_t key)
+{
+	bst_top_t *top = LOAD_ACQ(bst->top);
+	int i;
+
+	//> Pairs with the store of _bst_top_forget: a node read from a live
+	//> snapshot was retired after this thread entered its epoch
+	if(top == NULL || __atomic_load_n(&top->dead, __ATOMIC_SEQ_CST))
+		return bst->root;
+
+	i = _bst_top_search(top, key);
+	if(i < 0)
+		return top->nodes[0];
+	if(i == top->nr - 1 || top->keys[i] == key)
+		return top->nodes[i];
+	return (top->depths[i] > top->depths[i + 1]) ? top->nodes[i] : top->nodes[i + 1];
+}
+
+static inline void _bst_top_kill(bst_top_t *top, bst_node_t *node)
+{
+	int i;
+
+	if(top == NULL || LOAD(top->dead))
+		return;
+	i = _bst_top_search(top, node->key);
+	if(i >= 0 && top->nodes[i] == node)
+		__atomic_store_n(&top->dead, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Called after node was marked deleted and unlinked, before it is retired.
+ * The fence orders the deleted flag before the loads of the snapshots, and
+ * _bst_top_publish stores the pending snapshot before it checks the flags of
+ * its nodes: either this finds the snapshot or the rebuilder finds node
+ * deleted and drops it.
+ */
+static void _bst_top_forget(bst_t *bst, bst_node_t *node)
+{
+	bst_top_cache_t *cache = LOAD_ACQ(bst->top_cache);
+
+	if(cache == NULL || !LOAD(cache->enabled))
+		return;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	_bst_top_kill(LOAD_ACQ(cache->pending), node);	//> Cleared after top is set
+	_bst_top_kill(LOAD_ACQ(bst->top), node);
+}
+
+/*
+ * Pred/succ fixup from the node where a descent for key stopped. Returns the
+ * first node of the logical ordering layout with node->key >= key.
+ */
+static inline bst_node_t *_bst_fixup(bst_node_t *node, tree_key_t key)
+{
+	STATS_INC(nr_locates);
+	while(node->key > key){
+		node = LOAD_ACQ(COLD(node)->pred);
+		STATS_INC(nr_fixup_hops);
+	}
+
+	while(node->key < key){
+		node = LOAD_ACQ(COLD(node)->succ);
+		STATS_INC(nr_fixup_hops);
+	}
+
+	return node;
+}
+
+/*
+ * Tree descent followed by the pred/succ fixup. Returns the first node of the
+ * logical ordering layout with node->key >= key; it may be already deleted.
+ */
+static bst_node_t *_bst_locate(bst_t *bst, tree_key_t key)
 { 
-	int dir, currKey;
+	int dir;
+	tree_key_t currKey;
 	bst_node_t *node, *child = NULL;	
 
-	node = bst->root;
+	node = _bst_top_start(bst, key);
 	while(1){
 		currKey = node->key;
 		if(currKey == key)
 			break;
 		dir = currKey < key;
-		child = node->link[dir];
+		child = LOAD_ACQ(node->link[dir]);
 		if(child == NULL) 
 			break;		
 		node = child;
 	}
 
-	while(node->key > key)
-		node = node->pred;
+	return _bst_fixup(node, key);
+}
 
-	while(node->key < key)
-		node = node->succ;
-	
-	return ((node->key == key) && (node->valid == 1));
+static int _bst_lookup_helper(bst_t *bst, tree_key_t key)
+{ 
+	bst_node_t *node = _bst_locate(bst, key);
+
+	return ((node->key == key) && _bst_snapshot_read(bst, node, NODE_VALID(node)));
+}
+
+/* Skips sentinel keys, which are never found; returns the next key to look up. */
+static inline int _bst_lookup_batch_next(tree_key_t *keys, int next, int n, int *results)
+{
+	while(next < n && KEY_IS_SENTINEL(keys[next]))
+		results[next++] = 0;
+	return next;
+}
+
+/*
+ * Looks up keys[0..n) with up to LOOKUP_BATCH_WIDTH descents in flight. Each
+ * round moves every descent down by one level and prefetches the child it
+ * moves to, so the cache misses of the descents overlap instead of adding
+ * up. A descent that stops runs the fixup of _bst_locate, and its slot takes
+ * the next key. Returns the number of keys found.
+ */
+static int _bst_lookup_batch_helper(bst_t *bst, tree_key_t *keys, int n, int *results)
+{
+	bst_node_t *nodes[LOOKUP_BATCH_WIDTH], *node, *child;
+	int slots[LOOKUP_BATCH_WIDTH];	//> Index of the key of each descent
+	int i, next = 0, nr_active = 0, found = 0;
+	tree_key_t key, currKey;
+
+	for(next = _bst_lookup_batch_next(keys, 0, n, results);
+	    next < n && nr_active < LOOKUP_BATCH_WIDTH;
+	    next = _bst_lookup_batch_next(keys, next + 1, n, results)){
+		slots[nr_active] = next;
+		nodes[nr_active] = _bst_top_start(bst, keys[next]);
+		__builtin_prefetch(nodes[nr_active++]);
+	}
+
+	while(nr_active > 0){
+		for(i = 0; i < nr_active; i++){
+			node = nodes[i];
+			key = keys[slots[i]];
+			currKey = node->key;
+			if(currKey != key){
+				child = LOAD_ACQ(node->link[currKey < key]);
+				if(child != NULL){
+					__builtin_prefetch(child);
+					nodes[i] = child;
+					continue;
+				}
+			}
+
+			node = _bst_fixup(node, key);
+			results[slots[i]] = ((node->key == key) && _bst_snapshot_read(bst, node, NODE_VALID(node)));
+			found += results[slots[i]];
+
+			if(next < n){
+				slots[i] = next;
+				nodes[i] = _bst_top_start(bst, keys[next]);
+				__builtin_prefetch(nodes[i]);
+				next = _bst_lookup_batch_next(keys, next + 1, n, results);
+			}else{
+				nr_active--;
+				slots[i] = slots[nr_active];
+				nodes[i] = nodes[nr_active];
+				i--;		//> The moved descent has not advanced this round
+			}
+		}
+	}
+
+	return found;
+}
+
+/*
+ * The value and the deleted flag are read under the node's version, so a
+ * value that was overwritten or whose node was deleted during the read is
+ * never reported. Returns 1 if node is valid.
+ */
+static int _bst_read_node(bst_node_t *node, tree_value_t *value)
+{
+	node_version_t v;
+	tree_value_t val;
+
+	do {
+		v = version_read_begin(&node->version);
+		val = LOAD(COLD(node)->value);
+	} while(version_read_retry(&node->version, v));
+
+	if(!VERSION_VALID(v))
+		return 0;
+	if(value != NULL)
+		*value = val;
+	return 1;
+}
+
+static int _bst_get_helper(bst_t *bst, tree_key_t key, tree_value_t *value)
+{ 
+	bst_node_t *node = _bst_locate(bst, key);
+
+	if(node->key != key)
+		return 0;
+	return _bst_snapshot_read(bst, node, _bst_read_node(node, value));
+}
+
+#define ORDER_CEILING 0		//> Smallest key >= key
+#define ORDER_NEXT 1		//> Smallest key > key
+#define ORDER_FLOOR 2		//> Largest key <= key
+#define ORDER_PREV 3		//> Largest key < key
+
+/*
+ * Ordered queries without locks: the descent and fixup of _bst_locate give
+ * the first node >= key, from which the pred/succ chain is followed past
+ * deleted nodes. The two sentinels bound the walk. Like lookup, the result
+ * may miss concurrent inserts and deletes.
+ */
+static int _bst_order_helper(bst_t *bst, tree_key_t key, int query,
+                             tree_key_t *key_found, tree_value_t *value)
+{
+	bst_node_t *head = COLD(bst->root)->parent;
+	bst_node_t *node;
+
+	if(key <= KEY_MIN)
+		node = head;
+	else if(key >= KEY_MAX)
+		node = bst->root;
+	else
+		node = _bst_locate(bst, key);
+
+	if(query == ORDER_CEILING || query == ORDER_NEXT){
+		if(node == bst->root)
+			return 0;
+		if(node == head || (query == ORDER_NEXT && node->key == key))
+			node = LOAD_ACQ(COLD(node)->succ);
+		while(node != bst->root && !_bst_read_node(node, value))
+			node = LOAD_ACQ(COLD(node)->succ);
+		if(node == bst->root)
+			return 0;
+	}else{
+		if(node == head)
+			return 0;
+		if(node == bst->root || query == ORDER_PREV || node->key != key)
+			node = LOAD_ACQ(COLD(node)->pred);
+		while(node != head && !_bst_read_node(node, value))
+			node = LOAD_ACQ(COLD(node)->pred);
+		if(node == head)
+			return 0;
+	}
+
+	if(key_found != NULL)
+		*key_found = node->key;
+	return 1;
+}
+
+/* Returns 1 and the next valid key of the cursor, 0 at the end of the tree. */
+static int _bst_cursor_next_helper(bst_cursor_t *cursor, tree_key_t *key, tree_value_t *value)
+{
+	bst_node_t *node = cursor->node;
+
+	while(node != cursor->bst->root && !_bst_read_node(node, value))
+		node = LOAD_ACQ(COLD(node)->succ);
+	if(node == cursor->bst->root){
+		cursor->node = node;
+		return 0;
+	}
+
+	if(key != NULL)
+		*key = node->key;
+	cursor->node = LOAD_ACQ(COLD(node)->succ);
+	return 1;
+}
+
+/*
+ * Weakly consistent scan: streams the valid nodes along the succ chain
+ * without taking any lock. Every reported key was present at some point
+ * during the scan; keys inserted or deleted concurrently may or may not
+ * be reported.
+ */
+static int _bst_range_scan_weak(bst_t *bst, tree_key_t lo, tree_key_t hi, range_scan_cb_t cb, void *arg)
+{
+	int nr_keys = 0;
+	bst_node_t *node = (lo > KEY_MIN) ? _bst_locate(bst, lo) : LOAD_ACQ(COLD(COLD(bst->root)->parent)->succ);
+	bst_node_t *succ;
+	node_version_t v;
+	tree_value_t value;
+
+	while(node->key <= hi && node != bst->root){
+		do {
+			v = version_read_begin(&node->version);
+			value = LOAD(COLD(node)->value);
+			succ = LOAD_ACQ(COLD(node)->succ);
+		} while(version_read_retry(&node->version, v));
+
+		if(VERSION_VALID(v)){
+			nr_keys++;
+			if(cb(node->key, value, arg) != 0)
+				break;
+		}
+		node = succ;
+	}
+
+	return nr_keys;
 }
 
-static int _bst_insert_helper(bst_t *bst, bst_node_t *new_node)
+/*
+ * Linearizable scan: locks the succLock of lo's predecessor and then, hand
+ * over hand, of every node in [lo, hi]. All locks are held until the end of
+ * the scan, so no insert or delete can modify the range while it is
+ * reported. cb runs with the locks held and must not operate on the tree.
+ */
+static int _bst_range_scan_locked(bst_t *bst, tree_key_t lo, tree_key_t hi, range_scan_cb_t cb, void *arg)
+{
+	int nr_keys = 0;
+	bst_node_t *p, *node, *last;
+
+	while(1){
+		if(lo <= KEY_MIN){
+			p = COLD(bst->root)->parent;			//> The KEY_MIN sentinel, never deleted
+			node_lock(&SIDE(p)->succLock);
+			break;
+		}
+		node = _bst_locate(bst, lo);
+		p = (node->key >= lo) ? LOAD_ACQ(COLD(node)->pred) : node;
+		node_lock(&SIDE(p)->succLock);
+		if((p->key < lo) && (COLD(p)->succ->key >= lo) && NODE_VALID(p))
+			break;
+		node_unlock(&SIDE(p)->succLock);		//> Validation failed - restart
+		STATS_INC(nr_restarts);
+	}
+
+	last = p;
+	node = COLD(p)->succ;						//> Cannot be deleted while we hold p->succLock
+	while(node->key <= hi && node != bst->root){
+		node_lock(&SIDE(node)->succLock);
+		last = node;
+		nr_keys++;
+		if(cb(node->key, COLD(node)->value, arg) != 0)
+			break;
+		node = COLD(node)->succ;
+	}
+
+	node = p;
+	while(1){
+		bst_node_t *next = COLD(node)->succ;
+		node_unlock(&SIDE(node)->succLock);
+		if(node == last)
+			break;
+		node = next;
+	}
+
+	return nr_keys;
+}
+
+/*
+ * The existing node s is updated under its own succLock: s cannot be removed
+ * while we hold p->succLock (p->succ == s), and once s->succLock is taken
+ * p->succLock can be released so that inserts before s are not delayed.
+ */
+static void _bst_update_existing(bst_t *bst, bst_node_t *p, bst_node_t *s, bst_update_t *upd)
+{
+	node_lock(&SIDE(s)->succLock);
+	node_unlock(&SIDE(p)->succLock);
+
+	upd->found = 1;
+	upd->old_value = COLD(s)->value;
+	if(upd->op != UPDATE_NONE){
+		tree_value_t value = (upd->op == UPDATE_PUT) ? upd->value :
+		                     upd->fn(s->key, COLD(s)->value, upd->arg);
+		version_write_begin(&s->version);
+		STORE(COLD(s)->value, value);
+		version_write_end(&s->version, 0);
+		_bst_wal_append(bst, WAL_INSERT, s);
+	}
+
+	node_unlock(&SIDE(s)->succLock);
+}
+
+/*
+ * Returns the treeLock-ed tree parent for keys between p and s, with p->succLock
+ * held: either p has no right child or s has no left child. first is the
+ * candidate that is tried first.
+ */
+static bst_node_t *chooseParent(bst_node_t *p, bst_node_t *s, bst_node_t *first)
+{
+	bst_node_t *parent = first;
+
+	while(1){
+		node_lock(&SIDE(parent)->treeLock);
+		if(parent == p){
+			if(parent->link[1] == NULL)
+				break;
+			node_unlock(&SIDE(parent)->treeLock);
+			parent = s;
+		}else{
+			if(parent->link[0] == NULL)
+				break;
+			node_unlock(&SIDE(parent)->treeLock);
+			parent = p;
+		}
+	}
+
+	return parent;
+}
+
+/*
+ * Links new_node between p and s and below parent. Called with p->succLock
+ * and parent->treeLock held, which are both released.
+ */
+static void _bst_link_new(bst_t *bst, bst_node_t *p, bst_node_t *s, bst_node_t *parent,
+                          bst_node_t *new_node)
+{
+	//> Update logical ordering layout
+	COLD(new_node)->succ = s;
+	COLD(new_node)->pred = p;
+	COLD(new_node)->parent = parent;		//> Parent is already locked
+	STORE_REL(COLD(s)->pred, new_node);		//> Publishes new_node
+	version_write_begin(&p->version);
+	STORE_REL(COLD(p)->succ, new_node);
+	version_write_end(&p->version, 0);
+	_bst_wal_append(bst, WAL_INSERT, new_node);
+	node_unlock(&SIDE(p)->succLock);
+	_bst_snapshot_insert(bst, new_node);
+
+	//> Update physical layout - InsertToTree
+						//> Parent is already locked
+	if(parent->key < new_node->key){	//> New_node is the right child
+		STORE_REL(parent->link[1], new_node);
+	}else{					//> New_node is the left child
+		STORE_REL(parent->link[0], new_node);
+	}
+	node_unlock(&SIDE(parent)->treeLock);	//> Unlock parent's treeLock
+}
+
+#ifndef NO_FAST_INSERT
+/*
+ * Optimistic insert for the common case: the descent ended at node, a free
+ * child slot of p or s. The search result is checked without locks first.
+ * Both locks are then taken with a single trylock each instead of spinning,
+ * and node itself becomes the parent, skipping the ChooseParent loop. Under
+ * p->succLock, p must still be valid and linked to s. Returns 0 without any
+ * change on a conflict; the caller then falls back to the full protocol.
+ */
+static int _bst_insert_fast(bst_t *bst, bst_node_t *node, tree_key_t key, bst_node_t *new_node)
+{
+	int dir = node->key < key;		//> The free slot of node
+	bst_node_t *p = dir ? node : LOAD_ACQ(COLD(node)->pred);
+	bst_node_t *s = dir ? LOAD_ACQ(COLD(node)->succ) : node;
+
+	if(!((p->key < key) && (key < s->key)))
+		return 0;
+	if(node_trylock(&SIDE(p)->succLock) != 0)
+		return 0;
+	if(COLD(p)->succ != s || !NODE_VALID(p)){
+		node_unlock(&SIDE(p)->succLock);
+		return 0;
+	}
+	if(node_trylock(&SIDE(node)->treeLock) != 0){
+		node_unlock(&SIDE(p)->succLock);
+		return 0;
+	}
+	if(node->link[dir] != NULL){
+		node_unlock(&SIDE(node)->treeLock);
+		node_unlock(&SIDE(p)->succLock);
+		return 0;
+	}
+
+	_bst_link_new(bst, p, s, node, new_node);
+	STATS_INC(nr_fast_inserts);
+	return 1;
+}
+#endif
+
+/*
+ * Inserts new_node, or applies upd to the existing node with the same key.
+ * A NULL new_node only updates an existing node (compute_if_present).
+ * Unless built with -DNO_FAST_INSERT, _bst_insert_fast is tried first.
+ */
+static int _bst_insert_helper(bst_t *bst, tree_key_t key, bst_node_t *new_node, bst_update_t *upd)
 { 
-	int inserted = 0;
+	int inserted = 0, restarted = 0;
 	bst_node_t *node = NULL;
-	int key = new_node->key;
 
 	while(1){ 
 		//> Searh operation
-		int dir, currKey;
+		int dir;
+		tree_key_t currKey;
 		bst_node_t *node, *child = NULL;
-		node = bst->root;
+		node = restarted ? bst->root : _bst_top_start(bst, key);	//> A stale start fails once
 		while(1){
 			currKey = node->key;
 			if(currKey == key)
 				break;
 			dir = currKey < key;
-			child = node->link[dir];
+			child = LOAD_ACQ(node->link[dir]);
 			if(child == NULL) 
 				break;		
 			node = child;
 		}
 
-		bst_node_t *p = (node->key >= key) ? node->pred : node;
-		pthread_spin_lock(&p->succLock);
-		bst_node_t *s = p->succ;  
+#ifndef NO_FAST_INSERT
+		if(new_node != NULL && node->key != key && _bst_insert_fast(bst, node, key, new_node))
+			return 1;
+#endif
+
+		bst_node_t *p = (node->key >= key) ? LOAD_ACQ(COLD(node)->pred) : node;
+		node_lock(&SIDE(p)->succLock);
+		bst_node_t *s = COLD(p)->succ;  
 
-		if((p->key < key) && (s->key >= key) && (p->valid == 1)){
+		if((p->key < key) && (s->key >= key) && NODE_VALID(p)){
 
 			if(s->key == key){			//> The key already exists -  Unsuccessful insert 
-				pthread_spin_unlock(&p->succLock);
+				if(upd != NULL)
+					_bst_update_existing(bst, p, s, upd);
+				else
+					node_unlock(&SIDE(p)->succLock);
 				return inserted; 	
 			}
 
-			//> Find the right parent for new node - ChooseParent
-			bst_node_t *parent = ((node ==  p) || (node == s)) ? node : p;
-			while(1){
-				pthread_spin_lock(&parent->treeLock);
-				if(parent == p){
-					if(parent->link[1] == NULL)
-						break;
-					pthread_spin_unlock(&parent->treeLock);
-					parent = s;
-				}else{
-					if(parent->link[0] == NULL)
-						break;
-					pthread_spin_unlock(&parent->treeLock);
-					parent = p;
-				}
+			if(new_node == NULL){			//> Nothing to insert
+				node_unlock(&SIDE(p)->succLock);
+				return inserted;
 			}
 
-			//> Update logical ordering layout
-			new_node->succ = s;
-			new_node->pred = p;
-			new_node->parent = parent;		//> Parent is already locked
-			s->pred = new_node;
-			p->succ = new_node;
-			pthread_spin_unlock(&p->succLock);
-			
-			//> Update physical layout - InsertToTree
-								//> Parent is already locked
-			if(parent->key < new_node->key){	//> New_node is the right child
-				parent->link[1] = new_node;
-			}else{					//> New_node is the left child
-				parent->link[0] = new_node;
-			}
-			pthread_spin_unlock(&parent->treeLock);	//> Unlock parent's treeLock
+			//> Find the right parent for new node - ChooseParent
+			bst_node_t *parent = chooseParent(p, s, ((node ==  p) || (node == s)) ? node : p);
+
+			_bst_link_new(bst, p, s, parent, new_node);
+			STATS_INC(nr_slow_inserts);
 
 			inserted = 1;
 			return inserted;			//> Successful insert					
 		}
-		pthread_spin_unlock(&p->succLock);		//> Validation failed - restart
+		node_unlock(&SIDE(p)->succLock);		//> Validation failed - restart
+		STATS_INC(nr_restarts);
+		restarted = 1;
 	}
 	return inserted;
 }
 
-static int acquireTreeLocks(bst_node_t *node)
+static int acquireTreeLocks(bst_t *bst, bst_node_t *node)
 {
+	cm_retry_t r;
+
+	cm_begin(&r, &bst->cm);
 	while(1){
-		pthread_spin_lock(&node->treeLock);
+		cm_lock(&r, &SIDE(node)->treeLock);
 		bst_node_t *left = node->link[0];
 		bst_node_t *right = node->link[1];
 
 		if(left == NULL || right == NULL){		//> node is a leaf or has a single child
+			_bst_cm_end(&r);
 			return 0;				//> 0 => false
 		}
 		
 		// n has two children
-		bst_node_t *s = node->succ;
-		bst_node_t *parent = s->parent;
+		bst_node_t *s = COLD(node)->succ;
+		bst_node_t *parent = LOAD_ACQ(COLD(s)->parent);
 
 		if(parent != node){		
-			if(pthread_spin_trylock(&parent->treeLock) != 0){
-				pthread_spin_unlock(&node->treeLock);
+			if(node_trylock(&SIDE(parent)->treeLock) != 0){
+				STATS_INC(nr_trylock_fails);
+				node_unlock(&SIDE(node)->treeLock);
+				cm_wait(&r);
 				continue;
 			}
-			if(parent != s->parent || parent->valid == 0){
-				pthread_spin_unlock(&node->treeLock);
-				pthread_spin_unlock(&parent->treeLock);
+			if(parent != LOAD(COLD(s)->parent) || !NODE_VALID(parent)){
+				node_unlock(&SIDE(node)->treeLock);
+				node_unlock(&SIDE(parent)->treeLock);
+				cm_wait(&r);
 				continue;
 			}
 		}
 
-		if(pthread_spin_trylock(&s->treeLock) != 0){
-			pthread_spin_unlock(&node->treeLock);
+		if(node_trylock(&SIDE(s)->treeLock) != 0){
+			STATS_INC(nr_trylock_fails);
+			node_unlock(&SIDE(node)->treeLock);
 			if(parent != node)		
-				pthread_spin_unlock(&parent->treeLock);
+				node_unlock(&SIDE(parent)->treeLock);
+			cm_wait(&r);
 			continue;
 		}
+		_bst_cm_end(&r);
 		return 1;				//> 1 => true (it has two children)
 	}
 }
 
-static void removeFromTree(bst_node_t *node, int hasTwoChildren, bst_node_t *parent, bst_node_t *node_to_delete)
+static void removeFromTree(bst_node_t *node, int hasTwoChildren, bst_node_t *parent, bst_node_t **node_to_delete)
 {
 	if(hasTwoChildren == 0){			//> node is a leaf or has one single child
 		bst_node_t *child = (node->link[1] == NULL) ? node->link[0] : node->link[1];
 
 		//> UpdateChild
 		if(child != NULL)
-			child->parent = parent;
-		parent = node->parent;
+			STORE_REL(COLD(child)->parent, parent);
+		parent = COLD(node)->parent;
 		int isLeft = 0;
 		if(parent->link[0] == node)
 			isLeft = 1;
 		if(isLeft == 1){
-			parent->link[0] = child;
+			STORE_REL(parent->link[0], child);
 		}else{
-			parent->link[1] = child;
+			STORE_REL(parent->link[1], child);
 		}
 
-		node_to_delete = node;
-		pthread_spin_unlock(&parent->treeLock);
-		pthread_spin_unlock(&node->treeLock);
+		*node_to_delete = node;
+		node_unlock(&SIDE(parent)->treeLock);
+		node_unlock(&SIDE(node)->treeLock);
 		return;
 	}
 		
-	bst_node_t *succ = node->succ;
-	bst_node_t *oldParent = succ->parent;
+	bst_node_t *succ = COLD(node)->succ;
+	bst_node_t *oldParent = COLD(succ)->parent;
 	bst_node_t *oldRight = succ->link[1];		//> oldRight may be NULL
 
 	//> UpdateChild
 	if(oldRight != NULL)
-		oldRight->parent = oldParent;
+		STORE_REL(COLD(oldRight)->parent, oldParent);
 	int left = 0;
 	if(oldParent->link[0] == succ)
 		left = 1;
 	if(left == 1){
-		oldParent->link[0] = oldRight;
+		STORE_REL(oldParent->link[0], oldRight);
 	}else{
-		oldParent->link[1] = oldRight;
+		STORE_REL(oldParent->link[1], oldRight);
 	}
 
-	succ->parent = parent;
-	succ->link[0] = node->link[0];
-	succ->link[1] = node->link[1];
-	node->link[0]->parent = succ;
+	STORE_REL(COLD(succ)->parent, parent);
+	STORE_REL(succ->link[0], node->link[0]);
+	STORE_REL(succ->link[1], node->link[1]);
+	STORE_REL(COLD(node->link[0])->parent, succ);
 	if(node->link[1] != NULL)		//> n.right  may be null
-		node->link[1]->parent = succ;
+		STORE_REL(COLD(node->link[1])->parent, succ);
 	if(parent->link[0] == node){
-		parent->link[0] = succ;
+		STORE_REL(parent->link[0], succ);
 	}else{
-		parent->link[1] = succ;
+		STORE_REL(parent->link[1], succ);
 	}
 
-	node_to_delete = node;
+	*node_to_delete = node;
 	if(oldParent == node){
             oldParent = succ;
         }else{
-            pthread_spin_unlock(&succ->treeLock);
+            node_unlock(&SIDE(succ)->treeLock);
         }
-        pthread_spin_unlock(&oldParent->treeLock);
-	pthread_spin_unlock(&parent->treeLock);
-	pthread_spin_unlock(&node->treeLock);
+        node_unlock(&SIDE(oldParent)->treeLock);
+	node_unlock(&SIDE(parent)->treeLock);
+	node_unlock(&SIDE(node)->treeLock);
 
 	return;
 }
 
-static inline int _bst_delete_helper(bst_t *bst, int key, bst_node_t *node_to_delete)
+/*
+ * Deletes s if it holds key. Called with p->succLock held after validating
+ * that key lies in (p, s]; releases every lock before returning.
+ */
+static int _bst_delete_locked(bst_t *bst, bst_node_t *p, bst_node_t *s, tree_key_t key,
+                              bst_node_t **node_to_delete)
 {
 	int ret = 0;
 
+	if(s->key > key){			//> The key doesn't exist -  Unsuccessful delete
+		node_unlock(&SIDE(p)->succLock);
+		return ret; 	
+	}
+
+	node_lock(&SIDE(s)->succLock);	//> Successful remove
+	int hasTwoChildren = acquireTreeLocks(bst, s);
+	bst_node_t *sParent = lockParent(bst, s);
+
+	//> Update logical order
+	version_write_begin(&s->version);
+	version_write_end(&s->version, VERSION_DELETED);
+	_bst_snapshot_delete(bst, s);		//> Before s leaves the succ chain
+	_bst_wal_append(bst, WAL_DELETE, s);
+	bst_node_t *sSucc = COLD(s)->succ;
+	STORE_REL(COLD(sSucc)->pred, p);
+	version_write_begin(&p->version);
+	STORE_REL(COLD(p)->succ, sSucc);
+	version_write_end(&p->version, 0);
+	node_unlock(&SIDE(s)->succLock);
+	node_unlock(&SIDE(p)->succLock);
+
+	//> Physical remove
+	removeFromTree(s, hasTwoChildren, sParent, node_to_delete);
+	_bst_top_forget(bst, s);
+	ret = 1;
+	return ret;
+}
+
+static inline int _bst_delete_helper(bst_t *bst, tree_key_t key, bst_node_t **node_to_delete)
+{
+	int ret = 0, restarted = 0;
+
 	while(1){ 
 		//> Searh operation
-		int dir, currKey;
+		int dir;
+		tree_key_t currKey;
 		bst_node_t *node, *child = NULL;
-		node = bst->root;
+		node = restarted ? bst->root : _bst_top_start(bst, key);
 		while(1){
 			currKey = node->key;
 			if(currKey == key)
 				break;
 			dir = currKey < key;
-			child = node->link[dir];
+			child = LOAD_ACQ(node->link[dir]);
 			if(child == NULL) 
 				break;		
 			node = child;
 		}
 
-		bst_node_t *p = (node->key >= key) ? node->pred : node;
-		pthread_spin_lock(&p->succLock);
-		bst_node_t *s = p->succ;  
+		bst_node_t *p = (node->key >= key) ? LOAD_ACQ(COLD(node)->pred) : node;
+		node_lock(&SIDE(p)->succLock);
+		bst_node_t *s = COLD(p)->succ;  
 
-		if((p->key < key) && (s->key >= key) && (p->valid == 1)){
+		if((p->key < key) && (s->key >= key) && NODE_VALID(p))
+			return _bst_delete_locked(bst, p, s, key, node_to_delete);
+		node_unlock(&SIDE(p)->succLock);		//> Validation failed - restart
+		STATS_INC(nr_restarts);
+		restarted = 1;
+	}
+	return ret;
+}
 
-			if(s->key > key){			//> The key doesn't exist -  Unsuccessful delete
-				pthread_spin_unlock(&p->succLock);
-				return ret; 	
-			}
+#define BATCH_MAX_HOPS 32	//> Longer walks along the succ chain descend from the root
 
-			pthread_spin_lock(&s->succLock);	//> Successful remove
-			int hasTwoChildren = acquireTreeLocks(s);
-			bst_node_t *sParent = lockParent(s);
-
-			//> Update logical order
-			s->valid = 0;
-			bst_node_t *sSucc = s->succ;
-			sSucc->pred = p;
-			p->succ = sSucc;
-			pthread_spin_unlock(&s->succLock);
-			pthread_spin_unlock(&p->succLock);
-	
-			//> Physical remove
-			removeFromTree(s, hasTwoChildren, sParent, node_to_delete);
-			ret = 1;
-			return ret;		
+/*
+ * Returns the node to validate as the predecessor of key. The previous key of
+ * a sorted batch left pos close by, so the succ chain is followed from pos if
+ * key is at most BATCH_MAX_HOPS nodes ahead; otherwise the search descends
+ * from the root. The result may be stale and must be validated under its
+ * succLock.
+ */
+static bst_node_t *_bst_batch_pred(bst_t *bst, bst_node_t *pos, tree_key_t key)
+{
+	int hops;
+
+	if(pos != NULL && pos->key < key){
+		for(hops = 0; hops < BATCH_MAX_HOPS; hops++){
+			bst_node_t *succ = LOAD_ACQ(COLD(pos)->succ);
+			if(succ->key >= key)
+				return pos;
+			pos = succ;
 		}
-		pthread_spin_unlock(&p->succLock);		//> Validation failed - restart
 	}
-	return ret;
+
+	return LOAD_ACQ(COLD(_bst_locate(bst, key))->pred);
+}
+
+/* Links nodes[lo, hi), sorted by key, into a balanced subtree below parent. */
+static bst_node_t *_bst_batch_link(bst_node_t **nodes, int lo, int hi, bst_node_t *parent)
+{
+	if(lo >= hi)
+		return NULL;
+
+	int mid = lo + (hi - lo) / 2;
+	bst_node_t *node = nodes[mid];
+
+	COLD(node)->parent = parent;
+	node->link[0] = _bst_batch_link(nodes, lo, mid, node);
+	node->link[1] = _bst_batch_link(nodes, mid + 1, hi, node);
+	return node;
+}
+
+/*
+ * Inserts nodes[0, n), sorted by key. All new keys that fall between the same
+ * pair of neighbours p and s go in together under p->succLock: they are
+ * chained between p and s and their balanced subtree is hung from the free
+ * child slot that a single key of that gap would have used. inserted[i] is
+ * set for every node that was linked.
+ */
+static int _bst_insert_batch_helper(bst_t *bst, bst_node_t **nodes, int n, char *inserted)
+{
+	int i = 0, j, k, nr_inserted = 0;
+	bst_node_t *pos = NULL;
+
+	while(i < n){
+		tree_key_t key = nodes[i]->key;
+		bst_node_t *p = _bst_batch_pred(bst, pos, key);
+		node_lock(&SIDE(p)->succLock);
+		bst_node_t *s = COLD(p)->succ;
+
+		if(!((p->key < key) && (s->key >= key) && NODE_VALID(p))){
+			node_unlock(&SIDE(p)->succLock);	//> Validation failed - descend
+			STATS_INC(nr_restarts);
+			pos = NULL;
+			continue;
+		}
+		if(s->key == key){			//> The key already exists
+			node_unlock(&SIDE(p)->succLock);
+			pos = s;
+			i++;
+			continue;
+		}
+
+		//> Every following key that also precedes s, duplicates excluded
+		for(j = i + 1; j < n && nodes[j]->key < s->key && nodes[j]->key != nodes[j - 1]->key; j++)
+			;
+
+		bst_node_t *parent = chooseParent(p, s, p);
+		bst_node_t *root = _bst_batch_link(nodes, i, j, parent);
+
+		//> Update logical ordering layout
+		for(k = i; k < j; k++){
+			COLD(nodes[k])->pred = (k > i) ? nodes[k - 1] : p;
+			COLD(nodes[k])->succ = (k < j - 1) ? nodes[k + 1] : s;
+			inserted[k] = 1;
+		}
+		STORE_REL(COLD(s)->pred, nodes[j - 1]);	//> Publishes the new nodes
+		version_write_begin(&p->version);
+		STORE_REL(COLD(p)->succ, nodes[i]);
+		version_write_end(&p->version, 0);
+		for(k = i; k < j; k++)
+			_bst_wal_append(bst, WAL_INSERT, nodes[k]);
+		node_unlock(&SIDE(p)->succLock);
+		for(k = i; k < j; k++)
+			_bst_snapshot_insert(bst, nodes[k]);
+
+		//> Update physical layout
+		if(parent == p)
+			STORE_REL(parent->link[1], root);
+		else
+			STORE_REL(parent->link[0], root);
+		node_unlock(&SIDE(parent)->treeLock);
+
+		nr_inserted += j - i;
+		pos = nodes[j - 1];
+		i = j;
+	}
+
+	return nr_inserted;
+}
+
+/*
+ * Deletes keys[0, n), sorted. Each delete locks like a single one but starts
+ * from the predecessor of the previous key instead of the root. The unlinked
+ * nodes are stored in nodes_to_delete.
+ */
+static int _bst_delete_batch_helper(bst_t *bst, tree_key_t *keys, int n, bst_node_t **nodes_to_delete)
+{
+	int i = 0, nr_deleted = 0;
+	bst_node_t *pos = NULL, *node_to_delete;
+
+	while(i < n){
+		tree_key_t key = keys[i];
+		bst_node_t *p = _bst_batch_pred(bst, pos, key);
+		node_lock(&SIDE(p)->succLock);
+		bst_node_t *s = COLD(p)->succ;
+
+		if(!((p->key < key) && (s->key >= key) && NODE_VALID(p))){
+			node_unlock(&SIDE(p)->succLock);	//> Validation failed - descend
+			STATS_INC(nr_restarts);
+			pos = NULL;
+			continue;
+		}
+		if(_bst_delete_locked(bst, p, s, key, &node_to_delete))
+			nodes_to_delete[nr_deleted++] = node_to_delete;
+		pos = p;
+		i++;
+	}
+
+	return nr_deleted;
 }
 
 static int total_paths;
@@ -361,9 +1290,9 @@ static void _bst_validate(bst_node_t *root, int _th)
 		bst_violations++;
 
 	/* Violation in logical order */
-	if (root->pred->succ != root)
+	if (COLD(COLD(root)->pred)->succ != root)
 		logic_violations++;
-	if (root->succ->pred != root)
+	if (COLD(COLD(root)->succ)->pred != root)
 		logic_violations++;
 
 	/* We found a path (a node with at least one sentinel child). */
@@ -420,90 +1349,925 @@ static inline int _bst_validate_helper(bst_node_t *root)
 	return check_bst;
 }
 
+/*
+ * Placement of the nodes of a thread's pool, or of the nodes that warmup and
+ * bulk_load pre-fill the tree with.
+ */
+static int _bst_placement(int prefill)
+{
+	if(numa_policy == NUMA_POLICY_LOCAL)
+		return NODE_ALLOC_LOCAL;
+	if(numa_policy == NUMA_POLICY_INTERLEAVE)
+		return prefill ? NODE_ALLOC_INTERLEAVED : NODE_ALLOC_LOCAL;
+	return NODE_ALLOC_DEFAULT;
+}
+
 static inline int _bst_warmup_helper(bst_t *bst, int nr_nodes, int max_key,
                                      unsigned int seed, int force)
 {
 	int i, nodes_inserted = 0, ret = 0;
 	bst_node_t *node;
+	node_pool_t pool[NODE_NR_POOLS], *prefill = NULL;	//> Only used to place the nodes
 	
+	if (_bst_placement(1) != NODE_ALLOC_DEFAULT) {
+		bst_pool_init(pool, _bst_placement(1));
+		prefill = pool;
+	}
 	srand(seed);
 	while (nodes_inserted < nr_nodes) {
 		int key = rand() % max_key;
-		node = bst_node_new(key, NULL, NULL, NULL, NULL);
+		node = bst_node_new(prefill, key, VALUE_NONE, NULL, NULL, NULL);
 
-		ret = _bst_insert_helper(bst, node); 
+		ret = _bst_insert_helper(bst, key, node, NULL); 
 		nodes_inserted += ret;
 
-		if (!ret) {
-			free(node);
-		}
+		if (!ret)
+			bst_node_free(prefill, node);
 	}
 
 	return nodes_inserted;
 }
 
+#define BULK_MIN_KEYS_PER_THREAD 4096	//> Smaller subtrees are not worth a thread
+
+typedef struct {
+	bst_t *bst;
+	bst_node_t *nodes;		//> nodes[i] holds keys[i]
+	tree_key_t *keys;
+	tree_value_t *values;
+	int n;
+} bst_bulk_t;
+
+typedef struct {
+	bst_bulk_t *bulk;
+	int lo, hi;
+	bst_node_t *parent;
+	int depth;
+	bst_node_t *ret;
+} bst_bulk_task_t;
+
+static void *_bst_bulk_worker(void *arg);
+
+/*
+ * Builds a perfectly balanced subtree out of nodes[lo, hi) below parent and
+ * returns its root. The pred/succ chain follows from the array index, so
+ * disjoint subtrees can be built by different threads. For depth > 0 the
+ * left subtree is handed to a new thread.
+ */
+static bst_node_t *_bst_bulk_build(bst_bulk_t *bulk, int lo, int hi, bst_node_t *parent, int depth)
+{
+	if(lo >= hi)
+		return NULL;
+
+	int mid = lo + (hi - lo) / 2;
+	bst_node_t *node = &bulk->nodes[mid];
+	bst_node_t *pred = (mid > 0) ? &bulk->nodes[mid - 1] : COLD(bulk->bst->root)->parent;
+	bst_node_t *succ = (mid < bulk->n - 1) ? &bulk->nodes[mid + 1] : bulk->bst->root;
+
+	node->key = bulk->keys[mid];
+	node->version = 0;
+	COLD(node)->pred = pred;
+	COLD(node)->succ = succ;
+	COLD(node)->parent = parent;
+	COLD(node)->value = (bulk->values != NULL) ? bulk->values[mid] : VALUE_NONE;
+	node_lock_init(&SIDE(node)->succLock);
+	node_lock_init(&SIDE(node)->treeLock);
+#ifdef TREE_SNAPSHOT
+	COLD(node)->ins_ts = 0;			//> Present since the start
+	COLD(node)->del_ts = SNAPSHOT_TS_PENDING;
+#endif
+
+	node->link[0] = NULL;
+	if(depth > 0 && hi - lo >= 2 * BULK_MIN_KEYS_PER_THREAD){
+		pthread_t tid;
+		bst_bulk_task_t task = { bulk, lo, mid, node, depth - 1, NULL };
+
+		if(pthread_create(&tid, NULL, _bst_bulk_worker, &task) == 0){
+			node->link[1] = _bst_bulk_build(bulk, mid + 1, hi, node, depth - 1);
+			pthread_join(tid, NULL);
+			node->link[0] = task.ret;
+		}
+	}
+	if(node->link[0] == NULL){
+		node->link[0] = _bst_bulk_build(bulk, lo, mid, node, 0);
+		node->link[1] = _bst_bulk_build(bulk, mid + 1, hi, node, 0);
+	}
+
+	return node;
+}
+
+static void *_bst_bulk_worker(void *arg)
+{
+	bst_bulk_task_t *task = arg;
+
+	task->ret = _bst_bulk_build(task->bulk, task->lo, task->hi, task->parent, task->depth);
+	return NULL;
+}
+
+static int _bst_bulk_load_helper(bst_t *bst, tree_key_t *keys, tree_value_t *values,
+                                 int n, int nr_threads)
+{
+	int i, depth = 0;
+	bst_bulk_t bulk = { bst, NULL, keys, values, n };
+	bst_node_t *head = COLD(bst->root)->parent;
+
+	if(n <= 0 || bst->root->link[0] != NULL)
+		return 0;
+	for(i = 0; i < n; i++)
+		if(KEY_IS_SENTINEL(keys[i]) || (i > 0 && keys[i - 1] >= keys[i]))
+			return 0;
+
+	while((2 << depth) <= nr_threads)
+		depth++;
+
+	bulk.nodes = node_alloc(n * sizeof(*bulk.nodes), _bst_placement(1));
+#ifdef NODE_SPLIT
+	bst_node_cold_t *colds = node_alloc(n * sizeof(*colds), _bst_placement(1));
+	for(i = 0; i < n; i++)
+		bulk.nodes[i].cold = &colds[i];
+#endif
+#ifdef NODE_SIDE_LOCKS
+	bst_node_side_t *sides = node_alloc(n * sizeof(*sides), _bst_placement(1));
+	for(i = 0; i < n; i++)
+		SIDE(&bulk.nodes[i]) = &sides[i];
+#endif
+	bst->root->link[0] = _bst_bulk_build(&bulk, 0, n, bst->root, depth);
+	COLD(head)->succ = &bulk.nodes[0];
+	COLD(bst->root)->pred = &bulk.nodes[n - 1];
+
+	return n;
+}
+
+/*
+ * thread_data may only be NULL while no other thread operates on the tree
+ * (e.g. during warmup); nodes are then allocated from and unlinked nodes
+ * returned to bst_fallback_pool immediately.
+ */
+static inline void _bst_enter(bst_thread_data_t *data)
+{
+	bst_tid = (data != NULL) ? data->tid : 0;
+#ifdef TREE_STATS
+	bst_stats = (data != NULL) ? &data->stats : NULL;
+#endif
+	if (data != NULL)
+		epoch_enter(&bst_epoch, &data->epoch);
+}
+
+static inline void _bst_exit(bst_thread_data_t *data)
+{
+	if (data != NULL)
+		epoch_exit(&data->epoch);
+}
+
+/* Returns bst_fallback_pool locked, unlock with bst_fallback_lock. */
+static node_pool_t *_bst_fallback_pool(void)
+{
+	pthread_mutex_lock(&bst_fallback_lock);
+	if (!bst_fallback_ready) {
+		bst_pool_init(bst_fallback_pool, _bst_placement(0));
+		bst_fallback_ready = 1;
+	}
+	return bst_fallback_pool;
+}
+
+static inline bst_node_t *_bst_node_alloc(bst_thread_data_t *data, tree_key_t key, tree_value_t value)
+{
+	bst_node_t *node;
+
+	if (data != NULL)
+		return bst_node_new(data->pool, key, value, NULL, NULL, NULL);
+	node = bst_node_new(_bst_fallback_pool(), key, value, NULL, NULL, NULL);
+	pthread_mutex_unlock(&bst_fallback_lock);
+	return node;
+}
+
+/* For nodes that were never published, e.g. after an unsuccessful insert. */
+static inline void _bst_node_release(bst_thread_data_t *data, bst_node_t *node)
+{
+	if (data != NULL) {
+		bst_node_free(data->pool, node);
+		return;
+	}
+	bst_node_free(_bst_fallback_pool(), node);
+	pthread_mutex_unlock(&bst_fallback_lock);
+}
+
+static void _bst_node_reclaim(void *node, void *pool)
+{
+	bst_node_free(pool, node);
+}
+
+static inline void _bst_retire(bst_thread_data_t *data, bst_node_t *node)
+{
+	if (data != NULL)
+		epoch_retire(&bst_epoch, &data->epoch, node);
+	else
+		_bst_node_release(NULL, node);
+}
+
+static inline void _bst_size_add(bst_t *bst, bst_thread_data_t *data, long n)
+{
+	size_counter_add(&bst->size, (data != NULL) ? data->tid : 0, n);
+}
+
+#ifdef TREE_STATS
+static void _bst_stats_print(bst_stats_t *stats)
+{
+	printf("  Ops: lookup %lu insert %lu delete %lu get %lu update %lu scan %lu order %lu\n",
+	       stats->nr_ops[STATS_LOOKUP], stats->nr_ops[STATS_INSERT], stats->nr_ops[STATS_DELETE],
+	       stats->nr_ops[STATS_GET], stats->nr_ops[STATS_UPDATE], stats->nr_ops[STATS_SCAN],
+	       stats->nr_ops[STATS_ORDER]);
+	printf("  Contention: restarts %lu trylock failures %lu yields %lu\n",
+	       stats->nr_restarts, stats->nr_trylock_fails, stats->nr_yields);
+	printf("  Fixup: %.3f pred/succ hops per search (%lu searches)\n",
+	       stats->nr_locates ? (double)stats->nr_fixup_hops / stats->nr_locates : 0.0,
+	       stats->nr_locates);
+	printf("  Insert fast path: %lu of %lu inserts (%.1f%%)\n", stats->nr_fast_inserts,
+	       stats->nr_fast_inserts + stats->nr_slow_inserts,
+	       (stats->nr_fast_inserts + stats->nr_slow_inserts) ?
+	       100.0 * stats->nr_fast_inserts / (stats->nr_fast_inserts + stats->nr_slow_inserts) : 0.0);
+}
+
+static void _bst_stats_add(bst_stats_t *s1, bst_stats_t *s2, bst_stats_t *dst)
+{
+	int i;
+
+	for (i = 0; i < STATS_NR_OPS; i++)
+		dst->nr_ops[i] = s1->nr_ops[i] + s2->nr_ops[i];
+	dst->nr_restarts = s1->nr_restarts + s2->nr_restarts;
+	dst->nr_trylock_fails = s1->nr_trylock_fails + s2->nr_trylock_fails;
+	dst->nr_yields = s1->nr_yields + s2->nr_yields;
+	dst->nr_locates = s1->nr_locates + s2->nr_locates;
+	dst->nr_fixup_hops = s1->nr_fixup_hops + s2->nr_fixup_hops;
+	dst->nr_fast_inserts = s1->nr_fast_inserts + s2->nr_fast_inserts;
+	dst->nr_slow_inserts = s1->nr_slow_inserts + s2->nr_slow_inserts;
+}
+#endif
+
 /******************************************************************************/
 /* BST Logical Ordering Search tree interface implementation                  */
 /******************************************************************************/
 void *rbt_new()
 {
+#ifdef NODE_SPLIT
+	printf("Size of tree node is %lu + %lu (hot + cold)\n", sizeof(bst_node_t),
+	       sizeof(bst_node_cold_t));
+#else
 	printf("Size of tree node is %lu\n", sizeof(bst_node_t));
+#endif
+#ifdef NODE_SIDE_LOCKS
+	printf("Size of side part is %lu\n", sizeof(bst_node_side_t));
+#endif
 	return _bst_new_helper();
 }
 
 void *rbt_thread_data_new(int tid)
 {
-	return NULL;
+	bst_thread_data_t *data;
+
+	XMALLOC_ALIGNED(data, 1, CACHE_LINE_SIZE);
+	data->tid = tid;
+	bst_pool_init(data->pool, _bst_placement(0));
+	epoch_thread_register(&bst_epoch, &data->epoch, _bst_node_reclaim, data->pool);
+#ifdef TREE_STATS
+	memset(&data->stats, 0, sizeof(data->stats));
+#endif
+
+	return data;
 }
 
 void rbt_thread_data_print(void *thread_data)
 {
-	return;
+	bst_thread_data_t *data = thread_data;
+
+	node_pool_stats_print(&data->pool[0], "Node pool");
+#ifdef NODE_SPLIT
+	node_pool_stats_print(&data->pool[1], "Cold pool");
+#endif
+#ifdef NODE_SIDE_LOCKS
+	node_pool_stats_print(&data->pool[NODE_NR_POOLS - 1], "Side pool");
+#endif
+#ifdef TREE_STATS
+	_bst_stats_print(&data->stats);
+#endif
 }
 
 void rbt_thread_data_add(void *d1, void *d2, void *dst)
 {
+	bst_thread_data_t *data1 = d1, *data2 = d2, *dst_data = dst;
+	int i;
+
+	for (i = 0; i < NODE_NR_POOLS; i++)
+		node_pool_stats_add(&data1->pool[i], &data2->pool[i], &dst_data->pool[i]);
+#ifdef TREE_STATS
+	_bst_stats_add(&data1->stats, &data2->stats, &dst_data->stats);
+#endif
 }
 
-int rbt_lookup(void *bst, void *thread_data, int key)
+int rbt_lookup(void *bst, void *thread_data, tree_key_t key)
 {
 	int ret;
 
+	if (KEY_IS_SENTINEL(key))
+		return 0;
+
+	_bst_enter(thread_data);
+	STATS_INC(nr_ops[STATS_LOOKUP]);
 	ret = _bst_lookup_helper(bst, key);
+	_bst_exit(thread_data);
 
 	return ret;
 }
 
-int rbt_insert(void *bst, void *thread_data, int key, void *value)
+/*
+ * Looks up n keys, in any order: results[i] is set to 1 if keys[i] exists
+ * and to 0 otherwise. Returns the number of keys found.
+ */
+int rbt_lookup_batch(void *bst, void *thread_data, tree_key_t *keys, int n, int *results)
+{
+	int ret;
+
+	_bst_enter(thread_data);
+	STATS_ADD(nr_ops[STATS_LOOKUP], n);
+	ret = _bst_lookup_batch_helper(bst, keys, n, results);
+	_bst_exit(thread_data);
+
+	return ret;
+}
+
+int rbt_insert(void *bst, void *thread_data, tree_key_t key, tree_value_t value)
 {
 	int ret;
 	bst_node_t *node;
 
-	node = bst_node_new(key, value, NULL, NULL, NULL);
+	if (KEY_IS_SENTINEL(key))
+		return 0;
 
-	ret = _bst_insert_helper(bst, node);
+	node = _bst_node_alloc(thread_data, key, value);
 
-	if (!ret) {
-		free(node);
-	}
+	_bst_enter(thread_data);
+	STATS_INC(nr_ops[STATS_INSERT]);
+	ret = _bst_insert_helper(bst, key, node, NULL);
+	_bst_exit(thread_data);
+
+	if (ret)
+		_bst_size_add(bst, thread_data, 1);
+	else
+		_bst_node_release(thread_data, node);
 
 	return ret;
 }
 
-int rbt_delete(void *bst, void *thread_data, int key)
+int rbt_delete(void *bst, void *thread_data, tree_key_t key)
 {
 	int ret;
 	bst_node_t *node_to_delete=NULL;
 
-	ret = _bst_delete_helper(bst, key, node_to_delete);
+	if (KEY_IS_SENTINEL(key))
+		return 0;
+
+	_bst_enter(thread_data);
+	STATS_INC(nr_ops[STATS_DELETE]);
+	ret = _bst_delete_helper(bst, key, &node_to_delete);
 
 	if (ret) {
-		free(node_to_delete);
+		_bst_retire(thread_data, node_to_delete);
+	}
+	_bst_exit(thread_data);
+	_bst_size_add(bst, thread_data, -ret);
+
+	return ret;
+}
+
+static int _bst_node_cmp(const void *a, const void *b)
+{
+	tree_key_t k1 = (*(bst_node_t * const *)a)->key, k2 = (*(bst_node_t * const *)b)->key;
+
+	return (k1 > k2) - (k1 < k2);
+}
+
+static int _bst_key_cmp(const void *a, const void *b)
+{
+	tree_key_t k1 = *(const tree_key_t *)a, k2 = *(const tree_key_t *)b;
+
+	return (k1 > k2) - (k1 < k2);
+}
+
+/*
+ * Inserts n keys, in any order, and returns how many were inserted. The keys
+ * are sorted first so that each search continues from the previous key's
+ * position; values may be NULL.
+ */
+int rbt_insert_batch(void *bst, void *thread_data, tree_key_t *keys, tree_value_t *values, int n)
+{
+	int i, nr = 0, ret;
+	bst_node_t **nodes;
+	char *inserted;
+
+	XMALLOC(nodes, n + 1);
+	XMALLOC(inserted, n + 1);
+	for (i = 0; i < n; i++) {
+		if (KEY_IS_SENTINEL(keys[i]))
+			continue;
+		inserted[nr] = 0;
+		nodes[nr++] = _bst_node_alloc(thread_data, keys[i],
+		                              (values != NULL) ? values[i] : VALUE_NONE);
 	}
+	qsort(nodes, nr, sizeof(*nodes), _bst_node_cmp);
+
+	_bst_enter(thread_data);
+	STATS_ADD(nr_ops[STATS_INSERT], nr);
+	ret = _bst_insert_batch_helper(bst, nodes, nr, inserted);
+	_bst_exit(thread_data);
+	_bst_size_add(bst, thread_data, ret);
+
+	for (i = 0; i < nr; i++)
+		if (!inserted[i])
+			_bst_node_release(thread_data, nodes[i]);
+	free(inserted);
+	free(nodes);
 
 	return ret;
 }
 
+/*
+ * Deletes n keys, in any order, and returns how many were deleted.
+ */
+int rbt_delete_batch(void *bst, void *thread_data, tree_key_t *keys, int n)
+{
+	int i, nr = 0, ret;
+	tree_key_t *sorted;
+	bst_node_t **nodes_to_delete;
+
+	XMALLOC(sorted, n + 1);
+	XMALLOC(nodes_to_delete, n + 1);
+	for (i = 0; i < n; i++)
+		if (!KEY_IS_SENTINEL(keys[i]))
+			sorted[nr++] = keys[i];
+	qsort(sorted, nr, sizeof(*sorted), _bst_key_cmp);
+
+	_bst_enter(thread_data);
+	STATS_ADD(nr_ops[STATS_DELETE], nr);
+	ret = _bst_delete_batch_helper(bst, sorted, nr, nodes_to_delete);
+	for (i = 0; i < ret; i++)
+		_bst_retire(thread_data, nodes_to_delete[i]);
+	_bst_exit(thread_data);
+	_bst_size_add(bst, thread_data, -ret);
+
+	free(nodes_to_delete);
+	free(sorted);
+
+	return ret;
+}
+
+/*
+ * Returns 1 and stores the value of key in *value if key exists.
+ */
+int rbt_get(void *bst, void *thread_data, tree_key_t key, tree_value_t *value)
+{
+	int ret;
+
+	if (KEY_IS_SENTINEL(key))
+		return 0;
+
+	_bst_enter(thread_data);
+	STATS_INC(nr_ops[STATS_GET]);
+	ret = _bst_get_helper(bst, key, value);
+	_bst_exit(thread_data);
+
+	return ret;
+}
+
+static int _bst_upsert(bst_t *bst, bst_thread_data_t *thread_data, tree_key_t key,
+                       tree_value_t value, bst_update_t *upd)
+{
+	int ret;
+	bst_node_t *node;
+
+	node = _bst_node_alloc(thread_data, key, value);
+
+	_bst_enter(thread_data);
+	STATS_INC(nr_ops[STATS_UPDATE]);
+	ret = _bst_insert_helper(bst, key, node, upd);
+	_bst_exit(thread_data);
+
+	if (ret)
+		_bst_size_add(bst, thread_data, 1);
+	else
+		_bst_node_release(thread_data, node);
+
+	return ret;
+}
+
+/*
+ * Inserts key or overwrites the value of the existing node.
+ * Returns 1 if key was inserted, 0 if it existed; its previous value is then
+ * stored in *old_value.
+ */
+int rbt_put(void *bst, void *thread_data, tree_key_t key, tree_value_t value,
+            tree_value_t *old_value)
+{
+	int ret;
+	bst_update_t upd = { .op = UPDATE_PUT, .value = value };
+
+	if (KEY_IS_SENTINEL(key))
+		return 0;
+
+	ret = _bst_upsert(bst, thread_data, key, value, &upd);
+	if (!ret && old_value != NULL)
+		*old_value = upd.old_value;
+
+	return ret;
+}
+
+/*
+ * Inserts key only if it does not exist. Returns 1 if key was inserted,
+ * otherwise 0 and the value of the existing node in *value_found.
+ */
+int rbt_put_if_absent(void *bst, void *thread_data, tree_key_t key, tree_value_t value,
+                      tree_value_t *value_found)
+{
+	int ret;
+	bst_update_t upd = { .op = UPDATE_NONE };
+
+	if (KEY_IS_SENTINEL(key))
+		return 0;
+
+	ret = _bst_upsert(bst, thread_data, key, value, &upd);
+	if (!ret && value_found != NULL)
+		*value_found = upd.old_value;
+
+	return ret;
+}
+
+/*
+ * Atomically replaces the value of key with fn(key, value, arg), if key
+ * exists. fn runs under the node's succLock and must not operate on the
+ * tree. Returns 1 if key existed.
+ */
+int rbt_compute_if_present(void *bst, void *thread_data, tree_key_t key,
+                           compute_fn_t fn, void *arg)
+{
+	bst_update_t upd = { .op = UPDATE_COMPUTE, .fn = fn, .arg = arg };
+
+	if (KEY_IS_SENTINEL(key))
+		return 0;
+
+	_bst_enter(thread_data);
+	STATS_INC(nr_ops[STATS_UPDATE]);
+	_bst_insert_helper(bst, key, NULL, &upd);
+	_bst_exit(thread_data);
+
+	return upd.found;
+}
+
+int rbt_range_scan(void *bst, void *thread_data, tree_key_t lo, tree_key_t hi, int mode,
+                   range_scan_cb_t cb, void *arg)
+{
+	int ret;
+
+	if (lo > hi)
+		return 0;
+
+	_bst_enter(thread_data);
+	STATS_INC(nr_ops[STATS_SCAN]);
+	if (mode == RANGE_SCAN_LINEARIZABLE)
+		ret = _bst_range_scan_locked(bst, lo, hi, cb, arg);
+	else
+		ret = _bst_range_scan_weak(bst, lo, hi, cb, arg);
+	_bst_exit(thread_data);
+
+	return ret;
+}
+
+static int _bst_order(bst_t *bst, bst_thread_data_t *thread_data, tree_key_t key, int query,
+                     tree_key_t *key_found, tree_value_t *value)
+{
+	int ret;
+
+	_bst_enter(thread_data);
+	STATS_INC(nr_ops[STATS_ORDER]);
+	ret = _bst_order_helper(bst, key, query, key_found, value);
+	_bst_exit(thread_data);
+
+	return ret;
+}
+
+/*
+ * Ordered queries. Each returns 1 and stores the key found and its value in
+ * *key_found and *value (either may be NULL), or 0 if there is no such key.
+ * Any key may be passed, including the sentinels.
+ */
+int rbt_ceiling(void *bst, void *thread_data, tree_key_t key, tree_key_t *key_found,
+                tree_value_t *value)
+{
+	return _bst_order(bst, thread_data, key, ORDER_CEILING, key_found, value);
+}
+
+int rbt_floor(void *bst, void *thread_data, tree_key_t key, tree_key_t *key_found,
+              tree_value_t *value)
+{
+	return _bst_order(bst, thread_data, key, ORDER_FLOOR, key_found, value);
+}
+
+int rbt_next(void *bst, void *thread_data, tree_key_t key, tree_key_t *key_found,
+             tree_value_t *value)
+{
+	return _bst_order(bst, thread_data, key, ORDER_NEXT, key_found, value);
+}
+
+int rbt_prev(void *bst, void *thread_data, tree_key_t key, tree_key_t *key_found,
+             tree_value_t *value)
+{
+	return _bst_order(bst, thread_data, key, ORDER_PREV, key_found, value);
+}
+
+int rbt_min(void *bst, void *thread_data, tree_key_t *key_found, tree_value_t *value)
+{
+	return _bst_order(bst, thread_data, KEY_MIN, ORDER_CEILING, key_found, value);
+}
+
+int rbt_max(void *bst, void *thread_data, tree_key_t *key_found, tree_value_t *value)
+{
+	return _bst_order(bst, thread_data, KEY_MAX, ORDER_FLOOR, key_found, value);
+}
+
+/*
+ * Opens a cursor at the first key >= key. Every rbt_cursor_next resumes from
+ * the node the previous one stopped at, without a new descent, and, like
+ * the weak range scan, reports keys that were present at some point during
+ * the iteration. The cursor keeps the epoch of thread_data entered until
+ * rbt_cursor_close, which delays the reclamation of deleted nodes, so it
+ * should not be left open for long. The thread may run other operations on
+ * the tree while its cursor is open.
+ */
+void *rbt_cursor_open(void *bst, void *thread_data, tree_key_t key)
+{
+	bst_cursor_t *cursor;
+
+	XMALLOC(cursor, 1);
+	cursor->bst = bst;
+	cursor->data = thread_data;
+
+	_bst_enter(thread_data);
+	STATS_INC(nr_ops[STATS_ORDER]);
+	if(key <= KEY_MIN)
+		cursor->node = LOAD_ACQ(COLD(COLD(cursor->bst->root)->parent)->succ);
+	else if(key >= KEY_MAX)
+		cursor->node = cursor->bst->root;
+	else
+		cursor->node = _bst_locate(bst, key);
+
+	return cursor;
+}
+
+/* Returns 1 and the next key and value (either may be NULL), 0 at the end. */
+int rbt_cursor_next(void *cursor, tree_key_t *key, tree_value_t *value)
+{
+	bst_cursor_t *c = cursor;
+
+#ifdef TREE_STATS
+	bst_stats = (c->data != NULL) ? &c->data->stats : NULL;
+#endif
+	STATS_INC(nr_ops[STATS_ORDER]);
+	return _bst_cursor_next_helper(c, key, value);
+}
+
+void rbt_cursor_close(void *cursor)
+{
+	bst_cursor_t *c = cursor;
+
+	_bst_exit(c->data);
+	free(c);
+}
+
+static void _bst_top_collect(bst_top_t *top, bst_node_t *node, int depth, int levels)
+{
+	if(node == NULL || depth == levels)
+		return;
+	_bst_top_collect(top, LOAD_ACQ(node->link[0]), depth + 1, levels);
+	top->nodes[top->nr] = node;
+	top->keys[top->nr] = node->key;
+	top->depths[top->nr] = depth;
+	top->nr++;
+	_bst_top_collect(top, LOAD_ACQ(node->link[1]), depth + 1, levels);
+}
+
+/*
+ * Copies the top levels of the tree. A node that a concurrent delete moved
+ * up while it was read may be seen twice; the copy is then dropped. Returns
+ * NULL if the copy is not strictly sorted or the tree is empty.
+ */
+static bst_top_t *_bst_top_build(bst_t *bst, int levels)
+{
+	int i, max = (1 << levels) - 1;
+	bst_top_t *top;
+	char *mem;
+
+	XMALLOC(mem, sizeof(*top) + max * (sizeof(bst_node_t *) + sizeof(tree_key_t) + 1));
+	top = (bst_top_t *)mem;
+	top->dead = 0;
+	top->nr = 0;
+	top->nodes = (bst_node_t **)(top + 1);
+	top->keys = (tree_key_t *)(top->nodes + max);
+	top->depths = (unsigned char *)(top->keys + max);
+	_bst_top_collect(top, LOAD_ACQ(bst->root->link[0]), 0, levels);
+
+	for(i = 1; i < top->nr; i++)
+		if(top->keys[i - 1] >= top->keys[i])
+			break;
+	if(top->nr == 0 || i < top->nr){
+		free(top);
+		return NULL;
+	}
+	return top;
+}
+
+/*
+ * Replaces the current snapshot with top unless one of its nodes has been
+ * deleted in the meantime. top is stored in cache->pending before the
+ * deleted flags are checked, see _bst_top_forget. Replaced and dropped
+ * snapshots may still be read and are retired.
+ */
+static void _bst_top_publish(bst_t *bst, bst_top_cache_t *cache, bst_top_t *top)
+{
+	bst_top_t *old = bst->top;
+	int i;
+
+	__atomic_store_n(&cache->pending, top, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for(i = 0; i < top->nr; i++)
+		if(!NODE_VALID(top->nodes[i]))
+			break;
+	if(i < top->nr){
+		STORE_REL(cache->pending, NULL);
+		epoch_retire(&bst_epoch, &cache->retired, top);
+		cache->nr_discarded++;
+		return;
+	}
+
+	STORE_REL(bst->top, top);
+	STORE_REL(cache->pending, NULL);
+	cache->nr_published++;
+	if(old != NULL){
+		if(LOAD(old->dead))
+			cache->nr_dead++;
+		epoch_retire(&bst_epoch, &cache->retired, old);
+	}
+}
+
+static void *_bst_top_worker(void *arg)
+{
+	bst_t *bst = arg;
+	bst_top_cache_t *cache = bst->top_cache;
+	bst_thread_data_t *data = rbt_thread_data_new(-1);
+	bst_top_t *top;
+
+	while(!LOAD_ACQ(cache->stop)){
+		_bst_enter(data);
+		top = _bst_top_build(bst, cache->levels);
+		if(top != NULL)
+			_bst_top_publish(bst, cache, top);
+		else
+			cache->nr_discarded++;
+		_bst_exit(data);
+		usleep(cache->period_ms * 1000);
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts a thread that copies the top levels of the tree every period_ms
+ * milliseconds. Descents then start from the deepest copied node on their
+ * path, so the nodes near the root are no longer read by every operation.
+ * Meanwhile each delete also looks for its node in the copy. Call it, like
+ * rbt_top_cache_stop, while no other operation runs on the tree.
+ * Returns 1 on success, 0 if levels is not in [1, TOP_MAX_LEVELS] or the
+ * snapshot is already enabled.
+ */
+int rbt_top_cache_start(void *bst, int levels, int period_ms)
+{
+	bst_t *t = bst;
+	bst_top_cache_t *cache = t->top_cache;
+
+	if(levels < 1 || levels > TOP_MAX_LEVELS || period_ms < 1 ||
+	   (cache != NULL && cache->enabled))
+		return 0;
+	if(cache == NULL){
+		XMALLOC_ALIGNED(cache, 1, CACHE_LINE_SIZE);
+		memset(cache, 0, sizeof(*cache));
+		epoch_thread_register(&bst_epoch, &cache->retired, NULL, NULL);
+		STORE_REL(t->top_cache, cache);
+	}
+	cache->levels = levels;
+	cache->period_ms = period_ms;
+	cache->stop = 0;
+	cache->nr_published = cache->nr_discarded = cache->nr_dead = 0;
+
+	STORE_REL(cache->enabled, 1);
+	if(pthread_create(&cache->tid, NULL, _bst_top_worker, t) != 0){
+		STORE_REL(cache->enabled, 0);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Stops the rebuilder thread; descents start from the root again. Unlike
+ * the start, this may run concurrently with other operations.
+ */
+void rbt_top_cache_stop(void *bst)
+{
+	bst_t *t = bst;
+	bst_top_cache_t *cache = t->top_cache;
+	bst_top_t *top;
+
+	if(cache == NULL || !cache->enabled)
+		return;
+
+	STORE_REL(cache->stop, 1);
+	pthread_join(cache->tid, NULL);
+	top = t->top;
+	STORE_REL(t->top, NULL);
+	STORE_REL(cache->enabled, 0);
+	if(top != NULL){
+		if(LOAD(top->dead))
+			cache->nr_dead++;
+		epoch_retire(&bst_epoch, &cache->retired, top);
+	}
+
+	printf("Top cache: %lu snapshots published, %lu of them invalidated, %lu dropped\n",
+	       cache->nr_published, cache->nr_dead, cache->nr_discarded);
+}
+
+/*
+ * Number of keys in the tree, from counters that every thread updates after
+ * its successful inserts and deletes (see snapshot.h). Exact while no update
+ * runs; otherwise off by at most the number of updates in flight.
+ */
+long rbt_size(void *bst)
+{
+	return size_counter_read(&((bst_t *)bst)->size);
+}
+
+#ifdef TREE_SNAPSHOT
+/*
+ * Copies the nodes of the succ chain that belong to snap. A node that was
+ * deleted keeps its last value.
+ */
+static void _bst_snapshot_walk(bst_t *bst, snapshot_t *snap)
+{
+	bst_node_t *node = LOAD_ACQ(COLD(COLD(bst->root)->parent)->succ);
+	tree_value_t value;
+	int deleted;
+
+	while(node != bst->root){
+		deleted = !_bst_read_node(node, &value);
+		if(deleted)
+			value = LOAD(COLD(node)->value);
+		if(snapshot_visible(&bst->snapshot, snap, deleted, &COLD(node)->ins_ts,
+		                    &COLD(node)->del_ts))
+			snapshot_add(snap, node->key, value);
+		node = LOAD_ACQ(COLD(node)->succ);
+	}
+}
+
+/*
+ * Point-in-time copy of the keys of the tree and their values, built with
+ * -DTREE_SNAPSHOT (see snapshot.h). Updates continue while it is taken;
+ * concurrent calls are serialized. rbt_snapshot_next then returns the keys
+ * in increasing order, and rbt_snapshot_close frees the copy.
+ */
+void *rbt_snapshot_open(void *bst, void *thread_data)
+{
+	snapshot_t *snap;
+
+	_bst_enter(thread_data);
+	snap = snapshot_begin(&((bst_t *)bst)->snapshot);
+	_bst_snapshot_walk(bst, snap);
+	snapshot_end(&((bst_t *)bst)->snapshot, snap);
+	_bst_exit(thread_data);
+
+	return snap;
+}
+
+long rbt_snapshot_size(void *snapshot)
+{
+	return ((snapshot_t *)snapshot)->nr;
+}
+
+int rbt_snapshot_next(void *snapshot, tree_key_t *key, tree_value_t *value)
+{
+	return snapshot_next(snapshot, key, value);
+}
+
+void rbt_snapshot_close(void *snapshot)
+{
+	snapshot_free(snapshot);
+}
+#endif
+
 int rbt_validate(void *bst)
 {
 	int ret;
@@ -511,14 +2275,224 @@ int rbt_validate(void *bst)
 	return ret;
 }
 
+/*
+ * Selects where the nodes of thread data created afterwards, and the nodes
+ * of warmup and bulk_load, are allocated (NUMA_POLICY_*). Under a NUMA policy
+ * the warmup nodes come from a pool as well and, like those of bulk_load,
+ * must be deleted with a thread data. Returns the policy in effect, which is
+ * NUMA_POLICY_FIRST_TOUCH if the tree was built without -DTREE_NUMA or the
+ * machine has a single NUMA node.
+ */
+int rbt_numa_policy(int policy)
+{
+	numa_policy = (node_alloc_nr_nodes() > 1) ? policy : NUMA_POLICY_FIRST_TOUCH;
+	return numa_policy;
+}
+
 int rbt_warmup(void *bst, int nr_nodes, int max_key, 
                unsigned int seed, int force)
 {
 	int ret;
 	ret = _bst_warmup_helper((bst_t *)bst, nr_nodes, max_key, seed, force);
+	_bst_size_add(bst, NULL, ret);
+	return ret;
+}
+
+/*
+ * Loads n keys, sorted in strictly increasing order, into an empty tree in
+ * O(n) without taking any lock; values may be NULL. Up to nr_threads threads
+ * build disjoint subtrees. No other operation may run on the tree during the
+ * load. The nodes come from a single allocation and, like pool nodes, must
+ * be deleted with a thread data.
+ * Returns n, or 0 if the tree is not empty or the keys are not sorted.
+ */
+int rbt_bulk_load(void *bst, tree_key_t *keys, tree_value_t *values, int n, int nr_threads)
+{
+	int ret;
+	ret = _bst_bulk_load_helper((bst_t *)bst, keys, values, n, nr_threads);
+	_bst_size_add(bst, NULL, ret);
 	return ret;
 }
 
+/*
+ * Writes the keys of the tree and their values, in key order, to the
+ * checkpoint file path (see checkpoint.h). Built with -DTREE_SNAPSHOT the
+ * checkpoint is a point-in-time snapshot; otherwise it is a walk of the succ
+ * chain that may or may not see the updates that run concurrently.
+ * Returns the number of keys written, or -1 if the file cannot be written.
+ */
+long rbt_save(void *bst, void *thread_data, const char *path)
+{
+	tree_key_t *keys;
+	tree_value_t *values;
+	long n = 0;
+	int ret;
+#ifdef TREE_SNAPSHOT
+	snapshot_t *snap;
+
+	snap = rbt_snapshot_open(bst, thread_data);
+	XMALLOC(keys, snap->nr + 1);
+	XMALLOC(values, snap->nr + 1);
+	while(snapshot_next(snap, &keys[n], &values[n]))
+		n++;
+	snapshot_free(snap);
+#else
+	bst_node_t *node;
+	long size = 1024;
+
+	XMALLOC(keys, size);
+	XMALLOC(values, size);
+	_bst_enter(thread_data);
+	node = LOAD_ACQ(COLD(COLD(((bst_t *)bst)->root)->parent)->succ);
+	while(node != ((bst_t *)bst)->root){
+		if(n == size){
+			size *= 2;
+			keys = realloc(keys, size * sizeof(*keys));
+			values = realloc(values, size * sizeof(*values));
+			if(keys == NULL || values == NULL){
+				fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+				exit(1);
+			}
+		}
+		if(_bst_read_node(node, &values[n]))
+			keys[n++] = node->key;
+		node = LOAD_ACQ(COLD(node)->succ);
+	}
+	_bst_exit(thread_data);
+#endif
+
+	ret = checkpoint_write(path, keys, values, n);
+	free(keys);
+	free(values);
+	return (ret < 0) ? -1 : n;
+}
+
+/*
+ * Loads the checkpoint file path into an empty tree with bulk_load, reading
+ * the keys and values straight from the mapped file. The same restrictions
+ * as for bulk_load apply. Returns the number of keys loaded, or -1 if the
+ * file is missing, corrupt or was written by a build with other key or
+ * value types, or if the tree is not empty.
+ */
+long rbt_load(void *bst, const char *path, int nr_threads)
+{
+	checkpoint_map_t map;
+	long ret;
+
+	if(checkpoint_map(path, &map) < 0)
+		return -1;
+	ret = rbt_bulk_load(bst, map.keys, map.values, map.nr_keys, nr_threads);
+	if(ret == 0 && map.nr_keys > 0)
+		ret = -1;
+	checkpoint_unmap(&map);
+	return ret;
+}
+
+/*
+ * Starts logging every successful insert, delete and value update to the
+ * write-ahead log at path, with a group commit every period_us microseconds
+ * (see wal.h). An existing log is appended to; replay it first with
+ * rbt_wal_replay. Returns 1, or 0 if the log cannot be opened or is
+ * already on.
+ */
+int rbt_wal_start(void *bst, const char *path, int period_us)
+{
+	wal_t *wal;
+
+	if(((bst_t *)bst)->wal != NULL || period_us < 1)
+		return 0;
+	wal = wal_open(path, period_us);
+	if(wal == NULL)
+		return 0;
+	STORE_REL(((bst_t *)bst)->wal, wal);
+	return 1;
+}
+
+/* Waits until every update logged so far is durable. */
+void rbt_wal_sync(void *bst)
+{
+	wal_t *wal = LOAD_ACQ(((bst_t *)bst)->wal);
+
+	if(wal != NULL)
+		wal_sync(wal);
+}
+
+/*
+ * Flushes the log and stops logging. No update may run meanwhile.
+ * Returns the number of records written since rbt_wal_start.
+ */
+long rbt_wal_stop(void *bst)
+{
+	wal_t *wal = ((bst_t *)bst)->wal;
+
+	if(wal == NULL)
+		return 0;
+	STORE_REL(((bst_t *)bst)->wal, NULL);
+	return wal_close(wal);
+}
+
+/*
+ * Applies the write-ahead log at path: the last record of every key decides
+ * whether the key is present and its value. An empty tree is built with
+ * bulk_load, otherwise the keys are deleted and inserted again with the batch
+ * operations, WAL_REPLAY_BATCH keys at a time. No other operation may run
+ * meanwhile. Returns the number of records, or -1 if the log cannot be read.
+ */
+long rbt_wal_replay(void *bst, void *thread_data, const char *path, int nr_threads)
+{
+	wal_record_t *records;
+	tree_key_t *keys;
+	tree_value_t *values;
+	long n, nr_keys, nr_present = 0, i, len;
+
+	n = wal_read(path, &records);
+	if(n < 0)
+		return -1;
+	nr_keys = wal_last_per_key(records, n);
+	XMALLOC(keys, nr_keys + 1);
+	XMALLOC(values, nr_keys + 1);
+
+	if(rbt_size(bst) != 0){
+		for(i = 0; i < nr_keys; i++)
+			keys[i] = records[i].key;
+		for(i = 0; i < nr_keys; i += WAL_REPLAY_BATCH){
+			len = (nr_keys - i < WAL_REPLAY_BATCH) ? nr_keys - i : WAL_REPLAY_BATCH;
+			rbt_delete_batch(bst, thread_data, keys + i, len);
+		}
+	}
+	for(i = 0; i < nr_keys; i++){
+		if((records[i].lsn_op & 3) != WAL_INSERT)
+			continue;
+		keys[nr_present] = records[i].key;
+		values[nr_present++] = records[i].value;
+	}
+	if(rbt_size(bst) == 0){
+		rbt_bulk_load(bst, keys, values, nr_present, nr_threads);
+	}else{
+		for(i = 0; i < nr_present; i += WAL_REPLAY_BATCH){
+			len = (nr_present - i < WAL_REPLAY_BATCH) ? nr_present - i : WAL_REPLAY_BATCH;
+			rbt_insert_batch(bst, thread_data, keys + i, values + i, len);
+		}
+	}
+
+	free(keys);
+	free(values);
+	free(records);
+	return n;
+}
+
+/*
+ * Selects the contention manager of the lock retry loops of this tree
+ * (CONTENTION_*, see contention.h). yield_after sets the failures in a row
+ * before a thread yields, or the starting point of CONTENTION_ADAPTIVE;
+ * 0 keeps the current one. May be called while the tree is in use. Returns
+ * 1, or 0 if policy or yield_after is out of range.
+ */
+int rbt_contention(void *bst, int policy, int yield_after)
+{
+	return contention_config(&((bst_t *)bst)->cm, policy, yield_after);
+}
+
 char *rbt_name()
 {
 	return "bst_logical_ordering";
@@ -0,0 +1,180 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+/*
+ * Checkpoint files.
+ *
+ * A checkpoint holds a header, the keys of a tree in increasing order and
+ * their values. Both arrays start on a CHECKPOINT_ALIGN boundary, so a
+ * loader can mmap the file and hand them to bulk_load as they are, without
+ * copying or parsing them. The header records the key and value sizes,
+ * which must match the build that reads the file, and a checksum of both
+ * arrays. Values are stored as raw bits: pointer values do not survive a
+ * restart, scalar values (-DVALUE_TYPE) do. A file is written under a
+ * temporary name and renamed into place, so a crash never leaves a torn
+ * checkpoint at path.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "key.h"
+
+#define CHECKPOINT_MAGIC 0x54504b4345455254ULL	//> "TREECKPT" on little-endian machines
+#define CHECKPOINT_ALIGN 64
+
+typedef struct {
+	uint64_t magic;
+	uint32_t key_size;
+	uint32_t value_size;
+	uint64_t nr_keys;
+	uint64_t checksum;		//> Of the key and value arrays, see checkpoint_checksum
+} checkpoint_header_t;
+
+typedef struct {
+	void *base;
+	size_t len;
+	tree_key_t *keys;
+	tree_value_t *values;
+	long nr_keys;
+} checkpoint_map_t;
+
+#define CHECKPOINT_ROUND(off) (((off) + CHECKPOINT_ALIGN - 1) & ~((size_t)CHECKPOINT_ALIGN - 1))
+#define CHECKPOINT_KEYS_OFF CHECKPOINT_ROUND(sizeof(checkpoint_header_t))
+#define CHECKPOINT_VALUES_OFF(n) CHECKPOINT_ROUND(CHECKPOINT_KEYS_OFF + (n) * sizeof(tree_key_t))
+#define CHECKPOINT_LEN(n) (CHECKPOINT_VALUES_OFF(n) + (n) * sizeof(tree_value_t))
+
+/* Multiplicative hash over 8-byte words, a few GB/s. */
+static inline uint64_t checkpoint_checksum(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t w;
+
+	for (; len >= sizeof(w); len -= sizeof(w), p += sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		h = (h ^ w) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	for (; len > 0; len--, p++)
+		h = (h ^ *p) * 0x100000001b3ULL;
+	return h;
+}
+
+static inline int _checkpoint_write_all(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret < 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Writes keys[0, n), in increasing order, and their values to path.
+ * Returns 0, or -1 with errno set.
+ */
+static inline int checkpoint_write(const char *path, tree_key_t *keys, tree_value_t *values, long n)
+{
+	static const char zeros[CHECKPOINT_ALIGN];
+	checkpoint_header_t hdr;
+	char tmp[4096];
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return -1;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	hdr.magic = CHECKPOINT_MAGIC;
+	hdr.key_size = sizeof(tree_key_t);
+	hdr.value_size = sizeof(tree_value_t);
+	hdr.nr_keys = n;
+	hdr.checksum = checkpoint_checksum(0, keys, n * sizeof(tree_key_t));
+	hdr.checksum = checkpoint_checksum(hdr.checksum, values, n * sizeof(tree_value_t));
+	if (_checkpoint_write_all(fd, &hdr, sizeof(hdr)) < 0 ||
+	    _checkpoint_write_all(fd, zeros, CHECKPOINT_KEYS_OFF - sizeof(hdr)) < 0 ||
+	    _checkpoint_write_all(fd, keys, n * sizeof(tree_key_t)) < 0 ||
+	    _checkpoint_write_all(fd, zeros, CHECKPOINT_VALUES_OFF(n) - CHECKPOINT_KEYS_OFF -
+	                                     n * sizeof(tree_key_t)) < 0 ||
+	    _checkpoint_write_all(fd, values, n * sizeof(tree_value_t)) < 0 ||
+	    fsync(fd) < 0) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	if (close(fd) < 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* Checks the header and the checksum of a mapped checkpoint and fills map. */
+static inline int _checkpoint_check(checkpoint_map_t *map)
+{
+	checkpoint_header_t *hdr = map->base;
+	uint64_t sum;
+
+	if (hdr->magic != CHECKPOINT_MAGIC || hdr->key_size != sizeof(tree_key_t) ||
+	    hdr->value_size != sizeof(tree_value_t) || hdr->nr_keys > INT_MAX ||
+	    map->len != CHECKPOINT_LEN(hdr->nr_keys))
+		return -1;
+
+	map->nr_keys = hdr->nr_keys;
+	map->keys = (tree_key_t *)((char *)map->base + CHECKPOINT_KEYS_OFF);
+	map->values = (tree_value_t *)((char *)map->base + CHECKPOINT_VALUES_OFF(map->nr_keys));
+	sum = checkpoint_checksum(0, map->keys, map->nr_keys * sizeof(tree_key_t));
+	sum = checkpoint_checksum(sum, map->values, map->nr_keys * sizeof(tree_value_t));
+	return (sum == hdr->checksum) ? 0 : -1;
+}
+
+/*
+ * Maps the checkpoint at path read-only and checks it. Returns 0 and fills
+ * map, or -1 if the file cannot be read, was written by a build with other
+ * key or value types, or is truncated or corrupt.
+ */
+static inline int checkpoint_map(const char *path, checkpoint_map_t *map)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < CHECKPOINT_KEYS_OFF) {
+		close(fd);
+		return -1;
+	}
+	map->len = st.st_size;
+	map->base = mmap(NULL, map->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map->base == MAP_FAILED)
+		return -1;
+	madvise(map->base, map->len, MADV_SEQUENTIAL);
+
+	if (_checkpoint_check(map) < 0) {
+		munmap(map->base, map->len);
+		return -1;
+	}
+	return 0;
+}
+
+static inline void checkpoint_unmap(checkpoint_map_t *map)
+{
+	munmap(map->base, map->len);
+}
+
+#endif /* CHECKPOINT_H */
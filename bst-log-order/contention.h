@@ -0,0 +1,140 @@
+#ifndef CONTENTION_H
+#define CONTENTION_H
+
+/*
+ * Contention management of the lock retry loops.
+ *
+ * A retry loop (lockParent, acquireTreeLocks, the restart of rebalance) keeps
+ * a cm_retry_t on its stack: it takes the locks it may wait for with cm_lock,
+ * calls cm_wait after every failed attempt and cm_end once it succeeded. The
+ * policy of the tree (CONTENTION_* in key.h) decides what a failure costs:
+ *
+ *   SPIN      retry at once, cm_lock is node_lock
+ *   PAUSE     one pause instruction
+ *   BACKOFF   CM_MIN_BACKOFF pauses, doubling up to CM_MAX_BACKOFF
+ *   YIELD     BACKOFF, and sched_yield from the yield_after-th failure in a
+ *             row on
+ *   ADAPTIVE  YIELD, with yield_after tuned by the loops: one that succeeded
+ *             right after a yield halves it, one that succeeded without
+ *             yielding raises it by one, up to CM_MAX_YIELD_AFTER
+ *
+ * Yielding lets a preempted lock holder run again when there are more
+ * threads than cpus, where spinning on it burns the rest of a time slice.
+ * Except with SPIN, cm_lock retries node_trylock, so the futex locks of
+ * NODE_LOCK_FUTEX never sleep in these loops. yield_after is only written
+ * at the end of loops that failed at least once.
+ */
+
+#include <sched.h>
+
+#include "atomics.h"
+#include "key.h"
+#include "lock.h"
+
+#define CM_MIN_BACKOFF 4		//> Pauses
+#define CM_MAX_BACKOFF 1024
+#define CM_MAX_YIELD_AFTER 1024
+#define CM_DEFAULT_POLICY CONTENTION_ADAPTIVE
+#define CM_DEFAULT_YIELD_AFTER 16
+#define CM_CACHE_LINE_SIZE 64
+
+typedef struct {
+	int policy;
+	int yield_after;		//> Failures in a row before yielding (YIELD, ADAPTIVE)
+} __attribute__((aligned(CM_CACHE_LINE_SIZE))) contention_t;
+
+typedef struct {
+	contention_t *cm;
+	int policy;
+	int yield_after;		//> Of cm, when the loop started
+	int nr_fails;
+	int nr_yields;
+	int yielded;			//> The last wait yielded
+	unsigned int backoff;
+} cm_retry_t;
+
+static inline void contention_init(contention_t *cm)
+{
+	cm->policy = CM_DEFAULT_POLICY;
+	cm->yield_after = CM_DEFAULT_YIELD_AFTER;
+}
+
+/*
+ * Sets the policy of cm; yield_after <= 0 keeps the current one. Returns 0
+ * if policy or yield_after is out of range.
+ */
+static inline int contention_config(contention_t *cm, int policy, int yield_after)
+{
+	if (policy < CONTENTION_SPIN || policy > CONTENTION_ADAPTIVE ||
+	    yield_after > CM_MAX_YIELD_AFTER)
+		return 0;
+	if (yield_after > 0)
+		STORE(cm->yield_after, yield_after);
+	STORE(cm->policy, policy);
+	return 1;
+}
+
+static inline void cm_begin(cm_retry_t *r, contention_t *cm)
+{
+	r->cm = cm;
+	r->policy = LOAD(cm->policy);
+	r->yield_after = LOAD(cm->yield_after);
+	r->nr_fails = 0;
+	r->nr_yields = 0;
+	r->yielded = 0;
+	r->backoff = CM_MIN_BACKOFF;
+}
+
+static inline void cm_wait(cm_retry_t *r)
+{
+	unsigned int i;
+
+	r->nr_fails++;
+	r->yielded = 0;
+	switch (r->policy) {
+	case CONTENTION_SPIN:
+		return;
+	case CONTENTION_PAUSE:
+		cpu_relax();
+		return;
+	case CONTENTION_YIELD:
+	case CONTENTION_ADAPTIVE:
+		if (r->nr_fails >= r->yield_after) {
+			sched_yield();
+			r->nr_yields++;
+			r->yielded = 1;
+			return;
+		}
+		/* fall through */
+	default:
+		for (i = 0; i < r->backoff; i++)
+			cpu_relax();
+		if (r->backoff < CM_MAX_BACKOFF)
+			r->backoff <<= 1;
+	}
+}
+
+static inline void cm_lock(cm_retry_t *r, node_lock_t *lock)
+{
+	if (r->policy == CONTENTION_SPIN) {
+		node_lock(lock);
+		return;
+	}
+	while (node_trylock(lock) != 0)
+		cm_wait(r);
+}
+
+static inline void cm_end(cm_retry_t *r)
+{
+	int yield_after;
+
+	if (r->policy != CONTENTION_ADAPTIVE || r->nr_fails == 0)
+		return;
+	yield_after = LOAD(r->cm->yield_after);
+	if (r->yielded && yield_after > 1)
+		STORE(r->cm->yield_after, yield_after / 2);
+	else if (!r->yielded && r->nr_fails < yield_after && yield_after < CM_MAX_YIELD_AFTER)
+		STORE(r->cm->yield_after, yield_after + 1);
+}
+
+#endif /* CONTENTION_H */
@@ -0,0 +1,179 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based memory reclamation.
+ *
+ * Every operation that dereferences tree nodes runs between epoch_enter()
+ * and epoch_exit(). A node that has been unlinked from both the tree and the
+ * logical ordering layout is handed to epoch_retire() and is only freed once
+ * the global epoch has advanced twice past the epoch it was retired in, i.e.
+ * once every traversal that could still be walking pred/succ/link pointers
+ * to it has finished. Critical sections may nest, e.g. operations issued
+ * while a cursor keeps its node pinned; only the outermost one counts.
+ */
+
+#include <pthread.h>
+
+#include "alloc.h"
+
+#define EPOCH_NR_LIMBO 3
+#define EPOCH_ADVANCE_THRESHOLD 64	//> Retired nodes before trying to advance the epoch
+#define EPOCH_CACHE_LINE_SIZE 64
+
+typedef void (*epoch_free_fn_t)(void *ptr, void *arg);
+
+typedef struct {
+	unsigned long epoch;		//> Epoch in which the nodes of this bag were retired
+	void **ptrs;
+	int nr, size;
+} epoch_limbo_t;
+
+typedef struct epoch_thread {
+	unsigned long local_epoch;
+	int active;			//> Active = 1 => thread is inside a critical section
+	int nesting;			//> Depth of nested critical sections
+
+	epoch_limbo_t limbo[EPOCH_NR_LIMBO];
+	int nr_pending;
+	epoch_free_fn_t free_fn;
+	void *free_arg;
+
+	struct epoch_thread *next;
+} __attribute__((aligned(EPOCH_CACHE_LINE_SIZE))) epoch_thread_t;
+
+typedef struct {
+	unsigned long global_epoch;
+	epoch_thread_t *threads;	//> Registered threads, never removed
+} epoch_domain_t;
+
+static void epoch_free_default(void *ptr, void *arg)
+{
+	free(ptr);
+}
+
+static inline void epoch_thread_register(epoch_domain_t *dom, epoch_thread_t *t,
+                                         epoch_free_fn_t free_fn, void *free_arg)
+{
+	int i;
+	epoch_thread_t *head;
+
+	t->local_epoch = __atomic_load_n(&dom->global_epoch, __ATOMIC_SEQ_CST);
+	t->active = 0;
+	t->nesting = 0;
+	for (i = 0; i < EPOCH_NR_LIMBO; i++) {
+		t->limbo[i].epoch = t->local_epoch;
+		t->limbo[i].ptrs = NULL;
+		t->limbo[i].nr = 0;
+		t->limbo[i].size = 0;
+	}
+	t->nr_pending = 0;
+	t->free_fn = (free_fn != NULL) ? free_fn : epoch_free_default;
+	t->free_arg = free_arg;
+
+	head = __atomic_load_n(&dom->threads, __ATOMIC_SEQ_CST);
+	do {
+		t->next = head;
+	} while (!__atomic_compare_exchange_n(&dom->threads, &head, t, 0,
+	                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
+
+static inline void epoch_limbo_free(epoch_thread_t *t, epoch_limbo_t *bag)
+{
+	int i;
+
+	for (i = 0; i < bag->nr; i++)
+		t->free_fn(bag->ptrs[i], t->free_arg);
+	t->nr_pending -= bag->nr;
+	bag->nr = 0;
+}
+
+/*
+ * Frees every bag whose nodes were retired at least two epochs before
+ * `epoch'. No active thread can still hold a reference to them.
+ */
+static inline void epoch_reclaim(epoch_thread_t *t, unsigned long epoch)
+{
+	int i;
+
+	for (i = 0; i < EPOCH_NR_LIMBO; i++) {
+		epoch_limbo_t *bag = &t->limbo[i];
+		if (bag->nr > 0 && bag->epoch + 2 <= epoch)
+			epoch_limbo_free(t, bag);
+	}
+}
+
+static inline void epoch_enter(epoch_domain_t *dom, epoch_thread_t *t)
+{
+	unsigned long epoch;
+
+	if (t->nesting++ > 0)
+		return;
+	__atomic_store_n(&t->active, 1, __ATOMIC_SEQ_CST);
+	epoch = __atomic_load_n(&dom->global_epoch, __ATOMIC_SEQ_CST);
+	if (epoch != t->local_epoch) {
+		__atomic_store_n(&t->local_epoch, epoch, __ATOMIC_SEQ_CST);
+		epoch_reclaim(t, epoch);
+	}
+}
+
+static inline void epoch_exit(epoch_thread_t *t)
+{
+	if (--t->nesting > 0)
+		return;
+	__atomic_store_n(&t->active, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * The global epoch may only advance when every active thread has already
+ * observed the current one.
+ */
+static inline void epoch_try_advance(epoch_domain_t *dom, epoch_thread_t *self)
+{
+	unsigned long epoch = __atomic_load_n(&dom->global_epoch, __ATOMIC_SEQ_CST);
+	epoch_thread_t *t;
+
+	for (t = __atomic_load_n(&dom->threads, __ATOMIC_SEQ_CST); t != NULL; t = t->next) {
+		if (__atomic_load_n(&t->active, __ATOMIC_SEQ_CST) &&
+		    __atomic_load_n(&t->local_epoch, __ATOMIC_SEQ_CST) != epoch)
+			return;
+	}
+
+	if (__atomic_compare_exchange_n(&dom->global_epoch, &epoch, epoch + 1, 0,
+	                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		epoch++;
+
+	epoch_reclaim(self, epoch);
+}
+
+/*
+ * Must be called after ptr has been unlinked. The bag is tagged with the
+ * global epoch observed after the unlink: every traversal that may still
+ * reference ptr started no later than that epoch.
+ */
+static inline void epoch_retire(epoch_domain_t *dom, epoch_thread_t *t, void *ptr)
+{
+	unsigned long epoch = __atomic_load_n(&dom->global_epoch, __ATOMIC_SEQ_CST);
+	epoch_limbo_t *bag = &t->limbo[epoch % EPOCH_NR_LIMBO];
+
+	if (bag->epoch != epoch) {		//> Bag holds nodes from epoch - 3 or older
+		epoch_limbo_free(t, bag);
+		bag->epoch = epoch;
+	}
+
+	if (bag->nr == bag->size) {
+		bag->size = (bag->size == 0) ? EPOCH_ADVANCE_THRESHOLD : 2 * bag->size;
+		bag->ptrs = realloc(bag->ptrs, bag->size * sizeof(*bag->ptrs));
+		if (bag->ptrs == NULL) {
+			fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+			exit(1);
+		}
+	}
+	bag->ptrs[bag->nr++] = ptr;
+	t->nr_pending++;
+
+	if (t->nr_pending >= EPOCH_ADVANCE_THRESHOLD)
+		epoch_try_advance(dom, t);
+}
+
+#endif /* EPOCH_H */
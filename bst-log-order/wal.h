@@ -0,0 +1,366 @@
+#ifndef WAL_H
+#define WAL_H
+
+/*
+ * Write-ahead log of inserts, deletes and value updates.
+ *
+ * Every successful update appends a record while it still holds the locks
+ * of its linearization point. The record takes the next log sequence number
+ * (LSN) there, so the LSNs of the updates of one key follow their order in
+ * the tree. Records go to one of WAL_NR_STRIPES buffers, picked by the tid
+ * of the thread, and a single flusher thread moves all buffers to the file
+ * every period_us microseconds and syncs it once (group commit). The records
+ * of different buffers are therefore not in LSN order in the file; replay
+ * sorts them and keeps the last record of every key.
+ *
+ * The file starts with a header that records the key and value sizes. A
+ * crash may leave a torn record at the end, which is dropped when the log is
+ * read or reopened. Updates are durable once wal_sync returns, or after the
+ * next flush; an update that was not yet durable may be lost in a crash,
+ * while the updates of the same key that preceded it are not.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "key.h"
+
+#define WAL_MAGIC 0x474f4c4545525454ULL	//> "TTREELOG" on little-endian machines
+#define WAL_NR_STRIPES 64
+#define WAL_CACHE_LINE_SIZE 64
+#define WAL_INSERT 1			//> Insert, or value update of an existing key
+#define WAL_DELETE 2
+#define WAL_REPLAY_BATCH 4096		//> Keys per batch when replaying into a non-empty tree
+
+typedef struct {
+	uint64_t magic;
+	uint32_t key_size;
+	uint32_t value_size;
+} wal_header_t;
+
+typedef struct {
+	uint64_t lsn_op;		//> LSN << 2 | WAL_INSERT or WAL_DELETE
+	tree_key_t key;
+	tree_value_t value;
+} wal_record_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	wal_record_t *buf;
+	int nr, size;
+} __attribute__((aligned(WAL_CACHE_LINE_SIZE))) wal_stripe_t;
+
+typedef struct {
+	uint64_t lsn __attribute__((aligned(WAL_CACHE_LINE_SIZE)));	//> Next LSN
+	wal_stripe_t stripes[WAL_NR_STRIPES];
+
+	int fd;
+	int period_us;
+	int stop;
+	uint64_t durable;		//> Every record below this LSN is on disk
+	pthread_mutex_t lock;		//> Protects stop and durable, serializes flushes
+	pthread_cond_t kick, flushed;
+	pthread_t flusher;
+	wal_record_t *spare;		//> Buffer the flusher swaps in
+	int spare_size;
+
+	unsigned long nr_records, nr_flushes;
+} wal_t;
+
+static inline int _wal_write_all(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret < 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static inline int _wal_read_all(int fd, void *data, size_t len)
+{
+	char *p = data;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read(fd, p, len);
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static inline int _wal_record_valid(wal_record_t *r)
+{
+	int op = r->lsn_op & 3;
+
+	return op == WAL_INSERT || op == WAL_DELETE;
+}
+
+/*
+ * Reads the records of the log at path into *records. A torn or zeroed tail
+ * is dropped. Returns the number of records, or -1 if the file cannot be
+ * read or was written by a build with other key or value types.
+ */
+static inline long wal_read(const char *path, wal_record_t **records)
+{
+	wal_header_t hdr;
+	struct stat st;
+	long n, i;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || _wal_read_all(fd, &hdr, sizeof(hdr)) < 0 ||
+	    hdr.magic != WAL_MAGIC || hdr.key_size != sizeof(tree_key_t) ||
+	    hdr.value_size != sizeof(tree_value_t)) {
+		close(fd);
+		return -1;
+	}
+	n = (st.st_size - sizeof(hdr)) / sizeof(wal_record_t);
+	XMALLOC(*records, n + 1);
+	if (_wal_read_all(fd, *records, n * sizeof(wal_record_t)) < 0) {
+		free(*records);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	for (i = 0; i < n && _wal_record_valid(&(*records)[i]); i++)
+		;
+	return i;
+}
+
+static int _wal_record_cmp(const void *a, const void *b)
+{
+	const wal_record_t *r1 = a, *r2 = b;
+
+	if (r1->key != r2->key)
+		return (r1->key > r2->key) - (r1->key < r2->key);
+	return (r1->lsn_op > r2->lsn_op) - (r1->lsn_op < r2->lsn_op);
+}
+
+/*
+ * Sorts records by key and keeps the last record of every key, in place.
+ * Returns the number of keys.
+ */
+static inline long wal_last_per_key(wal_record_t *records, long n)
+{
+	long i, nr_keys = 0;
+
+	qsort(records, n, sizeof(*records), _wal_record_cmp);
+	for (i = 0; i < n; i++) {
+		if (nr_keys > 0 && records[nr_keys - 1].key == records[i].key)
+			nr_keys--;
+		records[nr_keys++] = records[i];
+	}
+	return nr_keys;
+}
+
+/* Moves every buffer to the file and syncs it. Called with wal->lock held. */
+static inline void _wal_flush(wal_t *wal)
+{
+	uint64_t target = __atomic_load_n(&wal->lsn, __ATOMIC_SEQ_CST);
+	wal_stripe_t *stripe;
+	wal_record_t *buf;
+	int i, nr, size, written = 0;
+
+	for (i = 0; i < WAL_NR_STRIPES; i++) {
+		stripe = &wal->stripes[i];
+		pthread_mutex_lock(&stripe->lock);
+		nr = stripe->nr;
+		if (nr > 0) {
+			buf = stripe->buf;
+			size = stripe->size;
+			stripe->buf = wal->spare;
+			stripe->size = wal->spare_size;
+			stripe->nr = 0;
+			wal->spare = buf;
+			wal->spare_size = size;
+		}
+		pthread_mutex_unlock(&stripe->lock);
+		if (nr == 0)
+			continue;
+		if (_wal_write_all(wal->fd, wal->spare, nr * sizeof(wal_record_t)) < 0) {
+			perror("wal");
+			exit(1);
+		}
+		wal->nr_records += nr;
+		written = 1;
+	}
+	if (written) {
+		if (fdatasync(wal->fd) < 0) {
+			perror("wal");
+			exit(1);
+		}
+		wal->nr_flushes++;
+	}
+	wal->durable = target;
+	pthread_cond_broadcast(&wal->flushed);
+}
+
+static void *_wal_flusher(void *arg)
+{
+	wal_t *wal = arg;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&wal->lock);
+	while (!wal->stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += wal->period_us * 1000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&wal->kick, &wal->lock, &deadline);
+		_wal_flush(wal);
+	}
+	_wal_flush(wal);
+	pthread_mutex_unlock(&wal->lock);
+	return NULL;
+}
+
+/*
+ * Opens the log at path for appending, or creates it, and starts the flusher
+ * with a group commit every period_us microseconds. LSNs continue after the
+ * last record of an existing log, whose torn tail is cut off. Returns NULL
+ * if the file cannot be opened or was written by another build.
+ */
+static inline wal_t *wal_open(const char *path, int period_us)
+{
+	wal_header_t hdr = { WAL_MAGIC, sizeof(tree_key_t), sizeof(tree_value_t) };
+	wal_record_t *records;
+	wal_t *wal;
+	long n, i;
+	uint64_t lsn = 0;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd >= 0) {
+		if (_wal_write_all(fd, &hdr, sizeof(hdr)) < 0 || fsync(fd) < 0) {
+			close(fd);
+			unlink(path);
+			return NULL;
+		}
+	} else {
+		if (errno != EEXIST || (n = wal_read(path, &records)) < 0)
+			return NULL;
+		for (i = 0; i < n; i++)
+			if ((records[i].lsn_op >> 2) >= lsn)
+				lsn = (records[i].lsn_op >> 2) + 1;
+		free(records);
+		fd = open(path, O_WRONLY);
+		if (fd < 0 || ftruncate(fd, sizeof(hdr) + n * sizeof(wal_record_t)) < 0 ||
+		    lseek(fd, 0, SEEK_END) < 0) {
+			if (fd >= 0)
+				close(fd);
+			return NULL;
+		}
+	}
+
+	XMALLOC_ALIGNED(wal, 1, WAL_CACHE_LINE_SIZE);
+	wal->lsn = lsn;
+	for (i = 0; i < WAL_NR_STRIPES; i++) {
+		pthread_mutex_init(&wal->stripes[i].lock, NULL);
+		wal->stripes[i].size = 1024;
+		wal->stripes[i].nr = 0;
+		XMALLOC(wal->stripes[i].buf, wal->stripes[i].size);
+	}
+	wal->fd = fd;
+	wal->period_us = period_us;
+	wal->stop = 0;
+	wal->durable = lsn;
+	pthread_mutex_init(&wal->lock, NULL);
+	pthread_cond_init(&wal->kick, NULL);
+	pthread_cond_init(&wal->flushed, NULL);
+	wal->spare_size = 1024;
+	XMALLOC(wal->spare, wal->spare_size);
+	wal->nr_records = 0;
+	wal->nr_flushes = 0;
+	if (pthread_create(&wal->flusher, NULL, _wal_flusher, wal) != 0) {
+		fprintf(stderr, "Failed to start the log flusher\n");
+		exit(1);
+	}
+	return wal;
+}
+
+/*
+ * Called with the locks of the update's linearization point held, so that
+ * the LSN follows the order of the updates of key.
+ */
+static inline void wal_append(wal_t *wal, int tid, int op, tree_key_t key, tree_value_t value)
+{
+	wal_stripe_t *stripe = &wal->stripes[(unsigned int)tid % WAL_NR_STRIPES];
+	wal_record_t *r;
+
+	pthread_mutex_lock(&stripe->lock);
+	if (stripe->nr == stripe->size) {
+		stripe->size *= 2;
+		stripe->buf = realloc(stripe->buf, stripe->size * sizeof(*stripe->buf));
+		if (stripe->buf == NULL) {
+			fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+			exit(1);
+		}
+	}
+	r = &stripe->buf[stripe->nr++];
+	r->lsn_op = __atomic_fetch_add(&wal->lsn, 1, __ATOMIC_RELAXED) << 2 | op;
+	r->key = key;
+	r->value = (op == WAL_INSERT) ? value : VALUE_NONE;
+	pthread_mutex_unlock(&stripe->lock);
+}
+
+/* Waits until every update logged so far is durable. */
+static inline void wal_sync(wal_t *wal)
+{
+	uint64_t target = __atomic_load_n(&wal->lsn, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&wal->lock);
+	while (wal->durable < target) {
+		pthread_cond_signal(&wal->kick);
+		pthread_cond_wait(&wal->flushed, &wal->lock);
+	}
+	pthread_mutex_unlock(&wal->lock);
+}
+
+/*
+ * Flushes the remaining records, stops the flusher and frees wal. Returns
+ * the number of records written.
+ */
+static inline unsigned long wal_close(wal_t *wal)
+{
+	unsigned long nr_records;
+	int i;
+
+	pthread_mutex_lock(&wal->lock);
+	wal->stop = 1;
+	pthread_cond_signal(&wal->kick);
+	pthread_mutex_unlock(&wal->lock);
+	pthread_join(wal->flusher, NULL);
+
+	close(wal->fd);
+	for (i = 0; i < WAL_NR_STRIPES; i++) {
+		pthread_mutex_destroy(&wal->stripes[i].lock);
+		free(wal->stripes[i].buf);
+	}
+	free(wal->spare);
+	nr_records = wal->nr_records;
+	free(wal);
+	return nr_records;
+}
+
+#endif /* WAL_H */
@@ -0,0 +1,768 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../bench/trees.h"
+
+/*
+ * Range-partitioned front-end over the BST and the AVL tree.
+ *
+ * The key space is split into shards, each an independent tree of the base
+ * implementation, so that writers to different ranges never meet at the top
+ * of one tree. The shard map (the lower bound of every shard and the shard
+ * itself) is immutable and published by pointer; operations route their key
+ * with a binary search over it. Keys keep one global order: shard i holds the
+ * keys in [lo[i], lo[i + 1]), so range scans continue from the largest key of
+ * a shard with the smallest key of the next one.
+ *
+ * Boundaries adapt to the keys. Every SHARD_CHECK_PERIOD successful updates a
+ * thread compares the size of the largest shard with the average; a shard
+ * that holds more than SHARD_SKEW times the average is split at its median
+ * while there are fewer than SHARD_MAX_FACTOR times the configured number of
+ * shards, and otherwise shares its keys evenly with its smaller neighbour.
+ * Such a repartition freezes the shards it replaces: writers announce the
+ * shard they update in their thread data before checking its frozen flag,
+ * and the repartition sets the flag before waiting for the announcements of
+ * that shard to clear, so no update runs on a frozen shard. It then copies
+ * the keys of the frozen shards, bulk loads them into new trees and publishes
+ * a new map. Writers of a frozen shard wait for that map; readers repeat an
+ * operation that overlapped a new map, since they may have read a replaced
+ * shard. Replaced shards and maps are never freed, as readers may still be
+ * walking them; a shard has to double the average size to be replaced.
+ *
+ * Range scans are weakly consistent across shards, also with
+ * RANGE_SCAN_LINEARIZABLE, which then only holds within each shard.
+ */
+
+#define SHARD_DEFAULT_NR 16
+#define SHARD_MAX_FACTOR 4		//> Splits stop at this many times the configured shards
+#define SHARD_MAX_NR 4096
+#define SHARD_CHECK_PERIOD 4096		//> Successful updates of a thread between balance checks
+#define SHARD_SKEW 2
+#define SHARD_CACHE_LINE_SIZE 64
+
+typedef struct {
+	void *tree;
+	int frozen;			//> Set once, before the shard is replaced
+} __attribute__((aligned(SHARD_CACHE_LINE_SIZE))) shard_t;
+
+typedef struct shard_map {
+	int nr;
+	tree_key_t *lo;			//> Smallest key of every shard, lo[0] = KEY_MIN
+	shard_t **shards;
+	struct shard_map *prev;		//> Replaced map
+} shard_map_t;
+
+typedef struct {
+	const tree_ops_t *base;
+	shard_map_t *map;
+	int nr_max;
+	pthread_mutex_t lock;		//> Serializes repartitions
+	void *data;			//> Thread data of the base tree for warmup and validate
+	int cm_policy, cm_yield_after;	//> Of shard_contention, cm_policy < 0 if not set
+} sharded_t;
+
+typedef struct shard_thread_data {
+	shard_t *writing;		//> Shard this thread is updating, NULL if none
+	const tree_ops_t *base;
+	void *data;			//> Thread data of the base tree, valid for every shard
+	int nr_updates;			//> Since the last balance check
+	struct shard_thread_data *next;
+} __attribute__((aligned(SHARD_CACHE_LINE_SIZE))) shard_thread_data_t;
+
+typedef struct {
+	int shard, idx;
+} shard_slot_t;
+
+static int shard_nr = SHARD_DEFAULT_NR;
+static shard_thread_data_t *shard_threads;	//> Registered threads, never removed
+
+#define SHARD_XMALLOC(ptr, n) do { \
+	(ptr) = malloc((n) * sizeof(*(ptr))); \
+	if ((ptr) == NULL) { \
+		fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__); \
+		exit(1); \
+	} \
+} while (0)
+
+static const tree_ops_t *_shard_base(const char *id)
+{
+	unsigned int i;
+
+	for (i = 0; i < NR_TREES; i++)
+		if (strcmp(tree_ops[i].id, id) == 0)
+			return &tree_ops[i];
+	return NULL;
+}
+
+static shard_map_t *_shard_map_new(int nr)
+{
+	shard_map_t *map;
+
+	SHARD_XMALLOC(map, 1);
+	SHARD_XMALLOC(map->lo, nr);
+	SHARD_XMALLOC(map->shards, nr);
+	map->nr = nr;
+	map->prev = NULL;
+	return map;
+}
+
+static shard_t *_shard_new(sharded_t *sh)
+{
+	shard_t *s;
+
+	s = aligned_alloc(SHARD_CACHE_LINE_SIZE, sizeof(*s));
+	if (s == NULL) {
+		fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+		exit(1);
+	}
+	s->tree = sh->base->new();
+	s->frozen = 0;
+	if (sh->cm_policy >= 0)
+		sh->base->contention(s->tree, sh->cm_policy, sh->cm_yield_after);
+	return s;
+}
+
+/* Index of the shard of key: the last one whose lower bound is <= key. */
+static inline int _shard_find(shard_map_t *map, tree_key_t key)
+{
+	int lo = 0, hi = map->nr - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (map->lo[mid] <= key)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+static inline shard_map_t *_shard_map(sharded_t *sh)
+{
+	return __atomic_load_n(&sh->map, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Announces an update of s. Returns 0 if s is frozen; the caller then routes
+ * its keys again.
+ */
+static inline int _shard_write_enter(shard_thread_data_t *data, shard_t *s)
+{
+	__atomic_store_n(&data->writing, s, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&s->frozen, __ATOMIC_SEQ_CST))
+		return 1;
+	__atomic_store_n(&data->writing, NULL, __ATOMIC_RELEASE);
+	sched_yield();
+	return 0;
+}
+
+static inline void _shard_write_exit(shard_thread_data_t *data)
+{
+	__atomic_store_n(&data->writing, NULL, __ATOMIC_RELEASE);
+}
+
+/* Routes key and announces an update of its shard. */
+static shard_t *_shard_write_begin(sharded_t *sh, shard_thread_data_t *data, tree_key_t key)
+{
+	shard_map_t *map;
+	shard_t *s;
+
+	do {
+		map = _shard_map(sh);
+		s = map->shards[_shard_find(map, key)];
+	} while (!_shard_write_enter(data, s));
+	return s;
+}
+
+static void _shard_wait_writers(shard_t *s)
+{
+	shard_thread_data_t *t;
+
+	for (t = __atomic_load_n(&shard_threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next)
+		while (__atomic_load_n(&t->writing, __ATOMIC_SEQ_CST) == s)
+			sched_yield();
+}
+
+typedef struct {
+	tree_key_t *keys;
+	tree_value_t *values;
+	long nr, size;
+} shard_copy_t;
+
+static int _shard_copy_cb(tree_key_t key, tree_value_t value, void *arg)
+{
+	shard_copy_t *copy = arg;
+
+	if (copy->nr == copy->size) {
+		copy->size *= 2;
+		copy->keys = realloc(copy->keys, copy->size * sizeof(*copy->keys));
+		copy->values = realloc(copy->values, copy->size * sizeof(*copy->values));
+		if (copy->keys == NULL || copy->values == NULL) {
+			fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+			exit(1);
+		}
+	}
+	copy->keys[copy->nr] = key;
+	copy->values[copy->nr++] = value;
+	return 0;
+}
+
+/*
+ * Replaces the nr_old shards from first on with nr_new shards that share
+ * their keys evenly. Called with sh->lock held and without an announced
+ * update.
+ */
+static void _shard_repartition(sharded_t *sh, shard_thread_data_t *data, int first, int nr_old,
+                               int nr_new)
+{
+	shard_map_t *map = sh->map, *new_map;
+	shard_copy_t copy;
+	long from, to;
+	int i;
+
+	for (i = first; i < first + nr_old; i++)
+		__atomic_store_n(&map->shards[i]->frozen, 1, __ATOMIC_SEQ_CST);
+	for (i = first; i < first + nr_old; i++)
+		_shard_wait_writers(map->shards[i]);
+
+	copy.nr = 0;
+	copy.size = 1024;
+	SHARD_XMALLOC(copy.keys, copy.size);
+	SHARD_XMALLOC(copy.values, copy.size);
+	for (i = first; i < first + nr_old; i++)
+		sh->base->range_scan(map->shards[i]->tree, data->data, KEY_MIN, KEY_MAX,
+		                     RANGE_SCAN_WEAK, _shard_copy_cb, &copy);
+
+	new_map = _shard_map_new(map->nr - nr_old + nr_new);
+	memcpy(new_map->lo, map->lo, first * sizeof(*map->lo));
+	memcpy(new_map->shards, map->shards, first * sizeof(*map->shards));
+	for (i = 0; i < nr_new; i++) {
+		from = copy.nr * i / nr_new;
+		to = copy.nr * (i + 1) / nr_new;
+		new_map->lo[first + i] = (i == 0) ? map->lo[first] : copy.keys[from];
+		new_map->shards[first + i] = _shard_new(sh);
+		sh->base->bulk_load(new_map->shards[first + i]->tree, copy.keys + from,
+		                    copy.values + from, to - from, 1);
+	}
+	memcpy(new_map->lo + first + nr_new, map->lo + first + nr_old,
+	       (map->nr - first - nr_old) * sizeof(*map->lo));
+	memcpy(new_map->shards + first + nr_new, map->shards + first + nr_old,
+	       (map->nr - first - nr_old) * sizeof(*map->shards));
+	new_map->prev = map;
+	__atomic_store_n(&sh->map, new_map, __ATOMIC_RELEASE);
+
+	free(copy.keys);
+	free(copy.values);
+}
+
+/*
+ * Splits the largest shard if it holds SHARD_SKEW times the average, or evens
+ * it out with its smaller neighbour if that holds less than half as much.
+ */
+static void _shard_balance(sharded_t *sh, shard_thread_data_t *data)
+{
+	shard_map_t *map;
+	long size, total = 0, max = -1;
+	int i, largest = 0, neighbour;
+
+	if (pthread_mutex_trylock(&sh->lock) != 0)
+		return;
+
+	map = sh->map;
+	for (i = 0; i < map->nr; i++) {
+		size = sh->base->size(map->shards[i]->tree);
+		total += size;
+		if (size > max) {
+			max = size;
+			largest = i;
+		}
+	}
+	if (max > 1 && max * map->nr > SHARD_SKEW * total) {
+		if (map->nr < sh->nr_max) {
+			_shard_repartition(sh, data, largest, 1, 2);
+		} else {
+			if (largest == 0)
+				neighbour = 1;
+			else if (largest == map->nr - 1)
+				neighbour = largest - 1;
+			else
+				neighbour = (sh->base->size(map->shards[largest - 1]->tree) <
+				             sh->base->size(map->shards[largest + 1]->tree)) ?
+				            largest - 1 : largest + 1;
+			if (sh->base->size(map->shards[neighbour]->tree) * 2 < max)
+				_shard_repartition(sh, data, (neighbour < largest) ? neighbour : largest,
+				                   2, 2);
+		}
+	}
+	pthread_mutex_unlock(&sh->lock);
+}
+
+static inline void _shard_updated(sharded_t *sh, shard_thread_data_t *data, int n)
+{
+	data->nr_updates += n;
+	if (data->nr_updates >= SHARD_CHECK_PERIOD) {
+		data->nr_updates = 0;
+		_shard_balance(sh, data);
+	}
+}
+
+/* Lower bounds that split [0, max_key) evenly; negative keys go to shard 0. */
+static void _shard_bounds_uniform(shard_map_t *map, tree_key_t max_key)
+{
+	int i;
+
+	map->lo[0] = KEY_MIN;
+	for (i = 1; i < map->nr; i++)
+		map->lo[i] = max_key / map->nr * i;
+}
+
+static void *_shard_tree_new(const tree_ops_t *base)
+{
+	sharded_t *sh;
+	int i;
+
+	SHARD_XMALLOC(sh, 1);
+	sh->base = base;
+	sh->nr_max = shard_nr * SHARD_MAX_FACTOR;
+	if (sh->nr_max > SHARD_MAX_NR)
+		sh->nr_max = SHARD_MAX_NR;
+	pthread_mutex_init(&sh->lock, NULL);
+	sh->data = base->thread_data_new(0);
+	sh->cm_policy = -1;
+	sh->cm_yield_after = 0;
+	sh->map = _shard_map_new(shard_nr);
+	_shard_bounds_uniform(sh->map, KEY_MAX);
+	for (i = 0; i < shard_nr; i++)
+		sh->map->shards[i] = _shard_new(sh);
+	return sh;
+}
+
+static void *_shard_thread_data_new(const tree_ops_t *base, int tid)
+{
+	shard_thread_data_t *data;
+
+	data = aligned_alloc(SHARD_CACHE_LINE_SIZE, sizeof(*data));
+	if (data == NULL) {
+		fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+		exit(1);
+	}
+	data->writing = NULL;
+	data->base = base;
+	data->data = base->thread_data_new(tid);
+	data->nr_updates = 0;
+	data->next = __atomic_load_n(&shard_threads, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&shard_threads, &data->next, data, 1,
+	                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return data;
+}
+
+#define SHARD_DEFINE(p, id)							\
+void *p##_new(void)								\
+{										\
+	return _shard_tree_new(_shard_base(id));				\
+}										\
+										\
+void *p##_thread_data_new(int tid)						\
+{										\
+	return _shard_thread_data_new(_shard_base(id), tid);			\
+}										\
+										\
+int p##_numa_policy(int policy)							\
+{										\
+	return _shard_base(id)->numa_policy(policy);				\
+}										\
+										\
+char *p##_name(void)								\
+{										\
+	return #p;								\
+}
+
+SHARD_DEFINE(shard_bst, "bst")
+SHARD_DEFINE(shard_avl, "avl")
+
+/*
+ * Number of shards of the sharded trees created afterwards (1 to
+ * SHARD_MAX_NR / SHARD_MAX_FACTOR). Returns the number in effect.
+ */
+int shard_config(int nr_shards)
+{
+	if (nr_shards >= 1 && nr_shards <= SHARD_MAX_NR / SHARD_MAX_FACTOR)
+		shard_nr = nr_shards;
+	return shard_nr;
+}
+
+void shard_thread_data_print(void *thread_data)
+{
+	shard_thread_data_t *data = thread_data;
+
+	data->base->thread_data_print(data->data);
+}
+
+void shard_thread_data_add(void *d1, void *d2, void *dst)
+{
+	shard_thread_data_t *data1 = d1, *data2 = d2, *dst_data = dst;
+
+	data1->base->thread_data_add(data1->data, data2->data, dst_data->data);
+}
+
+int shard_lookup(void *tree, void *thread_data, tree_key_t key)
+{
+	sharded_t *sh = tree;
+	shard_map_t *map;
+	int ret;
+
+	do {
+		map = _shard_map(sh);
+		ret = sh->base->lookup(map->shards[_shard_find(map, key)]->tree,
+		                       ((shard_thread_data_t *)thread_data)->data, key);
+	} while (_shard_map(sh) != map);
+	return ret;
+}
+
+int shard_get(void *tree, void *thread_data, tree_key_t key, tree_value_t *value)
+{
+	sharded_t *sh = tree;
+	shard_map_t *map;
+	int ret;
+
+	do {
+		map = _shard_map(sh);
+		ret = sh->base->get(map->shards[_shard_find(map, key)]->tree,
+		                    ((shard_thread_data_t *)thread_data)->data, key, value);
+	} while (_shard_map(sh) != map);
+	return ret;
+}
+
+int shard_insert(void *tree, void *thread_data, tree_key_t key, tree_value_t value)
+{
+	shard_thread_data_t *data = thread_data;
+	sharded_t *sh = tree;
+	shard_t *s;
+	int ret;
+
+	s = _shard_write_begin(sh, data, key);
+	ret = sh->base->insert(s->tree, data->data, key, value);
+	_shard_write_exit(data);
+	_shard_updated(sh, data, ret);
+	return ret;
+}
+
+int shard_delete(void *tree, void *thread_data, tree_key_t key)
+{
+	shard_thread_data_t *data = thread_data;
+	sharded_t *sh = tree;
+	shard_t *s;
+	int ret;
+
+	s = _shard_write_begin(sh, data, key);
+	ret = sh->base->delete(s->tree, data->data, key);
+	_shard_write_exit(data);
+	_shard_updated(sh, data, ret);
+	return ret;
+}
+
+int shard_put(void *tree, void *thread_data, tree_key_t key, tree_value_t value,
+              tree_value_t *old_value)
+{
+	shard_thread_data_t *data = thread_data;
+	sharded_t *sh = tree;
+	shard_t *s;
+	int ret;
+
+	s = _shard_write_begin(sh, data, key);
+	ret = sh->base->put(s->tree, data->data, key, value, old_value);
+	_shard_write_exit(data);
+	_shard_updated(sh, data, ret);
+	return ret;
+}
+
+static int _shard_slot_cmp(const void *a, const void *b)
+{
+	const shard_slot_t *s1 = a, *s2 = b;
+
+	if (s1->shard != s2->shard)
+		return s1->shard - s2->shard;
+	return s1->idx - s2->idx;
+}
+
+/* Sorts the indices of keys[0, n) by the shard of their key in map. */
+static shard_slot_t *_shard_group(shard_map_t *map, tree_key_t *keys, int n)
+{
+	shard_slot_t *slots;
+	int i;
+
+	SHARD_XMALLOC(slots, n + 1);
+	for (i = 0; i < n; i++) {
+		slots[i].shard = _shard_find(map, keys[i]);
+		slots[i].idx = i;
+	}
+	qsort(slots, n, sizeof(*slots), _shard_slot_cmp);
+	return slots;
+}
+
+/* Issues the keys of each shard as one lookup_batch of the base tree. */
+int shard_lookup_batch(void *tree, void *thread_data, tree_key_t *keys, int n, int *results)
+{
+	sharded_t *sh = tree;
+	shard_map_t *map;
+	shard_slot_t *slots;
+	tree_key_t *group_keys;
+	int *group_results;
+	int i, j, k, ret;
+
+	SHARD_XMALLOC(group_keys, n + 1);
+	SHARD_XMALLOC(group_results, n + 1);
+	do {
+		map = _shard_map(sh);
+		slots = _shard_group(map, keys, n);
+		for (i = 0, ret = 0; i < n; i = j) {
+			for (j = i; j < n && slots[j].shard == slots[i].shard; j++)
+				group_keys[j - i] = keys[slots[j].idx];
+			ret += sh->base->lookup_batch(map->shards[slots[i].shard]->tree,
+			                              ((shard_thread_data_t *)thread_data)->data,
+			                              group_keys, j - i, group_results);
+			for (k = i; k < j; k++)
+				results[slots[k].idx] = group_results[k - i];
+		}
+		free(slots);
+	} while (_shard_map(sh) != map);
+	free(group_keys);
+	free(group_results);
+	return ret;
+}
+
+/*
+ * Issues the keys of each shard as one batch of the base tree. The keys of a
+ * shard that is frozen meanwhile are issued one at a time instead.
+ */
+static int _shard_update_batch(sharded_t *sh, shard_thread_data_t *data, tree_key_t *keys,
+                               tree_value_t *values, int n, int insert)
+{
+	shard_map_t *map = _shard_map(sh);
+	shard_slot_t *slots = _shard_group(map, keys, n);
+	tree_key_t *group_keys;
+	tree_value_t *group_values;
+	shard_t *s;
+	int i, j, k, ret = 0, nr_done;
+
+	SHARD_XMALLOC(group_keys, n + 1);
+	SHARD_XMALLOC(group_values, n + 1);
+	for (i = 0; i < n; i = j) {
+		for (j = i; j < n && slots[j].shard == slots[i].shard; j++) {
+			group_keys[j - i] = keys[slots[j].idx];
+			group_values[j - i] = (values != NULL) ? values[slots[j].idx] : VALUE_NONE;
+		}
+		s = map->shards[slots[i].shard];
+		if (_shard_write_enter(data, s)) {
+			nr_done = insert ?
+			          sh->base->insert_batch(s->tree, data->data, group_keys, group_values, j - i) :
+			          sh->base->delete_batch(s->tree, data->data, group_keys, j - i);
+			_shard_write_exit(data);
+			_shard_updated(sh, data, nr_done);
+			ret += nr_done;
+			continue;
+		}
+		for (k = 0; k < j - i; k++)
+			ret += insert ? shard_insert(sh, data, group_keys[k], group_values[k]) :
+			                shard_delete(sh, data, group_keys[k]);
+	}
+	free(slots);
+	free(group_keys);
+	free(group_values);
+	return ret;
+}
+
+int shard_insert_batch(void *tree, void *thread_data, tree_key_t *keys, tree_value_t *values, int n)
+{
+	return _shard_update_batch(tree, thread_data, keys, values, n, 1);
+}
+
+int shard_delete_batch(void *tree, void *thread_data, tree_key_t *keys, int n)
+{
+	return _shard_update_batch(tree, thread_data, keys, NULL, n, 0);
+}
+
+typedef struct {
+	range_scan_cb_t cb;
+	void *arg;
+	tree_key_t end;			//> Keys from end on belong to the next shard
+	int bounded;			//> Zero in the last shard, which has no end
+	int nr_keys;
+	int stopped;
+} shard_scan_t;
+
+/*
+ * The upper bound of a shard is exclusive, and lo[i + 1] - 1 is not the
+ * largest key below lo[i + 1] unless KEY_TYPE is an integer. The scan of a
+ * shard therefore runs up to hi and is cut off here at the next shard.
+ */
+static int _shard_scan_cb(tree_key_t key, tree_value_t value, void *arg)
+{
+	shard_scan_t *scan = arg;
+
+	if (scan->bounded && key >= scan->end)
+		return 1;
+	scan->nr_keys++;
+	scan->stopped = scan->cb(key, value, scan->arg);
+	return scan->stopped;
+}
+
+/* Scans the shards that overlap [lo, hi] in key order. */
+int shard_range_scan(void *tree, void *thread_data, tree_key_t lo, tree_key_t hi, int mode,
+                     range_scan_cb_t cb, void *arg)
+{
+	sharded_t *sh = tree;
+	shard_map_t *map = _shard_map(sh);
+	shard_scan_t scan = { cb, arg, KEY_MAX, 0, 0, 0 };
+	tree_key_t shard_lo;
+	int i;
+
+	for (i = _shard_find(map, lo); i < map->nr && map->lo[i] <= hi && !scan.stopped; i++) {
+		shard_lo = (map->lo[i] > lo) ? map->lo[i] : lo;
+		scan.bounded = (i + 1 < map->nr);
+		if (scan.bounded)
+			scan.end = map->lo[i + 1];
+		sh->base->range_scan(map->shards[i]->tree, ((shard_thread_data_t *)thread_data)->data,
+		                     shard_lo, hi, mode, _shard_scan_cb, &scan);
+	}
+	return scan.nr_keys;
+}
+
+long shard_size(void *tree)
+{
+	sharded_t *sh = tree;
+	shard_map_t *map = _shard_map(sh);
+	long size = 0;
+	int i;
+
+	for (i = 0; i < map->nr; i++)
+		size += sh->base->size(map->shards[i]->tree);
+	return size;
+}
+
+static int _shard_count_cb(tree_key_t key, tree_value_t value, void *arg)
+{
+	(*(long *)arg)++;
+	return 0;
+}
+
+typedef struct {
+	tree_key_t lo;
+	long *count;
+} shard_below_t;
+
+/* Counts the keys below lo, which the scan of [KEY_MIN, lo] ends with. */
+static int _shard_below_cb(tree_key_t key, tree_value_t value, void *arg)
+{
+	shard_below_t *below = arg;
+
+	if (key >= below->lo)
+		return 1;
+	(*below->count)++;
+	return 0;
+}
+
+/*
+ * Sets the contention manager of every shard and of the shards that later
+ * repartitions create, see *_contention of the base tree.
+ */
+int shard_contention(void *tree, int policy, int yield_after)
+{
+	sharded_t *sh = tree;
+	shard_map_t *map;
+	int i, ret = 1;
+
+	pthread_mutex_lock(&sh->lock);
+	map = _shard_map(sh);
+	for (i = 0; i < map->nr; i++)
+		ret &= sh->base->contention(map->shards[i]->tree, policy, yield_after);
+	if (ret) {
+		sh->cm_policy = policy;
+		sh->cm_yield_after = yield_after;
+	}
+	pthread_mutex_unlock(&sh->lock);
+	return ret;
+}
+
+/* Validates every shard and checks that it only holds keys of its range. */
+int shard_validate(void *tree)
+{
+	sharded_t *sh = tree;
+	shard_map_t *map = _shard_map(sh);
+	long size, min = -1, max = 0, outside = 0;
+	shard_below_t below = { KEY_MIN, &outside };
+	int i, valid = 1;
+
+	for (i = 0; i < map->nr; i++) {
+		valid &= sh->base->validate(map->shards[i]->tree);
+		if (i > 0) {
+			below.lo = map->lo[i];
+			sh->base->range_scan(map->shards[i]->tree, sh->data, KEY_MIN, map->lo[i],
+			                     RANGE_SCAN_WEAK, _shard_below_cb, &below);
+		}
+		if (i + 1 < map->nr)
+			sh->base->range_scan(map->shards[i]->tree, sh->data, map->lo[i + 1], KEY_MAX,
+			                     RANGE_SCAN_WEAK, _shard_count_cb, &outside);
+		size = sh->base->size(map->shards[i]->tree);
+		if (min < 0 || size < min)
+			min = size;
+		if (size > max)
+			max = size;
+	}
+	printf("Shards: %d, %ld to %ld keys each\n", map->nr, min, max);
+	printf("  Keys outside their shard: %ld %s\n", outside, (outside == 0) ? "[OK]" : "[BAD]");
+	return valid && outside == 0;
+}
+
+/*
+ * Splits [0, max_key) evenly among the shards of an empty tree and inserts
+ * the same keys as the warmup of the base tree.
+ */
+int shard_warmup(void *tree, int nr_nodes, int max_key, unsigned int seed, int force)
+{
+	sharded_t *sh = tree;
+	shard_map_t *map = _shard_map(sh);
+	int key, nodes_inserted = 0;
+
+	if (shard_size(sh) == 0)
+		_shard_bounds_uniform(map, max_key);
+	srand(seed);
+	while (nodes_inserted < nr_nodes) {
+		key = rand() % max_key;
+		nodes_inserted += sh->base->insert(map->shards[_shard_find(map, key)]->tree, sh->data,
+		                                   key, VALUE_NONE);
+	}
+	return nodes_inserted;
+}
+
+/*
+ * Places the shard boundaries at the quantiles of keys and bulk loads each
+ * shard. The same restrictions as for the bulk_load of the base tree apply.
+ * Returns n, or 0 if the tree is not empty or the keys are not sorted.
+ */
+int shard_bulk_load(void *tree, tree_key_t *keys, tree_value_t *values, int n, int nr_threads)
+{
+	sharded_t *sh = tree;
+	shard_map_t *map = _shard_map(sh);
+	long from, to;
+	int i, ret = 0;
+
+	if (shard_size(sh) != 0)
+		return 0;
+	for (i = 1; i < n; i++)
+		if (keys[i - 1] >= keys[i])
+			return 0;
+	for (i = 0; i < map->nr; i++) {
+		from = (long)n * i / map->nr;
+		to = (long)n * (i + 1) / map->nr;
+		if (i > 0)
+			map->lo[i] = (to > from) ? keys[from] : map->lo[i - 1] + 1;
+		ret += sh->base->bulk_load(map->shards[i]->tree, keys + from,
+		                           (values != NULL) ? values + from : NULL, to - from, nr_threads);
+	}
+	return ret;
+}
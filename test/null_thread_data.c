@@ -0,0 +1,81 @@
+/*
+ * Updates without thread data (see _*_enter) must give unlinked nodes back
+ * the way they were allocated, whether a thread pool or the array of a bulk
+ * load holds them. The test deletes such nodes without thread data, inserts
+ * again and checks the tree; a node handed to free() aborts it.
+ *
+ * Built against the BST, or with -DTEST_AVL against the AVL tree; `make
+ * check` runs both. Exits non-zero on failure.
+ */
+
+#include <stdio.h>
+
+#ifdef TEST_AVL
+#include "../avl-log-order/avl_logical_ordering.c"
+#define TREE_NAME "avl"
+#define tree_new avl_new
+#define tree_thread_data_new avl_thread_data_new
+#define tree_insert avl_insert
+#define tree_delete avl_delete
+#define tree_bulk_load avl_bulk_load
+#define tree_size avl_size
+#define tree_validate avl_validate
+#else
+#include "../bst-log-order/bst_log_order_fg_spinlock.c"
+#define TREE_NAME "bst"
+#define tree_new rbt_new
+#define tree_thread_data_new rbt_thread_data_new
+#define tree_insert rbt_insert
+#define tree_delete rbt_delete
+#define tree_bulk_load rbt_bulk_load
+#define tree_size rbt_size
+#define tree_validate rbt_validate
+#endif
+
+#define NR_KEYS 256
+
+static int nr_failed;
+
+static void check(const char *what, int ok)
+{
+	printf("  %-40s %s\n", what, ok ? "[OK]" : "[FAILED]");
+	if (!ok)
+		nr_failed++;
+}
+
+static int delete_range(void *tree, void *data, int lo, int hi)
+{
+	int key, nr = 0;
+
+	for (key = lo; key < hi; key++)
+		nr += tree_delete(tree, data, key);
+	return nr;
+}
+
+int main(void)
+{
+	void *tree = tree_new();
+	void *data = tree_thread_data_new(0);
+	tree_key_t keys[NR_KEYS];
+	int i, nr;
+
+	printf("Deletes without thread data (%s):\n", TREE_NAME);
+	for (i = 0; i < NR_KEYS; i++)
+		keys[i] = i;
+	check("bulk load", tree_bulk_load(tree, keys, NULL, NR_KEYS, 1) == NR_KEYS);
+	check("delete bulk loaded nodes", delete_range(tree, NULL, 0, NR_KEYS / 2) == NR_KEYS / 2);
+
+	for (i = 0, nr = 0; i < NR_KEYS / 2; i++)
+		nr += tree_insert(tree, data, i, (tree_value_t)(long)i);
+	check("insert with thread data", nr == NR_KEYS / 2);
+	check("delete pool nodes", delete_range(tree, NULL, 0, NR_KEYS / 4) == NR_KEYS / 4);
+
+	for (i = 0, nr = 0; i < NR_KEYS / 4; i++)
+		nr += tree_insert(tree, NULL, i, (tree_value_t)(long)i);
+	check("insert without thread data", nr == NR_KEYS / 4);
+	check("delete them with thread data", delete_range(tree, data, 0, NR_KEYS / 8) == NR_KEYS / 8);
+
+	check("size", tree_size(tree) == NR_KEYS - NR_KEYS / 8);
+	check("valid tree", tree_validate(tree));
+	return nr_failed != 0;
+}
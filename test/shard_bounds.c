@@ -0,0 +1,58 @@
+/*
+ * Shard i holds the keys in [lo[i], lo[i + 1]), an upper bound that is
+ * exclusive for every KEY_TYPE. The test fills shards of a tree with
+ * fractional keys right below the shard boundaries and checks that range
+ * scans across the boundaries report all of them.
+ *
+ * Built with KEY_TYPE double against the sharded BST; `make check` runs it.
+ * Exits non-zero on failure.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../bench/trees.h"
+
+#define NR_SHARDS 4
+#define MAX_KEY 100
+
+static int nr_failed;
+
+static int _count_cb(tree_key_t key, tree_value_t value, void *arg)
+{
+	(*(int *)arg)++;
+	return 0;
+}
+
+static void check(const char *what, int ok)
+{
+	printf("  %-40s %s\n", what, ok ? "[OK]" : "[FAILED]");
+	if (!ok)
+		nr_failed++;
+}
+
+int main(void)
+{
+	void *tree, *data;
+	tree_key_t key;
+	int n, ret;
+
+	shard_config(NR_SHARDS);
+	tree = shard_bst_new();
+	data = shard_bst_thread_data_new(0);
+	shard_warmup(tree, 0, MAX_KEY, 0, 0);	//> Boundaries at 25, 50 and 75
+	for (key = 0.5; key < MAX_KEY; key += 1)
+		shard_insert(tree, data, key, (tree_value_t)1L);
+
+	printf("Shard boundaries with fractional keys:\n");
+	n = 0;
+	ret = shard_range_scan(tree, data, 0, MAX_KEY, RANGE_SCAN_WEAK, _count_cb, &n);
+	check("weak scan reports every key", n == MAX_KEY && ret == n);
+
+	n = 0;
+	ret = shard_range_scan(tree, data, 10, 60.2, RANGE_SCAN_LINEARIZABLE, _count_cb, &n);
+	check("linearizable scan of [10, 60.2]", n == 50 && ret == n);
+
+	check("shards hold only their own keys", shard_validate(tree));
+	return nr_failed != 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Snapshots must order the updates that a lookup or get has observed before
+ * the snapshot began (see snapshot.h). The test pauses an insert and a delete
+ * right after their linearization point by clearing the stamp that the
+ * update would write next, lets a reader observe the update, and checks that
+ * a snapshot opened afterwards agrees with the reader.
+ *
+ * Built with -DTREE_SNAPSHOT, against the BST or with -DTEST_AVL against the
+ * AVL tree; `make check` runs both. Exits non-zero on failure.
+ */
+
+#include <stdio.h>
+
+#ifdef TEST_AVL
+#include "../avl-log-order/avl_logical_ordering.c"
+#define TREE_NAME "avl"
+#define tree_new avl_new
+#define tree_thread_data_new avl_thread_data_new
+#define tree_insert avl_insert
+#define tree_lookup avl_lookup
+#define tree_get avl_get
+#define tree_snapshot_open avl_snapshot_open
+#define tree_snapshot_next avl_snapshot_next
+#define tree_snapshot_close avl_snapshot_close
+#define tree_locate _avl_locate
+#else
+#include "../bst-log-order/bst_log_order_fg_spinlock.c"
+#define TREE_NAME "bst"
+#define tree_new rbt_new
+#define tree_thread_data_new rbt_thread_data_new
+#define tree_insert rbt_insert
+#define tree_lookup rbt_lookup
+#define tree_get rbt_get
+#define tree_snapshot_open rbt_snapshot_open
+#define tree_snapshot_next rbt_snapshot_next
+#define tree_snapshot_close rbt_snapshot_close
+#define tree_locate _bst_locate
+#endif
+
+static int nr_failed;
+
+static int snapshot_has(void *tree, void *data, tree_key_t key)
+{
+	void *snap = tree_snapshot_open(tree, data);
+	tree_key_t k;
+	int found = 0;
+
+	while (tree_snapshot_next(snap, &k, NULL))
+		if (k == key)
+			found = 1;
+	tree_snapshot_close(snap);
+	return found;
+}
+
+static void check(const char *what, int ok)
+{
+	printf("  %-40s %s\n", what, ok ? "[OK]" : "[FAILED]");
+	if (!ok)
+		nr_failed++;
+}
+
+/* Inserts key as far as its linearization point, without the stamp. */
+static void insert_unstamped(void *tree, void *data, tree_key_t key)
+{
+	tree_insert(tree, data, key, (tree_value_t)(long)key);
+	COLD(tree_locate(tree, key))->ins_ts = SNAPSHOT_TS_PENDING;
+}
+
+/* Marks the node of key deleted, leaving it linked and unstamped. */
+static void delete_unstamped(void *tree, tree_key_t key)
+{
+	typeof(tree_locate(tree, key)) node = tree_locate(tree, key);
+
+	version_write_begin(&node->version);
+	version_write_end(&node->version, VERSION_DELETED);
+}
+
+int main(void)
+{
+	void *tree = tree_new();
+	void *data = tree_thread_data_new(0);
+	tree_value_t value;
+	tree_key_t key;
+
+	printf("Snapshots after readers (%s):\n", TREE_NAME);
+	for (key = 1; key <= 3; key++)
+		tree_insert(tree, data, key, (tree_value_t)(long)key);
+
+	insert_unstamped(tree, data, 10);
+	check("lookup finds a pending insert", tree_lookup(tree, data, 10));
+	check("a later snapshot contains it", snapshot_has(tree, data, 10));
+
+	insert_unstamped(tree, data, 20);
+	check("get finds a pending insert", tree_get(tree, data, 20, &value) && value == (tree_value_t)20L);
+	check("a later snapshot contains it", snapshot_has(tree, data, 20));
+
+	delete_unstamped(tree, 2);
+	check("lookup misses a pending delete", !tree_lookup(tree, data, 2));
+	check("a later snapshot misses it", !snapshot_has(tree, data, 2));
+
+	delete_unstamped(tree, 3);
+	check("get misses a pending delete", !tree_get(tree, data, 3, &value));
+	check("a later snapshot misses it", !snapshot_has(tree, data, 3));
+
+	return nr_failed != 0;
+}